@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "../db.h"
+#include "../sdbsc.h"
+
+/*
+ *  sdb_bench times the sdbsc functions in process, on student.db in the
+ *  current directory, and writes the results as JSON:
+ *
+ *      sdb_bench [-f load.csv] [-n ops] [-r reps] [-s seed] [-o out.json]
+ *                [engine options]
+ *
+ *  The database is emptied and loaded from the -f file (see sdb_gen), then
+ *  ops adds of free ids, ops gets and ops deletes of present ids are timed
+ *  one call at a time, and count, print and compress reps times each.  For
+ *  every operation the JSON has the number of calls that succeeded, their
+ *  total time, throughput and p50/p99 latency in microseconds, and the
+ *  number of calls that failed, which are not timed.  Engine options such
+ *  as --mmap or --no-wal are taken just like sdbsc takes them.
+ *
+ *  What the functions print goes to /dev/null.
+ */
+
+#define BENCH_OPS   10000
+#define BENCH_REPS  10
+
+typedef struct bench_op {
+    const char *name;
+    double     *lat_us;             //one entry per successful call
+    int        n;
+    int        failed;              //calls that returned an error
+} bench_op_t;
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+
+    return (da > db) - (da < db);
+}
+
+static void shuffle(int *ids, int n)
+{
+    int i;
+
+    for (i = n - 1; i > 0; i--)
+    {
+        int j = rand() % (i + 1);
+        int t = ids[i];
+
+        ids[i] = ids[j];
+        ids[j] = t;
+    }
+}
+
+static int collect_id(const student_t *s, off_t slot, void *arg)
+{
+    bool *present = arg;
+
+    (void)slot;
+    if ((s->id >= MIN_STD_ID) && (s->id <= MAX_STD_ID))
+        present[s->id] = true;
+    return NO_ERROR;
+}
+
+// count the call that started at start as a success or a failure
+static void op_done(bench_op_t *op, double start, bool ok)
+{
+    double t = now_us() - start;
+
+    if (ok)
+        op->lat_us[op->n++] = t;
+    else
+        op->failed++;
+}
+
+static void op_report(FILE *out, bench_op_t *op, bool last)
+{
+    double total = 0;
+    int i;
+
+    for (i = 0; i < op->n; i++)
+        total += op->lat_us[i];
+    qsort(op->lat_us, op->n, sizeof(double), cmp_double);
+
+    fprintf(out, "    \"%s\": {\"ops\": %d, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+            "\"p50_us\": %.2f, \"p99_us\": %.2f, \"failed\": %d}%s\n",
+            op->name, op->n, total / 1e6,
+            (total > 0) ? op->n / (total / 1e6) : 0.0,
+            (op->n > 0) ? op->lat_us[(op->n - 1) / 2] : 0.0,
+            (op->n > 0) ? op->lat_us[(int)((op->n - 1) * 0.99)] : 0.0,
+            op->failed, last ? "" : ",");
+}
+
+static void bench_usage(const char *exename)
+{
+    fprintf(stderr, "usage: %s [-f load.csv] [-n ops] [-r reps] [-s seed] [-o out.json] "
+            "[engine options]\n", exename);
+}
+
+int main(int argc, char *argv[])
+{
+    static bool present[MAX_STD_ID + 1];
+    const char *load_file = NULL;
+    const char *out_path = NULL;
+    bench_op_t ops[] = {
+        { "add", NULL, 0, 0 }, { "get", NULL, 0, 0 }, { "count", NULL, 0, 0 },
+        { "print", NULL, 0, 0 }, { "del", NULL, 0, 0 }, { "compress", NULL, 0, 0 },
+    };
+    int nops = (int)(sizeof(ops) / sizeof(ops[0]));
+    int count = BENCH_OPS;
+    int reps = BENCH_REPS;
+    int *have;
+    int *avail;
+    int nhave = 0;
+    int navail = 0;
+    int records = 0;
+    double load_us = 0;
+    FILE *out;
+    int fd;
+    int opt;
+    int i;
+
+    argc = parse_engine_opts(argc, argv);
+    if (argc < 0)
+    {
+        bench_usage(argv[0]);
+        return 2;
+    }
+
+    while ((opt = getopt(argc, argv, "f:n:r:s:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            load_file = optarg;
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 's':
+            srand((unsigned int)atoi(optarg));
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        default:
+            bench_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    // the results go to the real stdout or -o, everything the functions
+    // print goes nowhere
+    out = (out_path != NULL) ? fopen(out_path, "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || freopen("/dev/null", "w", stdout) == NULL)
+    {
+        fprintf(stderr, "%s: cannot open the output\n", argv[0]);
+        return 1;
+    }
+
+    have = malloc((MAX_STD_ID + 1) * sizeof(int));
+    avail = malloc((MAX_STD_ID + 1) * sizeof(int));
+    if (have == NULL || avail == NULL)
+    {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+    for (i = 0; i < nops; i++)
+    {
+        ops[i].lat_us = malloc((count > reps ? count : reps) * sizeof(double));
+        if (ops[i].lat_us == NULL)
+        {
+            fprintf(stderr, "%s: out of memory\n", argv[0]);
+            return 1;
+        }
+    }
+
+    fd = open_db(DB_FILE, true);
+    if (fd < 0)
+    {
+        fprintf(stderr, "%s: cannot open %s\n", argv[0], DB_FILE);
+        return 1;
+    }
+
+    if (load_file != NULL)
+    {
+        double t = now_us();
+
+        records = bulk_load(fd, (char *)load_file);
+        load_us = now_us() - t;
+        if (records < 0)
+        {
+            fprintf(stderr, "%s: cannot load %s\n", argv[0], load_file);
+            return 1;
+        }
+    }
+
+    if (db_scan(fd, collect_id, present) != NO_ERROR)
+    {
+        fprintf(stderr, "%s: cannot read %s\n", argv[0], DB_FILE);
+        return 1;
+    }
+    for (i = MIN_STD_ID; i <= MAX_STD_ID; i++)
+    {
+        if (present[i])
+            have[nhave++] = i;
+        else
+            avail[navail++] = i;
+    }
+    shuffle(have, nhave);
+    shuffle(avail, navail);
+
+    for (i = 0; i < count && i < navail; i++)
+    {
+        double t = now_us();
+        bool ok = add_student(fd, avail[i], "bench", "mark",
+                              rand() % (MAX_STD_GPA + 1)) == NO_ERROR;
+
+        op_done(&ops[0], t, ok);
+        if (ok)
+            have[nhave++] = avail[i];
+    }
+    shuffle(have, nhave);
+
+    for (i = 0; i < count && nhave > 0; i++)
+    {
+        student_t s;
+        double t = now_us();
+
+        op_done(&ops[1], t, get_student(fd, have[rand() % nhave], &s) == NO_ERROR);
+    }
+
+    for (i = 0; i < reps; i++)
+    {
+        double t = now_us();
+        bool ok = count_db_records(fd) >= 0;
+
+        op_done(&ops[2], t, ok);
+
+        t = now_us();
+        ok = print_db(fd) == NO_ERROR;
+        fflush(stdout);
+        op_done(&ops[3], t, ok);
+    }
+
+    for (i = 0; i < count && i < nhave; i++)
+    {
+        double t = now_us();
+
+        op_done(&ops[4], t, del_student(fd, have[i]) == NO_ERROR);
+    }
+
+    for (i = 0; i < reps && fd >= 0; i++)
+    {
+        double t = now_us();
+
+        fd = compress_db(fd);
+        op_done(&ops[5], t, fd >= 0);
+    }
+    if (fd >= 0)
+        close_db(fd);
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"records\": %d,\n", records);
+    fprintf(out, "  \"engine\": {\"mmap\": %s, \"wal\": %s, \"sync\": %d, \"scan_threads\": %d},\n",
+            sdb_config.use_mmap ? "true" : "false", sdb_config.use_wal ? "true" : "false",
+            sdb_config.sync_policy, sdb_config.scan_threads);
+    fprintf(out, "  \"load\": {\"records\": %d, \"seconds\": %.6f, \"records_per_sec\": %.1f},\n",
+            records, load_us / 1e6, (load_us > 0) ? records / (load_us / 1e6) : 0.0);
+    fprintf(out, "  \"results\": {\n");
+    for (i = 0; i < nops; i++)
+        op_report(out, &ops[i], i == nops - 1);
+    fprintf(out, "  }\n}\n");
+
+    fclose(out);
+    return (fd < 0) ? 1 : 0;
+}
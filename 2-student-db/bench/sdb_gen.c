@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "../db.h"
+
+/*
+ *  sdb_gen writes a CSV of synthetic students that sdbsc -b loads:
+ *
+ *      sdb_gen [-n count] [-d density] [-D seq|uniform|cluster] [-s seed]
+ *
+ *  count     students to generate, default 10000
+ *  density   share of the id span that is in use, 0.01 to 1, default 1.
+ *            The span is count / density ids starting at MIN_STD_ID, so a
+ *            density of 0.1 leaves nine empty slots for every student
+ *  seq       ids evenly spaced over the span
+ *  uniform   ids picked at random from the span
+ *  cluster   runs of GEN_CLUSTER consecutive ids at random places
+ *  seed      for the random number generator, default 1
+ */
+
+#define GEN_CLUSTER     64
+
+static const char *first_names[] = {
+    "ann", "bob", "cy", "dee", "eve", "fay", "gus", "hal", "ivy", "jim",
+    "kay", "lou", "max", "ned", "olive", "pat", "quinn", "rob", "sue", "tom"
+};
+
+static const char *last_names[] = {
+    "adams", "baker", "clark", "davis", "evans", "fisher", "green", "hall",
+    "irwin", "jones", "king", "lee", "moore", "nash", "owens", "price",
+    "quill", "reed", "smith", "turner", "underwood", "vance", "walsh", "young"
+};
+
+#define NAMES(a)    ((int)(sizeof(a) / sizeof(a[0])))
+
+static void usage(const char *exename)
+{
+    fprintf(stderr, "usage: %s [-n count] [-d density] [-D seq|uniform|cluster] [-s seed]\n",
+            exename);
+}
+
+// mark count of the span ids as used, *used has span entries
+static void pick_ids(bool *used, int span, int count, const char *dist)
+{
+    int picked = 0;
+    int i;
+
+    if (strcmp(dist, "seq") == 0)
+    {
+        for (i = 0; i < count; i++)
+            used[(int)((long long)i * span / count)] = true;
+        return;
+    }
+
+    while (picked < count)
+    {
+        int run = (strcmp(dist, "cluster") == 0) ? GEN_CLUSTER : 1;
+        int start = rand() % span;
+
+        for (i = start; i < start + run && i < span && picked < count; i++)
+        {
+            if (!used[i])
+            {
+                used[i] = true;
+                picked++;
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *dist = "seq";
+    double density = 1.0;
+    int count = 10000;
+    int span;
+    bool *used;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "n:d:D:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'd':
+            density = atof(optarg);
+            break;
+        case 'D':
+            dist = optarg;
+            break;
+        case 's':
+            srand((unsigned int)atoi(optarg));
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (strcmp(dist, "seq") != 0 && strcmp(dist, "uniform") != 0 &&
+        strcmp(dist, "cluster") != 0)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (density < 0.01 || density > 1.0 || count < 1 ||
+        count > MAX_STD_ID - MIN_STD_ID + 1)
+    {
+        fprintf(stderr, "%s: count must fit the id range and density be 0.01 to 1\n",
+                argv[0]);
+        return 2;
+    }
+
+    span = (int)(count / density);
+    if (span > MAX_STD_ID - MIN_STD_ID + 1)
+        span = MAX_STD_ID - MIN_STD_ID + 1;
+
+    used = calloc(span, sizeof(bool));
+    if (used == NULL)
+        return 1;
+    pick_ids(used, span, count, dist);
+
+    for (i = 0; i < span; i++)
+    {
+        if (!used[i])
+            continue;
+        printf("%d,%s,%s,%d\n", i + MIN_STD_ID,
+               first_names[rand() % NAMES(first_names)],
+               last_names[rand() % NAMES(last_names)],
+               MIN_STD_GPA + rand() % (MAX_STD_GPA - MIN_STD_GPA + 1));
+    }
+
+    free(used);
+    return 0;
+}
@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  The occupancy bitmap is a sidecar file (.student.db.bmp) holding one bit
+ *  per possible student id plus a count of live records.  It is mapped
+ *  shared so tests and updates are plain memory accesses.
+ *
+ *  Every change follows the same protocol: db_bitmap_begin() counts the
+ *  change as in flight, the database is written, db_bitmap_set() flips the
+ *  bit and db_bitmap_commit() takes the change off the count again.  The
+ *  commit that brings the count back to zero stamps the bitmap with the
+ *  inode, size and mtime of the database file, while other writers are
+ *  still in flight the stamp would not cover their changes.  A bitmap with
+ *  changes in flight, the wrong version, or a stamp that does not match
+ *  the database file (it was changed by something that does not know about
+ *  the bitmap) is rebuilt from a scan when the database is opened, so a
+ *  count left behind by a writer that crashed is never trusted.
+ */
+
+static bool bit_test(const bmp_file_t *bmp, int id)
+{
+    return (bmp->bits[id >> 3] >> (id & 7)) & 1;
+}
+
+static void bit_assign(bmp_file_t *bmp, int id, bool present)
+{
+    if (present)
+        bmp->bits[id >> 3] |= (uint8_t)(1 << (id & 7));
+    else
+        bmp->bits[id >> 3] &= (uint8_t)~(1 << (id & 7));
+}
+
+static int rebuild_record(const student_t *s, off_t slot, void *arg)
+{
+    bmp_file_t *bmp = arg;
+
+    (void)slot;
+    if ((s->id >= MIN_STD_ID) && (s->id <= MAX_STD_ID) && !bit_test(bmp, s->id))
+    {
+        bit_assign(bmp, s->id, true);
+        bmp->count++;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  db_bitmap_open
+ *      ctx:  database context, layout already worked out
+ *
+ *  Maps the bitmap of the database, creating or rebuilding it when needed.
+ *  If the bitmap cannot be used ctx->bmp stays NULL and callers fall back
+ *  to reading the database itself.
+ *
+ *  returns:  NO_ERROR if the bitmap is usable, ERR_DB_FILE otherwise
+ */
+int db_bitmap_open(sdb_ctx_t *ctx)
+{
+    char bmp_path[PATH_MAX];
+    bmp_file_t *bmp;
+    int bfd;
+
+    if (db_sidecar_path(ctx->path, BMP_SIDECAR, bmp_path) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    bfd = open(bmp_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (bfd == -1)
+        return ERR_DB_FILE;
+
+    if (ftruncate(bfd, sizeof(bmp_file_t)) == -1)
+    {
+        close(bfd);
+        return ERR_DB_FILE;
+    }
+
+    bmp = mmap(NULL, sizeof(bmp_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, bfd, 0);
+    close(bfd);
+    if (bmp == MAP_FAILED)
+        return ERR_DB_FILE;
+
+    if (bmp->magic != BMP_MAGIC || bmp->version != BMP_VERSION ||
+        bmp->inflight != 0 || !db_stamp_matches(ctx->fd, &bmp->stamp))
+    {
+        // whatever changed the file behind our back is a change too
+        uint32_t changes = bmp->changes + 1;
+
+        memset(bmp, 0, sizeof(bmp_file_t));
+        bmp->magic = BMP_MAGIC;
+        bmp->version = BMP_VERSION;
+        bmp->changes = changes;
+        if (db_scan(ctx->fd, rebuild_record, bmp) != NO_ERROR ||
+            db_stamp(ctx->fd, &bmp->stamp) != NO_ERROR)
+        {
+            munmap(bmp, sizeof(bmp_file_t));
+            return ERR_DB_FILE;
+        }
+    }
+
+    ctx->bmp = bmp;
+    return NO_ERROR;
+}
+
+/*
+ *  db_bitmap_close
+ *      ctx:  database context
+ *
+ *  Unmaps the bitmap, the kernel writes it back like any other file.
+ */
+void db_bitmap_close(sdb_ctx_t *ctx)
+{
+    if (ctx->bmp != NULL)
+        munmap(ctx->bmp, sizeof(bmp_file_t));
+    ctx->bmp = NULL;
+}
+
+/*
+ *  db_bitmap_test
+ *      fd:        database file descriptor
+ *      id:        student id
+ *      *present:  receives whether the id is in the database
+ *
+ *  returns:  true if the bitmap answered, false if there is no bitmap and
+ *            the caller has to look at the database
+ */
+bool db_bitmap_test(int fd, int id, bool *present)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx == NULL || ctx->bmp == NULL)
+        return false;
+
+    *present = (id >= MIN_STD_ID) && (id <= MAX_STD_ID) && bit_test(ctx->bmp, id);
+    return true;
+}
+
+/*
+ *  db_bitmap_count
+ *      fd:  database file descriptor
+ *
+ *  returns:  number of live records, or -1 if there is no bitmap
+ */
+int db_bitmap_count(int fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx == NULL || ctx->bmp == NULL)
+        return -1;
+
+    return (int)ctx->bmp->count;
+}
+
+/*
+ *  db_bitmap_begin / db_bitmap_set / db_bitmap_commit
+ *      fd:       database file descriptor
+ *      id:       student id that was added or removed
+ *      present:  true for an add, false for a delete
+ *
+ *  Bracket a change to the database, see the protocol at the top of this
+ *  file.  A crash between begin and commit leaves the change counted as in
+ *  flight and the bitmap is rebuilt on the next open.  Commits also count
+ *  the change in the header.  These are no-ops without a bitmap.
+ */
+void db_bitmap_begin(int fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx != NULL && ctx->bmp != NULL)
+        ctx->bmp->inflight++;
+}
+
+void db_bitmap_set(int fd, int id, bool present)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx == NULL || ctx->bmp == NULL ||
+        (id < MIN_STD_ID) || (id > MAX_STD_ID) ||
+        bit_test(ctx->bmp, id) == present)
+        return;
+
+    bit_assign(ctx->bmp, id, present);
+    if (present)
+        ctx->bmp->count++;
+    else
+        ctx->bmp->count--;
+}
+
+void db_bitmap_commit(int fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx == NULL || ctx->bmp == NULL)
+        return;
+
+    // buffer pools of other processes drop their pages, see sdb_pool.c
+    __atomic_add_fetch(&ctx->bmp->changes, 1, __ATOMIC_RELEASE);
+
+    // a rebuild by another process may already have cleared the count
+    if (ctx->bmp->inflight > 0)
+        ctx->bmp->inflight--;
+    db_bitmap_restamp(fd, fd);
+}
+
+/*
+ *  db_bitmap_restamp
+ *      fd:        database file descriptor
+ *      stamp_fd:  file whose inode, size and mtime go into the stamp
+ *
+ *  compress_db() rewrites the database without changing which ids are in
+ *  it.  Stamping the bitmap with the compressed file before it is renamed
+ *  into place keeps the bitmap valid across the compression.  A bitmap
+ *  with changes in flight is left as it is, the next open rebuilds it.
+ */
+void db_bitmap_restamp(int fd, int stamp_fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx == NULL || ctx->bmp == NULL || ctx->bmp->inflight != 0)
+        return;
+
+    db_stamp(stamp_fd, &ctx->bmp->stamp);
+}
+
+/*
+ *  db_bitmap_add_dead / db_bitmap_clear_dead / db_bitmap_dead
+ *      fd:     database file descriptor
+ *      delta:  change in the number of deleted slots holding storage
+ *
+ *  The dead slot counter drives background compaction.  It is an estimate:
+ *  a delete that lets its whole block be punched out is never counted, but
+ *  dead slots in that block counted earlier are not taken back off.  Over
+ *  counting only makes compaction run a little early, and every compaction
+ *  starts the count again from zero.
+ */
+void db_bitmap_add_dead(int fd, int delta)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx == NULL || ctx->bmp == NULL)
+        return;
+
+    if (delta < 0 && (uint32_t)-delta > ctx->bmp->dead)
+        ctx->bmp->dead = 0;
+    else
+        ctx->bmp->dead += delta;
+}
+
+void db_bitmap_clear_dead(int fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx != NULL && ctx->bmp != NULL)
+        ctx->bmp->dead = 0;
+}
+
+int db_bitmap_dead(int fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx == NULL || ctx->bmp == NULL)
+        return 0;
+
+    return (int)ctx->bmp->dead;
+}
@@ -0,0 +1,467 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define COL_X86     1
+#else
+    #define COL_X86     0
+#endif
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  The column sidecar (.student.db.col) keeps the ids and GPAs of the live
+ *  students as two dense int32 columns, row i of one belongs with row i of
+ *  the other.  A filter over them touches 8 bytes per student instead of a
+ *  64 byte record, and runs 8 (AVX2) or 4 (SSE2) students per instruction.
+ *  Rows are in no particular order: an add appends a row, a delete moves
+ *  the last row into the hole, pos[] remembers where every id is.
+ *
+ *  The columns are mapped shared and kept in step with the database with
+ *  the begin, set, commit protocol of the occupancy bitmap, see
+ *  sdb_bitmap.c.  Names are not kept in columns, name lookups go through
+ *  the name index.
+ */
+
+static void col_assign(col_file_t *c, int id, int gpa, bool present)
+{
+    uint32_t row;
+
+    if ((id < MIN_STD_ID) || (id > MAX_STD_ID))
+        return;
+
+    if (c->pos[id] != 0)
+    {
+        row = c->pos[id] - 1;
+        if (present)
+        {
+            c->gpa[row] = gpa;
+            return;
+        }
+
+        // move the last row into the hole
+        c->count--;
+        if (row != c->count)
+        {
+            c->id[row] = c->id[c->count];
+            c->gpa[row] = c->gpa[c->count];
+            c->pos[c->id[row]] = row + 1;
+        }
+        c->pos[id] = 0;
+        return;
+    }
+
+    if (!present || c->count > MAX_STD_ID - 1)
+        return;
+
+    row = c->count++;
+    c->id[row] = id;
+    c->gpa[row] = gpa;
+    c->pos[id] = row + 1;
+}
+
+static int rebuild_record(const student_t *s, off_t slot, void *arg)
+{
+    (void)slot;
+    col_assign(arg, s->id, s->gpa, true);
+    return NO_ERROR;
+}
+
+static int col_build(int fd, col_file_t *c)
+{
+    memset(c, 0, sizeof(col_file_t));
+    c->magic = COL_MAGIC;
+    c->version = COL_VERSION;
+
+    if (db_scan(fd, rebuild_record, c) != NO_ERROR ||
+        db_stamp(fd, &c->stamp) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    return NO_ERROR;
+}
+
+/*
+ *  kernel_scalar / kernel_sse2 / kernel_avx2
+ *      ids, gpas:  the columns
+ *      n:          rows to filter
+ *      p:          predicate, both ranges inclusive and inside the valid
+ *                  id and GPA ranges
+ *      agg:        count, sum, min and max of the passing rows are added
+ *                  to it
+ *      out:        receives the ids of the passing rows, may be NULL
+ *
+ *  The filter kernels.  All three give the same answer, the vector ones
+ *  compare a register of ids and gpas at a time and finish the tail that
+ *  does not fill a register with the scalar kernel.
+ */
+static void kernel_scalar(const int32_t *ids, const int32_t *gpas, int n,
+                          const col_pred_t *p, col_agg_t *agg, int32_t *out)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (gpas[i] < p->gpa_lo || gpas[i] > p->gpa_hi ||
+            ids[i] < p->id_lo || ids[i] > p->id_hi)
+            continue;
+
+        if (out != NULL)
+            out[agg->count] = ids[i];
+        agg->count++;
+        agg->sum += gpas[i];
+        if (gpas[i] < agg->min)
+            agg->min = gpas[i];
+        if (gpas[i] > agg->max)
+            agg->max = gpas[i];
+    }
+}
+
+#if COL_X86
+static void kernel_sse2(const int32_t *ids, const int32_t *gpas, int n,
+                        const col_pred_t *p, col_agg_t *agg, int32_t *out)
+{
+    const __m128i glo = _mm_set1_epi32(p->gpa_lo - 1);
+    const __m128i ghi = _mm_set1_epi32(p->gpa_hi + 1);
+    const __m128i ilo = _mm_set1_epi32(p->id_lo - 1);
+    const __m128i ihi = _mm_set1_epi32(p->id_hi + 1);
+    __m128i vsum = _mm_setzero_si128();
+    __m128i vmin = _mm_set1_epi32(INT_MAX);
+    __m128i vmax = _mm_set1_epi32(INT_MIN);
+    int32_t lanes[4];
+    int i;
+    int k;
+
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        __m128i g = _mm_loadu_si128((const __m128i *)&gpas[i]);
+        __m128i d = _mm_loadu_si128((const __m128i *)&ids[i]);
+        __m128i m = _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi32(g, glo), _mm_cmplt_epi32(g, ghi)),
+                                  _mm_and_si128(_mm_cmpgt_epi32(d, ilo), _mm_cmplt_epi32(d, ihi)));
+        int bits = _mm_movemask_ps(_mm_castsi128_ps(m));
+        __m128i lt;
+        __m128i gt;
+
+        if (bits == 0)
+            continue;
+
+        if (out != NULL)
+        {
+            int at = agg->count;
+
+            for (k = 0; k < 4; k++)
+                if (bits & (1 << k))
+                    out[at++] = ids[i + k];
+        }
+
+        agg->count += __builtin_popcount(bits);
+        vsum = _mm_add_epi32(vsum, _mm_and_si128(m, g));
+
+        // SSE2 has no min/max for int32, select with masks
+        lt = _mm_and_si128(m, _mm_cmplt_epi32(g, vmin));
+        vmin = _mm_or_si128(_mm_and_si128(lt, g), _mm_andnot_si128(lt, vmin));
+        gt = _mm_and_si128(m, _mm_cmpgt_epi32(g, vmax));
+        vmax = _mm_or_si128(_mm_and_si128(gt, g), _mm_andnot_si128(gt, vmax));
+    }
+
+    _mm_storeu_si128((__m128i *)lanes, vsum);
+    for (k = 0; k < 4; k++)
+        agg->sum += lanes[k];
+    _mm_storeu_si128((__m128i *)lanes, vmin);
+    for (k = 0; k < 4; k++)
+        if (lanes[k] < agg->min)
+            agg->min = lanes[k];
+    _mm_storeu_si128((__m128i *)lanes, vmax);
+    for (k = 0; k < 4; k++)
+        if (lanes[k] > agg->max)
+            agg->max = lanes[k];
+
+    kernel_scalar(ids + i, gpas + i, n - i, p, agg, out);
+}
+
+__attribute__((target("avx2")))
+static void kernel_avx2(const int32_t *ids, const int32_t *gpas, int n,
+                        const col_pred_t *p, col_agg_t *agg, int32_t *out)
+{
+    const __m256i glo = _mm256_set1_epi32(p->gpa_lo - 1);
+    const __m256i ghi = _mm256_set1_epi32(p->gpa_hi + 1);
+    const __m256i ilo = _mm256_set1_epi32(p->id_lo - 1);
+    const __m256i ihi = _mm256_set1_epi32(p->id_hi + 1);
+    __m256i vsum = _mm256_setzero_si256();
+    __m256i vmin = _mm256_set1_epi32(INT_MAX);
+    __m256i vmax = _mm256_set1_epi32(INT_MIN);
+    int32_t lanes[8];
+    int i;
+    int k;
+
+    for (i = 0; i + 8 <= n; i += 8)
+    {
+        __m256i g = _mm256_loadu_si256((const __m256i *)&gpas[i]);
+        __m256i d = _mm256_loadu_si256((const __m256i *)&ids[i]);
+        __m256i m = _mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi32(g, glo),
+                                                      _mm256_cmpgt_epi32(ghi, g)),
+                                     _mm256_and_si256(_mm256_cmpgt_epi32(d, ilo),
+                                                      _mm256_cmpgt_epi32(ihi, d)));
+        int bits = _mm256_movemask_ps(_mm256_castsi256_ps(m));
+
+        if (bits == 0)
+            continue;
+
+        if (out != NULL)
+        {
+            int at = agg->count;
+
+            for (k = 0; k < 8; k++)
+                if (bits & (1 << k))
+                    out[at++] = ids[i + k];
+        }
+
+        agg->count += __builtin_popcount(bits);
+        vsum = _mm256_add_epi32(vsum, _mm256_and_si256(m, g));
+        vmin = _mm256_min_epi32(vmin, _mm256_blendv_epi8(_mm256_set1_epi32(INT_MAX), g, m));
+        vmax = _mm256_max_epi32(vmax, _mm256_blendv_epi8(_mm256_set1_epi32(INT_MIN), g, m));
+    }
+
+    _mm256_storeu_si256((__m256i *)lanes, vsum);
+    for (k = 0; k < 8; k++)
+        agg->sum += lanes[k];
+    _mm256_storeu_si256((__m256i *)lanes, vmin);
+    for (k = 0; k < 8; k++)
+        if (lanes[k] < agg->min)
+            agg->min = lanes[k];
+    _mm256_storeu_si256((__m256i *)lanes, vmax);
+    for (k = 0; k < 8; k++)
+        if (lanes[k] > agg->max)
+            agg->max = lanes[k];
+
+    kernel_scalar(ids + i, gpas + i, n - i, p, agg, out);
+}
+#endif
+
+static void col_filter(const col_file_t *c, uint32_t n, const col_pred_t *p, col_agg_t *agg,
+                       int32_t *out)
+{
+    agg->count = 0;
+    agg->sum = 0;
+    agg->min = INT_MAX;
+    agg->max = INT_MIN;
+
+#if COL_X86
+    if (__builtin_cpu_supports("avx2"))
+        kernel_avx2(c->id, c->gpa, n, p, agg, out);
+    else
+        kernel_sse2(c->id, c->gpa, n, p, agg, out);
+#else
+    kernel_scalar(c->id, c->gpa, n, p, agg, out);
+#endif
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    int ia = *(const int32_t *)a;
+    int ib = *(const int32_t *)b;
+
+    return (ia > ib) - (ia < ib);
+}
+
+/*
+ *  db_col_open
+ *      ctx:  database context, layout already worked out
+ *
+ *  Maps the columns of the database, creating or rebuilding them when
+ *  needed.  If they cannot be used ctx->col stays NULL.
+ *
+ *  returns:  NO_ERROR if the columns are usable, ERR_DB_FILE otherwise
+ */
+int db_col_open(sdb_ctx_t *ctx)
+{
+    char col_path[PATH_MAX];
+    col_file_t *c;
+    int cfd;
+
+    if (db_sidecar_path(ctx->path, COL_SIDECAR, col_path) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    cfd = open(col_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (cfd == -1)
+        return ERR_DB_FILE;
+
+    if (ftruncate(cfd, sizeof(col_file_t)) == -1)
+    {
+        close(cfd);
+        return ERR_DB_FILE;
+    }
+
+    c = mmap(NULL, sizeof(col_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, cfd, 0);
+    close(cfd);
+    if (c == MAP_FAILED)
+        return ERR_DB_FILE;
+
+    if ((c->magic != COL_MAGIC || c->version != COL_VERSION ||
+         c->inflight != 0 || c->count > MAX_STD_ID ||
+         !db_stamp_matches(ctx->fd, &c->stamp)) &&
+        col_build(ctx->fd, c) != NO_ERROR)
+    {
+        munmap(c, sizeof(col_file_t));
+        return ERR_DB_FILE;
+    }
+
+    ctx->col = c;
+    return NO_ERROR;
+}
+
+/*
+ *  db_col_close
+ *      ctx:  database context
+ */
+void db_col_close(sdb_ctx_t *ctx)
+{
+    if (ctx->col != NULL)
+        munmap(ctx->col, sizeof(col_file_t));
+    ctx->col = NULL;
+}
+
+/*
+ *  db_col_begin / db_col_set / db_col_commit / db_col_restamp
+ *      fd:        database file descriptor
+ *      id:        student id that was added, removed or changed
+ *      gpa:       GPA the student has now
+ *      present:   false if the student was removed
+ *      stamp_fd:  file whose stamp the columns take, see db_bitmap_restamp()
+ *
+ *  Bracket a change to the database exactly like the bitmap functions of
+ *  the same names.  These are no-ops without columns.
+ */
+void db_col_begin(int fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx != NULL && ctx->col != NULL)
+        ctx->col->inflight++;
+}
+
+void db_col_set(int fd, int id, int gpa, bool present)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx != NULL && ctx->col != NULL)
+        col_assign(ctx->col, id, gpa, present);
+}
+
+void db_col_commit(int fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx != NULL && ctx->col != NULL && ctx->col->inflight > 0)
+        ctx->col->inflight--;
+    db_col_restamp(fd, fd);
+}
+
+void db_col_restamp(int fd, int stamp_fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx == NULL || ctx->col == NULL || ctx->col->inflight != 0)
+        return;
+
+    db_stamp(stamp_fd, &ctx->col->stamp);
+}
+
+/*
+ *  db_col_query
+ *      fd:     database file descriptor
+ *      p:      predicate on id and GPA, both ranges inclusive
+ *      *agg:   receives count, sum, min and max GPA of the matches
+ *      fn:     callback for every matching record in id order, may be NULL
+ *      arg:    passed through to fn
+ *
+ *  Filters the columns with the widest kernel the CPU has.  The aggregates
+ *  come straight from the columns, records are only read for the ids that
+ *  passed and only when there is a callback.  Without the sidecar the
+ *  columns are built in memory from a scan first.  The shared columns are
+ *  filtered under the meta lock, so adds and deletes of other processes
+ *  cannot change the row count or move a row half way through.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on errors, or whatever fn
+ *            returned to stop
+ */
+int db_col_query(int fd, const col_pred_t *p, col_agg_t *agg, db_scan_fn fn, void *arg)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+    col_file_t *owned = NULL;
+    const col_file_t *c;
+    col_pred_t clamped = *p;
+    int32_t *ids = NULL;
+    uint32_t n;
+    int rc = NO_ERROR;
+    int i;
+
+    if (ctx == NULL)
+        return ERR_DB_FILE;
+
+    c = ctx->col;
+    if (c == NULL)
+    {
+        owned = malloc(sizeof(col_file_t));
+        if (owned == NULL || col_build(fd, owned) != NO_ERROR)
+        {
+            free(owned);
+            return ERR_DB_FILE;
+        }
+        c = owned;
+    }
+    else if (db_lock_records(fd, SDB_LOCK_META, 1, false) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    n = (c->count < MAX_STD_ID) ? c->count : MAX_STD_ID;
+    if (fn != NULL && (ids = malloc((n + 1) * sizeof(int32_t))) == NULL)
+    {
+        if (owned == NULL)
+            db_unlock_records(fd, SDB_LOCK_META, 1);
+        free(owned);
+        return ERR_DB_FILE;
+    }
+
+    // the kernels compare against lo - 1 and hi + 1
+    if (clamped.id_lo < MIN_STD_ID)
+        clamped.id_lo = MIN_STD_ID;
+    if (clamped.id_hi > MAX_STD_ID)
+        clamped.id_hi = MAX_STD_ID;
+    if (clamped.gpa_lo < MIN_STD_GPA)
+        clamped.gpa_lo = MIN_STD_GPA;
+    if (clamped.gpa_hi > MAX_STD_GPA)
+        clamped.gpa_hi = MAX_STD_GPA;
+
+    col_filter(c, n, &clamped, agg, ids);
+    if (owned == NULL)
+        db_unlock_records(fd, SDB_LOCK_META, 1);
+
+    if (fn != NULL)
+    {
+        qsort(ids, agg->count, sizeof(int32_t), cmp_int);
+        for (i = 0; i < agg->count && rc == NO_ERROR; i++)
+        {
+            student_t s;
+            off_t slot;
+
+            rc = db_find(fd, ids[i], &slot, &s);
+            if (rc == SRCH_NOT_FOUND)
+                rc = NO_ERROR;
+            else if (rc == NO_ERROR)
+                rc = fn(&s, slot, arg);
+        }
+    }
+
+    free(ids);
+    free(owned);
+    return rc;
+}
@@ -0,0 +1,593 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  The compact layout shrinks a record from 64 bytes to 16 by storing each
+ *  name once, in the name dictionary (.student.db.dict), and putting the
+ *  number of its dictionary entry in the record.  Names repeat a lot, a
+ *  class of 100000 students has a few thousand distinct ones, so a full
+ *  scan reads a quarter of the bytes and four times as many students fit
+ *  in the page cache.
+ *
+ *  The file is still direct addressed, student id lives in slot id, and
+ *  db_read_slot(), db_write_slot() and db_scan() decode and encode on the
+ *  way through.  Everything above the storage engine sees student_t.
+ *
+ *  Entries are only ever added, under the meta lock, and a record names
+ *  an entry only after it was written, so lookups and decoding take no
+ *  lock.  Like the hash directory the dictionary is part of the database,
+ *  it cannot be rebuilt from the records.
+ */
+
+#define DICT_FILE_SIZE  ((off_t)sizeof(dict_file_t))
+
+/*
+ *  name_hash
+ *      name:  name to hash
+ *      len:   its length
+ *
+ *  returns:  the 32 bit FNV-1a hash of name
+ */
+static uint32_t name_hash(const char *name, size_t len)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ *  dict_lookup
+ *      d:     mapped dictionary
+ *      name:  name to look for, not NUL terminated
+ *      len:   its length, 1 to DICT_ENTRY_SIZE - 1
+ *      *pos:  receives the table slot of name, or the free slot it goes to
+ *
+ *  returns:  the entry of name, 0 if it is not in the dictionary
+ */
+static uint32_t dict_lookup(const dict_file_t *d, const char *name, size_t len,
+                            uint32_t *pos)
+{
+    uint32_t p = name_hash(name, len) & (DICT_TABLE_SLOTS - 1);
+    uint32_t e;
+
+    while ((e = __atomic_load_n(&d->table[p], __ATOMIC_ACQUIRE)) != 0)
+    {
+        if (memcmp(d->names[e], name, len) == 0 && d->names[e][len] == '\0')
+            break;
+        p = (p + 1) & (DICT_TABLE_SLOTS - 1);
+    }
+
+    *pos = p;
+    return e;
+}
+
+/*
+ *  dict_add
+ *      d:       mapped dictionary, the caller keeps other writers out
+ *      name:    name to add, not NUL terminated
+ *      len:     its length
+ *      *entry:  receives the entry of name
+ *
+ *  Finds name or appends it.  The entry is filled in before the table
+ *  points at it, a lookup that finds it sees the whole name.
+ *
+ *  returns:  true if name has an entry, false if the dictionary is full
+ */
+static bool dict_add(dict_file_t *d, const char *name, size_t len, uint32_t *entry)
+{
+    uint32_t pos;
+    uint32_t e = dict_lookup(d, name, len, &pos);
+
+    if (e == 0)
+    {
+        e = d->count;
+        if (e >= DICT_MAX_ENTRIES)
+            return false;
+
+        memcpy(d->names[e], name, len);
+        memset(d->names[e] + len, 0, DICT_ENTRY_SIZE - len);
+        __atomic_store_n(&d->count, e + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&d->table[pos], e, __ATOMIC_RELEASE);
+    }
+
+    *entry = e;
+    return true;
+}
+
+/*
+ *  dict_map
+ *      dict_path:  path of the dictionary file
+ *      create:     create an empty dictionary, replacing any old one
+ *      **d:        receives the mapping
+ *
+ *  returns:  NO_ERROR on success, SRCH_NOT_FOUND if the file does not exist
+ *            and create is false, ERR_DB_FILE if it cannot be created or is
+ *            damaged
+ */
+static int dict_map(const char *dict_path, bool create, dict_file_t **d)
+{
+    uint32_t hdr[3] = { DICT_MAGIC, DICT_VERSION, 1 };     //entry 0 is ""
+    struct stat st;
+    int dfd;
+
+    dfd = open(dict_path, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR,
+               S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (dfd == -1)
+        return create ? ERR_DB_FILE : SRCH_NOT_FOUND;
+
+    // an empty dictionary is its header, the table and entries are the
+    // zeros of the sparse file
+    if (create && (ftruncate(dfd, DICT_FILE_SIZE) == -1 ||
+                   pwrite(dfd, hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)))
+    {
+        close(dfd);
+        return ERR_DB_FILE;
+    }
+
+    if (fstat(dfd, &st) == -1 || st.st_size != DICT_FILE_SIZE)
+    {
+        close(dfd);
+        return ERR_DB_FILE;
+    }
+
+    *d = mmap(NULL, DICT_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, dfd, 0);
+    close(dfd);
+    if (*d == MAP_FAILED)
+        return ERR_DB_FILE;
+
+    if ((*d)->magic != DICT_MAGIC || (*d)->version != DICT_VERSION ||
+        (*d)->count == 0 || (*d)->count > DICT_MAX_ENTRIES)
+    {
+        munmap(*d, DICT_FILE_SIZE);
+        return ERR_DB_FILE;
+    }
+
+    return NO_ERROR;
+}
+
+// path of dictionary 0 or 1 of the database at path
+static int dict_path_of(const char *path, uint32_t which, char *dict_path)
+{
+    return db_sidecar_path(path, (which == 0) ? DICT_SIDECAR : DICT_ALT_SIDECAR, dict_path);
+}
+
+// the header record every compact file starts with, which dictionary its
+// records use goes in place of the first name
+static int write_header(int fd, uint32_t which)
+{
+    compact_rec_t hdr = { COMPACT_MAGIC, COMPACT_VERSION, which, 0 };
+
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr))
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+/*
+ *  db_dict_create / db_dict_exists
+ *      path:  path of the database file, emptied by the caller
+ *
+ *  db_dict_create() turns an empty database into an empty compact one: an
+ *  empty dictionary and the header record.  db_dict_exists() tells -z
+ *  whether to keep a database compact.
+ *
+ *  returns:  db_dict_create: NO_ERROR on success, ERR_DB_FILE on failure
+ *            db_dict_exists: true if path has a name dictionary
+ */
+int db_dict_create(const char *path)
+{
+    char dict_path[PATH_MAX];
+    dict_file_t *d;
+    int fd;
+    int rc;
+
+    if (dict_path_of(path, 0, dict_path) != NO_ERROR ||
+        dict_map(dict_path, true, &d) != NO_ERROR)
+        return ERR_DB_FILE;
+    munmap(d, DICT_FILE_SIZE);
+
+    fd = open(path, O_RDWR);
+    if (fd == -1)
+        return ERR_DB_FILE;
+    rc = write_header(fd, 0);
+    close(fd);
+    return rc;
+}
+
+bool db_dict_exists(const char *path)
+{
+    char dict_path[PATH_MAX];
+    uint32_t which;
+
+    for (which = 0; which < 2; which++)
+    {
+        if (dict_path_of(path, which, dict_path) == NO_ERROR && access(dict_path, F_OK) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ *  db_dict_open / db_dict_close
+ *      ctx:  database context
+ *
+ *  Looks for the header record in slot 0 and maps the dictionary it names
+ *  for a compact database, db_register() calls this before it looks at
+ *  the other layouts.
+ *
+ *  returns:  NO_ERROR if the database is compact, SRCH_NOT_FOUND if it is
+ *            not, ERR_DB_FILE if its dictionary is missing or damaged
+ */
+int db_dict_open(sdb_ctx_t *ctx)
+{
+    char dict_path[PATH_MAX];
+    compact_rec_t hdr;
+
+    if (pread(ctx->fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        hdr.id != COMPACT_MAGIC)
+        return SRCH_NOT_FOUND;
+
+    if (hdr.gpa != COMPACT_VERSION || hdr.fname > 1 ||
+        dict_path_of(ctx->path, hdr.fname, dict_path) != NO_ERROR ||
+        dict_map(dict_path, false, &ctx->dict) != NO_ERROR)
+    {
+        ctx->dict = NULL;
+        return ERR_DB_FILE;
+    }
+
+    return NO_ERROR;
+}
+
+void db_dict_close(sdb_ctx_t *ctx)
+{
+    if (ctx->dict != NULL)
+        munmap(ctx->dict, DICT_FILE_SIZE);
+    ctx->dict = NULL;
+}
+
+/*
+ *  db_dict_encoded
+ *      fd:  database file descriptor
+ *
+ *  returns:  true if the database uses the compact layout
+ */
+bool db_dict_encoded(int fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    return ctx != NULL && ctx->layout == DB_LAYOUT_COMPACT;
+}
+
+/*
+ *  db_dict_sync
+ *      ctx:  database context
+ *
+ *  Waits for new dictionary entries to reach the disk, db_sync() calls
+ *  this before the records that use them are made durable.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+int db_dict_sync(sdb_ctx_t *ctx)
+{
+    if (ctx->dict != NULL && db_msync(ctx->dict, DICT_FILE_SIZE, MS_SYNC) == -1)
+        return ERR_DB_FILE;
+
+    return NO_ERROR;
+}
+
+/*
+ *  db_dict_decode
+ *      ctx:   database context of a compact database
+ *      rec:   compact record
+ *      *s:    receives the full student record
+ *
+ *  An entry past the end of the dictionary, which only a damaged file can
+ *  have, decodes as the empty name.
+ */
+void db_dict_decode(const sdb_ctx_t *ctx, const compact_rec_t *rec, student_t *s)
+{
+    const dict_file_t *d = ctx->dict;
+    uint32_t count = __atomic_load_n(&d->count, __ATOMIC_ACQUIRE);
+
+    memset(s, 0, STUDENT_RECORD_SIZE);
+    s->id = rec->id;
+    s->gpa = rec->gpa;
+    if (rec->fname < count)
+        memcpy(s->fname, d->names[rec->fname],
+               strnlen(d->names[rec->fname], sizeof(s->fname)));
+    if (rec->lname < count)
+        memcpy(s->lname, d->names[rec->lname],
+               strnlen(d->names[rec->lname], sizeof(s->lname)));
+}
+
+/*
+ *  intern
+ *      ctx:     database context of a compact database
+ *      fd:      database file descriptor
+ *      name:    name field of a student, NUL terminated if shorter than max
+ *      max:     size of the field
+ *      *entry:  receives the entry of name
+ *      *added:  set if the dictionary had to be changed
+ *
+ *  Most names are in the dictionary already and are found without a lock,
+ *  the others are added under the meta lock, dict_add() looks again in
+ *  case another writer added the name in the meantime.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE if the dictionary is full or
+ *            the lock cannot be taken
+ */
+static int intern(sdb_ctx_t *ctx, int fd, const char *name, size_t max,
+                  uint32_t *entry, bool *added)
+{
+    size_t len = strnlen(name, max);
+    uint32_t pos;
+    bool ok;
+
+    *entry = 0;
+    if (len == 0)
+        return NO_ERROR;
+
+    *entry = dict_lookup(ctx->dict, name, len, &pos);
+    if (*entry != 0)
+        return NO_ERROR;
+
+    if (db_lock_records(fd, SDB_LOCK_META, 1, true) != NO_ERROR)
+        return ERR_DB_FILE;
+    ok = dict_add(ctx->dict, name, len, entry);
+    db_unlock_records(fd, SDB_LOCK_META, 1);
+
+    *added = true;
+    return ok ? NO_ERROR : ERR_DB_FILE;
+}
+
+// the compact record of s
+static int encode(sdb_ctx_t *ctx, int fd, const student_t *s, compact_rec_t *rec,
+                  bool *added)
+{
+    rec->id = s->id;
+    rec->gpa = s->gpa;
+
+    // an emptied slot is all zeros like in every other layout
+    if (s->id == DELETED_STUDENT_ID)
+    {
+        memset(rec, 0, sizeof(*rec));
+        return NO_ERROR;
+    }
+
+    if (intern(ctx, fd, s->fname, sizeof(s->fname), &rec->fname, added) != NO_ERROR ||
+        intern(ctx, fd, s->lname, sizeof(s->lname), &rec->lname, added) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    return NO_ERROR;
+}
+
+/*
+ *  db_dict_read / db_dict_write
+ *      ctx:   database context of a compact database
+ *      fd:    database file descriptor
+ *      slot:  record slot, the byte offset is slot * COMPACT_RECORD_SIZE
+ *      *s:    record to read into or write from
+ *
+ *  db_read_slot() and db_write_slot() for a compact database.  With
+ *  SDB_SYNC_FULL new dictionary entries are flushed before the record
+ *  that uses them.
+ *
+ *  returns:  NO_ERROR       record transferred
+ *            SRCH_NOT_FOUND slot is past the end of the file (read only)
+ *            ERR_DB_FILE    I/O error, short transfer or full dictionary
+ */
+int db_dict_read(sdb_ctx_t *ctx, int fd, off_t slot, student_t *s)
+{
+    compact_rec_t rec;
+    ssize_t n;
+
+    n = pread(fd, &rec, sizeof(rec), slot * COMPACT_RECORD_SIZE);
+    if (n == 0)
+        return SRCH_NOT_FOUND;
+    if (n != (ssize_t)sizeof(rec))
+        return ERR_DB_FILE;
+
+    if (slot == 0)
+        memset(s, 0, STUDENT_RECORD_SIZE);      //the header is no student
+    else
+        db_dict_decode(ctx, &rec, s);
+    return NO_ERROR;
+}
+
+int db_dict_write(sdb_ctx_t *ctx, int fd, off_t slot, const student_t *s)
+{
+    compact_rec_t rec;
+    bool added = false;
+
+    if (slot == 0 || encode(ctx, fd, s, &rec, &added) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    if (sdb_config.sync_policy == SDB_SYNC_FULL && added &&
+        db_dict_sync(ctx) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    if (pwrite(fd, &rec, sizeof(rec), slot * COMPACT_RECORD_SIZE) != (ssize_t)sizeof(rec))
+        return ERR_DB_FILE;
+
+    if (sdb_config.sync_policy == SDB_SYNC_FULL && db_fsync(fd, true) == -1)
+        return ERR_DB_FILE;
+
+    return NO_ERROR;
+}
+
+typedef struct convert {
+    int         fd;                 //file being written
+    dict_file_t *dict;              //its dictionary, NULL to write full records
+} convert_t;
+
+static int convert_record(const student_t *s, off_t slot, void *arg)
+{
+    convert_t *cv = arg;
+    compact_rec_t rec = { s->id, s->gpa, 0, 0 };
+    size_t flen = strnlen(s->fname, sizeof(s->fname));
+    size_t llen = strnlen(s->lname, sizeof(s->lname));
+
+    (void)slot;
+    if (cv->dict == NULL)
+    {
+        if (pwrite(cv->fd, s, STUDENT_RECORD_SIZE, (off_t)s->id * STUDENT_RECORD_SIZE) != STUDENT_RECORD_SIZE)
+            return ERR_DB_FILE;
+        return NO_ERROR;
+    }
+
+    if ((flen > 0 && !dict_add(cv->dict, s->fname, flen, &rec.fname)) ||
+        (llen > 0 && !dict_add(cv->dict, s->lname, llen, &rec.lname)) ||
+        pwrite(cv->fd, &rec, sizeof(rec), (off_t)s->id * COMPACT_RECORD_SIZE) != (ssize_t)sizeof(rec))
+        return ERR_DB_FILE;
+
+    return NO_ERROR;
+}
+
+/*
+ *  convert_db
+ *      fd:      database file descriptor
+ *      layout:  "compact" or "direct"
+ *
+ *  Rewrites the database in the compact layout or as plain direct
+ *  addressed records, from any of the layouts of one file but the hashed
+ *  one.  Converting a compact database to compact again leaves the names
+ *  nobody uses any more out of the new dictionary.
+ *
+ *  Like compress_db() the new file is written next to the database under
+ *  the exclusive lock and renamed over it.  Its dictionary is written
+ *  beforehand to whichever of the two dictionary files the database does
+ *  not use, the header record of the new file names it, so the rename
+ *  switches records and names at once.  The students are the same, so the
+ *  bitmap, GPA index and columns are stamped with the new file, the name
+ *  index is rebuilt on the next open.
+ *
+ *  returns:  <number>       the fd of the converted database file
+ *            ERR_DB_FILE    database file I/O issue
+ *            ERR_DB_OP      layout is not compact or direct
+ *
+ *  console:  M_DB_CONVERTED_OK  on success
+ *            M_ERR_LAYOUT       layout is not compact or direct
+ *            M_ERR_DB_CREATE    error creating or renaming the new files
+ *            M_ERR_DB_READ      error locking the database
+ *            M_ERR_DB_WRITE     error writing the new files
+ *            M_ERR_DB_OPEN      error opening the converted database
+ */
+int convert_db(int fd, char *layout)
+{
+    char dict_path[PATH_MAX];
+    char old_dict_path[PATH_MAX];
+    char idx_path[PATH_MAX];
+    convert_t cv = { -1, NULL };
+    compact_rec_t hdr;
+    uint32_t which = 0;
+    bool compact;
+    int rc;
+
+    if (strcmp(layout, "compact") != 0 && strcmp(layout, "direct") != 0)
+    {
+        printf(M_ERR_LAYOUT, layout);
+        return ERR_DB_OP;
+    }
+    compact = (strcmp(layout, "compact") == 0);
+
+    // records move and the file is replaced, see compress_db()
+    if (db_lock(fd, true) != NO_ERROR)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    if (db_dict_encoded(fd) && pread(fd, &hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr))
+        which = !hdr.fname;
+
+    if (dict_path_of(DB_FILE, which, dict_path) != NO_ERROR ||
+        dict_path_of(DB_FILE, !which, old_dict_path) != NO_ERROR ||
+        db_sidecar_path(DB_FILE, IDX_SIDECAR, idx_path) != NO_ERROR)
+    {
+        printf(M_ERR_DB_CREATE);
+        db_unlock(fd);
+        return ERR_DB_FILE;
+    }
+
+    if (wal_checkpoint(fd) != NO_ERROR)
+    {
+        printf(M_ERR_DB_WRITE);
+        db_unlock(fd);
+        return ERR_DB_FILE;
+    }
+
+    cv.fd = open(TMP_DB_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (cv.fd == -1 ||
+        (compact && dict_map(dict_path, true, &cv.dict) != NO_ERROR))
+    {
+        printf(M_ERR_DB_CREATE);
+        if (cv.fd != -1)
+            close(cv.fd);
+        db_unlock(fd);
+        return ERR_DB_FILE;
+    }
+
+    rc = compact ? write_header(cv.fd, which) : NO_ERROR;
+    if (rc == NO_ERROR)
+        rc = db_scan(fd, convert_record, &cv);
+    if (rc == NO_ERROR && (db_fsync(cv.fd, false) == -1 ||
+                           (cv.dict != NULL && db_msync(cv.dict, DICT_FILE_SIZE, MS_SYNC) == -1)))
+        rc = ERR_DB_FILE;
+    if (cv.dict != NULL)
+        munmap(cv.dict, DICT_FILE_SIZE);
+    if (rc != NO_ERROR)
+    {
+        printf(M_ERR_DB_WRITE);
+        close(cv.fd);
+        unlink(TMP_DB_FILE);
+        db_unlock(fd);
+        return ERR_DB_FILE;
+    }
+
+    db_bitmap_clear_dead(fd);
+    db_bitmap_restamp(fd, cv.fd);
+    db_gpa_restamp(fd, cv.fd);
+    db_col_restamp(fd, cv.fd);
+
+    // a packed index no longer describes anything, the dictionary the old
+    // records used is not needed once the new file is in place
+    rc = (rename(TMP_DB_FILE, DB_FILE) == 0) ? NO_ERROR : ERR_DB_FILE;
+    if (rc == NO_ERROR)
+    {
+        unlink(idx_path);
+        unlink(old_dict_path);
+        if (!compact)
+            unlink(dict_path);
+    }
+
+    close_db(fd);
+    close(cv.fd);
+    if (rc != NO_ERROR)
+    {
+        printf(M_ERR_DB_CREATE);
+        return ERR_DB_FILE;
+    }
+
+    fd = open_db(DB_FILE, false);
+    if (fd < 0)
+        return ERR_DB_FILE;
+
+    printf(M_DB_CONVERTED_OK, layout);
+    return fd;
+}
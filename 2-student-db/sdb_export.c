@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  Export streams every student to stdout as CSV, JSON lines or packed
+ *  student_t records.  Rows are formatted by hand into EXPORT_CHUNKS
+ *  buffers of EXPORT_CHUNK_BYTES and the buffers go out together with one
+ *  writev() once they are all full, so a whole database is a handful of
+ *  system calls and no printf().
+ *
+ *  The CSV and binary output can be loaded back with -b.
+ */
+
+#define EXPORT_CHUNKS       8
+#define EXPORT_CHUNK_BYTES  (128 * 1024)
+
+//longest row any format produces: a JSON line with every name character
+//escaped as \u00XX is well under this
+#define EXPORT_ROW_MAX      512
+
+#define EXPORT_CSV      0
+#define EXPORT_JSONL    1
+#define EXPORT_BIN      2
+
+typedef struct export_buf {
+    char   *chunks[EXPORT_CHUNKS];
+    size_t used[EXPORT_CHUNKS];
+    int    cur;                     //chunk being filled
+    int    format;                  //EXPORT_xxx
+    int    out;                     //descriptor written to
+} export_buf_t;
+
+static int export_flush(export_buf_t *b)
+{
+    struct iovec iov[EXPORT_CHUNKS];
+    int cnt = 0;
+    int i;
+
+    for (i = 0; i <= b->cur && i < EXPORT_CHUNKS; i++)
+    {
+        iov[cnt].iov_base = b->chunks[i];
+        iov[cnt].iov_len = b->used[i];
+        if (b->used[i] > 0)
+            cnt++;
+    }
+
+    // writev() may stop short on pipes, carry on from where it stopped
+    i = 0;
+    while (i < cnt)
+    {
+        ssize_t n = writev(b->out, &iov[i], cnt - i);
+
+        if (n <= 0)
+            return ERR_DB_FILE;
+        while (i < cnt && (size_t)n >= iov[i].iov_len)
+            n -= iov[i++].iov_len;
+        if (i < cnt)
+        {
+            iov[i].iov_base = (char *)iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+        }
+    }
+
+    memset(b->used, 0, sizeof(b->used));
+    b->cur = 0;
+    return NO_ERROR;
+}
+
+// room for a row of up to EXPORT_ROW_MAX bytes, flushing when all the
+// chunks are full
+static char *export_reserve(export_buf_t *b)
+{
+    if (b->used[b->cur] + EXPORT_ROW_MAX > EXPORT_CHUNK_BYTES)
+    {
+        if (b->cur == EXPORT_CHUNKS - 1)
+        {
+            if (export_flush(b) != NO_ERROR)
+                return NULL;
+        }
+        else
+            b->cur++;
+    }
+
+    return b->chunks[b->cur] + b->used[b->cur];
+}
+
+static char *put_str(char *p, const char *s)
+{
+    while (*s != '\0')
+        *p++ = *s++;
+    return p;
+}
+
+static char *put_uint(char *p, unsigned int v)
+{
+    char digits[10];
+    int n = 0;
+
+    do
+    {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+
+    while (n > 0)
+        *p++ = digits[--n];
+    return p;
+}
+
+static char *put_int(char *p, int v)
+{
+    if (v < 0)
+    {
+        *p++ = '-';
+        return put_uint(p, 0u - (unsigned int)v);
+    }
+    return put_uint(p, (unsigned int)v);
+}
+
+// a GPA of 345 goes out as 3.45
+static char *put_gpa(char *p, int gpa)
+{
+    if (gpa < 0)
+    {
+        *p++ = '-';
+        gpa = -gpa;
+    }
+    p = put_uint(p, (unsigned int)(gpa / 100));
+    *p++ = '.';
+    *p++ = (char)('0' + gpa / 10 % 10);
+    *p++ = (char)('0' + gpa % 10);
+    return p;
+}
+
+// a name field as far as its NUL or the end of the field
+static char *put_name(char *p, const char *name, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size && name[i] != '\0'; i++)
+        *p++ = name[i];
+    return p;
+}
+
+static char *put_json_name(char *p, const char *name, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
+
+    *p++ = '"';
+    for (i = 0; i < size && name[i] != '\0'; i++)
+    {
+        unsigned char c = (unsigned char)name[i];
+
+        if (c == '"' || c == '\\')
+        {
+            *p++ = '\\';
+            *p++ = (char)c;
+        }
+        else if (c < 0x20)
+        {
+            p = put_str(p, "\\u00");
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 0xf];
+        }
+        else
+            *p++ = (char)c;
+    }
+    *p++ = '"';
+    return p;
+}
+
+static int export_record(const student_t *s, off_t slot, void *arg)
+{
+    export_buf_t *b = arg;
+    char *start = export_reserve(b);
+    char *p = start;
+
+    (void)slot;
+    if (p == NULL)
+        return ERR_DB_FILE;
+
+    switch (b->format)
+    {
+    case EXPORT_CSV:
+        p = put_int(p, s->id);
+        *p++ = ',';
+        p = put_name(p, s->fname, sizeof(s->fname));
+        *p++ = ',';
+        p = put_name(p, s->lname, sizeof(s->lname));
+        *p++ = ',';
+        p = put_int(p, s->gpa);
+        *p++ = '\n';
+        break;
+    case EXPORT_JSONL:
+        p = put_str(p, "{\"id\":");
+        p = put_int(p, s->id);
+        p = put_str(p, ",\"first_name\":");
+        p = put_json_name(p, s->fname, sizeof(s->fname));
+        p = put_str(p, ",\"last_name\":");
+        p = put_json_name(p, s->lname, sizeof(s->lname));
+        p = put_str(p, ",\"gpa\":");
+        p = put_gpa(p, s->gpa);
+        p = put_str(p, "}\n");
+        break;
+    default:
+        memcpy(p, s, STUDENT_RECORD_SIZE);
+        p += STUDENT_RECORD_SIZE;
+        break;
+    }
+
+    b->used[b->cur] += (size_t)(p - start);
+    return NO_ERROR;
+}
+
+/*
+ *  export_db
+ *      fd:      linux file descriptor
+ *      format:  "csv", "jsonl" or "bin"
+ *
+ *  Writes every student to stdout in slot order.  CSV has a header line and
+ *  takes the GPA as a 3 digit int like -a and -b do, JSON lines have one
+ *  object per student with the GPA as a number, and bin is the student_t
+ *  records of the students without the empty slots between them.
+ *
+ *  returns:  NO_ERROR       on success
+ *            ERR_DB_OP      format is not one of the above
+ *            ERR_DB_FILE    database or output I/O issue
+ *
+ *  console:  the exported students on success
+ *            M_ERR_EXPORT_FMT  unknown format
+ *            M_ERR_DB_READ     error reading the database or writing out
+ */
+int export_db(int fd, char *format)
+{
+    export_buf_t b;
+    int rc;
+    int i;
+
+    memset(&b, 0, sizeof(b));
+    b.out = STDOUT_FILENO;
+    if (strcmp(format, "csv") == 0)
+        b.format = EXPORT_CSV;
+    else if (strcmp(format, "jsonl") == 0)
+        b.format = EXPORT_JSONL;
+    else if (strcmp(format, "bin") == 0)
+        b.format = EXPORT_BIN;
+    else
+    {
+        printf(M_ERR_EXPORT_FMT, format);
+        return ERR_DB_OP;
+    }
+
+    for (i = 0; i < EXPORT_CHUNKS; i++)
+    {
+        b.chunks[i] = malloc(EXPORT_CHUNK_BYTES);
+        if (b.chunks[i] == NULL)
+            break;
+    }
+
+    // anything printf() still holds goes out before the rows
+    fflush(stdout);
+
+    rc = (i < EXPORT_CHUNKS) ? ERR_DB_FILE : NO_ERROR;
+    if (rc == NO_ERROR && b.format == EXPORT_CSV)
+    {
+        char *start = export_reserve(&b);
+        char *p = put_str(start, "id,first_name,last_name,gpa\n");
+
+        b.used[b.cur] += (size_t)(p - start);
+    }
+    if (rc == NO_ERROR)
+        rc = db_scan(fd, export_record, &b);
+    if (rc == NO_ERROR)
+        rc = export_flush(&b);
+
+    for (i = 0; i < EXPORT_CHUNKS; i++)
+        free(b.chunks[i]);
+
+    if (rc != NO_ERROR)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    return NO_ERROR;
+}
@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  The GPA index is a sidecar file (.student.db.gpa) with one bucket per
+ *  possible GPA.  Every bucket has a count, the histogram, and a doubly
+ *  linked list of the ids in it threaded through per id next/prev arrays,
+ *  so moving a student between buckets is a handful of stores.  Like the
+ *  occupancy bitmap it is mapped shared and follows the same begin, set,
+ *  commit protocol, see sdb_bitmap.c.
+ *
+ *  Range and top-K queries walk the buckets in GPA order and only read the
+ *  records they print.  Stats come from the histogram alone.  Without the
+ *  sidecar the same structure is built in memory from a scan.
+ */
+
+static void bucket_link(gpa_file_t *g, int id, int b)
+{
+    g->next[id] = g->head[b];
+    g->prev[id] = 0;
+    if (g->head[b] != 0)
+        g->prev[g->head[b]] = id;
+    g->head[b] = id;
+    g->where[id] = b + 1;
+    g->hist[b]++;
+    g->count++;
+}
+
+static void bucket_unlink(gpa_file_t *g, int id)
+{
+    int b = g->where[id] - 1;
+
+    if (g->prev[id] != 0)
+        g->next[g->prev[id]] = g->next[id];
+    else
+        g->head[b] = g->next[id];
+    if (g->next[id] != 0)
+        g->prev[g->next[id]] = g->prev[id];
+
+    g->where[id] = 0;
+    g->hist[b]--;
+    g->count--;
+}
+
+static void gpa_assign(gpa_file_t *g, int id, int gpa, bool present)
+{
+    if ((id < MIN_STD_ID) || (id > MAX_STD_ID))
+        return;
+    if (present && ((gpa < MIN_STD_GPA) || (gpa > MAX_STD_GPA)))
+        return;
+
+    if (g->where[id] != 0)
+        bucket_unlink(g, id);
+    if (present)
+        bucket_link(g, id, gpa - MIN_STD_GPA);
+}
+
+static int rebuild_record(const student_t *s, off_t slot, void *arg)
+{
+    (void)slot;
+    gpa_assign(arg, s->id, s->gpa, true);
+    return NO_ERROR;
+}
+
+// fill in an empty index from a scan of the database
+static int gpa_build(int fd, gpa_file_t *g)
+{
+    memset(g, 0, sizeof(gpa_file_t));
+    g->magic = GPA_MAGIC;
+    g->version = GPA_VERSION;
+
+    if (db_scan(fd, rebuild_record, g) != NO_ERROR ||
+        db_stamp(fd, &g->stamp) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    return NO_ERROR;
+}
+
+/*
+ *  gpa_get
+ *      fd:      database file descriptor
+ *      *owned:  receives an index the caller has to free(), or NULL
+ *
+ *  returns:  the mapped index, or one built in memory when there is no
+ *            sidecar.  NULL on errors
+ */
+static const gpa_file_t *gpa_get(int fd, gpa_file_t **owned)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    *owned = NULL;
+    if (ctx == NULL)
+        return NULL;
+    if (ctx->gpa != NULL)
+        return ctx->gpa;
+
+    *owned = malloc(sizeof(gpa_file_t));
+    if (*owned != NULL && gpa_build(fd, *owned) != NO_ERROR)
+    {
+        free(*owned);
+        *owned = NULL;
+    }
+
+    return *owned;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    int ia = *(const int *)a;
+    int ib = *(const int *)b;
+
+    return (ia > ib) - (ia < ib);
+}
+
+/*
+ *  db_gpa_open
+ *      ctx:  database context, layout already worked out
+ *
+ *  Maps the GPA index of the database, creating or rebuilding it when
+ *  needed.  If it cannot be used ctx->gpa stays NULL.
+ *
+ *  returns:  NO_ERROR if the index is usable, ERR_DB_FILE otherwise
+ */
+int db_gpa_open(sdb_ctx_t *ctx)
+{
+    char gpa_path[PATH_MAX];
+    gpa_file_t *g;
+    int gfd;
+
+    if (db_sidecar_path(ctx->path, GPA_SIDECAR, gpa_path) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    gfd = open(gpa_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (gfd == -1)
+        return ERR_DB_FILE;
+
+    if (ftruncate(gfd, sizeof(gpa_file_t)) == -1)
+    {
+        close(gfd);
+        return ERR_DB_FILE;
+    }
+
+    g = mmap(NULL, sizeof(gpa_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, gfd, 0);
+    close(gfd);
+    if (g == MAP_FAILED)
+        return ERR_DB_FILE;
+
+    if ((g->magic != GPA_MAGIC || g->version != GPA_VERSION ||
+         g->inflight != 0 || !db_stamp_matches(ctx->fd, &g->stamp)) &&
+        gpa_build(ctx->fd, g) != NO_ERROR)
+    {
+        munmap(g, sizeof(gpa_file_t));
+        return ERR_DB_FILE;
+    }
+
+    ctx->gpa = g;
+    return NO_ERROR;
+}
+
+/*
+ *  db_gpa_close
+ *      ctx:  database context
+ */
+void db_gpa_close(sdb_ctx_t *ctx)
+{
+    if (ctx->gpa != NULL)
+        munmap(ctx->gpa, sizeof(gpa_file_t));
+    ctx->gpa = NULL;
+}
+
+/*
+ *  db_gpa_begin / db_gpa_set / db_gpa_commit / db_gpa_restamp
+ *      fd:        database file descriptor
+ *      id:        student id that was added, removed or changed
+ *      gpa:       GPA the student has now
+ *      present:   false if the student was removed
+ *      stamp_fd:  file whose stamp the index takes, see db_bitmap_restamp()
+ *
+ *  Bracket a change to the database exactly like the bitmap functions of
+ *  the same names.  These are no-ops without an index.
+ */
+void db_gpa_begin(int fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx != NULL && ctx->gpa != NULL)
+        ctx->gpa->inflight++;
+}
+
+void db_gpa_set(int fd, int id, int gpa, bool present)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx != NULL && ctx->gpa != NULL)
+        gpa_assign(ctx->gpa, id, gpa, present);
+}
+
+void db_gpa_commit(int fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx != NULL && ctx->gpa != NULL && ctx->gpa->inflight > 0)
+        ctx->gpa->inflight--;
+    db_gpa_restamp(fd, fd);
+}
+
+void db_gpa_restamp(int fd, int stamp_fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx == NULL || ctx->gpa == NULL || ctx->gpa->inflight != 0)
+        return;
+
+    db_stamp(stamp_fd, &ctx->gpa->stamp);
+}
+
+/*
+ *  db_gpa_histogram
+ *      fd:    database file descriptor
+ *      hist:  GPA_BUCKETS counters, hist[gpa - MIN_STD_GPA] receives the
+ *             number of students with that GPA
+ *
+ *  returns:  number of students, ERR_DB_FILE on errors
+ */
+int db_gpa_histogram(int fd, uint32_t *hist)
+{
+    gpa_file_t *owned;
+    const gpa_file_t *g = gpa_get(fd, &owned);
+    int count;
+
+    if (g == NULL)
+        return ERR_DB_FILE;
+
+    memcpy(hist, g->hist, sizeof(g->hist));
+    count = (int)g->count;
+    free(owned);
+    return count;
+}
+
+/*
+ *  db_gpa_scan
+ *      fd:          database file descriptor
+ *      lo, hi:      GPA range to visit, inclusive
+ *      high_first:  visit the highest GPA first
+ *      limit:       stop after this many records, 0 for no limit
+ *      fn:          callback, called for every record in the range
+ *      arg:         passed through to fn
+ *
+ *  Visits the students with a GPA in [lo, hi] bucket by bucket, ids in
+ *  ascending order within a bucket.  Only the records visited are read.
+ *  A record whose GPA changed since the index was read is skipped.
+ *
+ *  returns:  NO_ERROR after visiting the range, ERR_DB_FILE on errors, or
+ *            whatever fn returned to stop the scan
+ */
+int db_gpa_scan(int fd, int lo, int hi, bool high_first, int limit,
+                db_scan_fn fn, void *arg)
+{
+    gpa_file_t *owned;
+    const gpa_file_t *g = gpa_get(fd, &owned);
+    int *ids;
+    int visited = 0;
+    int rc = NO_ERROR;
+    int step;
+    int b;
+
+    if (g == NULL)
+        return ERR_DB_FILE;
+
+    ids = malloc(MAX_STD_ID * sizeof(int));
+    if (ids == NULL)
+    {
+        free(owned);
+        return ERR_DB_FILE;
+    }
+
+    if (lo < MIN_STD_GPA)
+        lo = MIN_STD_GPA;
+    if (hi > MAX_STD_GPA)
+        hi = MAX_STD_GPA;
+
+    step = high_first ? -1 : 1;
+    for (b = (high_first ? hi : lo) - MIN_STD_GPA;
+         b >= lo - MIN_STD_GPA && b <= hi - MIN_STD_GPA && rc == NO_ERROR;
+         b += step)
+    {
+        uint32_t id;
+        int n = 0;
+        int i;
+
+        for (id = g->head[b]; id != 0 && n < MAX_STD_ID; id = g->next[id])
+            ids[n++] = id;
+        qsort(ids, n, sizeof(int), cmp_int);
+
+        for (i = 0; i < n && rc == NO_ERROR; i++)
+        {
+            student_t s;
+            off_t slot;
+
+            if (limit > 0 && visited == limit)
+                break;
+
+            rc = db_find(fd, ids[i], &slot, &s);
+            if (rc == SRCH_NOT_FOUND || (rc == NO_ERROR && s.gpa != b + MIN_STD_GPA))
+            {
+                rc = NO_ERROR;
+                continue;
+            }
+            if (rc == NO_ERROR)
+                rc = fn(&s, slot, arg);
+            visited++;
+        }
+
+        if (limit > 0 && visited == limit)
+            break;
+    }
+
+    free(ids);
+    free(owned);
+    return rc;
+}
@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  The hashed layout stores students whose ids are far too big to be
+ *  direct addressed (9 digit ids would make a file of 64GB mostly holes).
+ *  The database file is an array of buckets of HASH_BUCKET_SLOTS records,
+ *  one 4KB page each.  The directory (.student.db.hash) maps the low depth
+ *  bits of the hash of an id to the bucket that holds it, so finding or
+ *  placing a student reads one bucket whatever the id is.
+ *
+ *  A full bucket is split: the records whose next hash bit is set move to
+ *  a new bucket appended to the file, and the directory entries that
+ *  pointed at the old bucket with that bit set now point at the new one.
+ *  When the bucket already used every bit of the directory the directory
+ *  doubles first, the new half a copy of the old.  Only the split bucket
+ *  is touched, nothing is ever rehashed as a whole.
+ *
+ *  Splits move records, so changes to a hashed database hold the file lock
+ *  exclusively (see lock_student()) and lookups hold it shared.  The
+ *  directory is mapped shared, every process sees a split as soon as the
+ *  lock is given back.  Unlike the other sidecars the directory cannot be
+ *  rebuilt from the records, it is part of the database like the shard
+ *  manifest is.
+ */
+
+#define HASH_FILE_SIZE  ((off_t)sizeof(hash_dir_t))
+
+/*
+ *  hash_id
+ *      id:  student id
+ *
+ *  Ids handed out in order would only differ in their high bits, mix every
+ *  bit into the low ones the directory uses (the murmur3 finaliser).
+ *
+ *  returns:  the 32 bit hash of id
+ */
+static uint32_t hash_id(int id)
+{
+    uint32_t h = (uint32_t)id;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static uint32_t hash_bucket(const hash_dir_t *h, int id)
+{
+    return h->dir[hash_id(id) & ((1u << h->depth) - 1)];
+}
+
+// read a whole bucket, the part past the end of the file reads as empty
+static int read_bucket(int fd, uint32_t b, student_t *recs)
+{
+    ssize_t n = pread(fd, recs, HASH_BUCKET_BYTES, (off_t)b * HASH_BUCKET_BYTES);
+
+    if (n < 0)
+        return ERR_DB_FILE;
+
+    SDB_COUNT(records_scanned, HASH_BUCKET_SLOTS);
+    memset((char *)recs + n, 0, HASH_BUCKET_BYTES - n);
+    return NO_ERROR;
+}
+
+static int write_bucket(int fd, uint32_t b, const student_t *recs)
+{
+    if (pwrite(fd, recs, HASH_BUCKET_BYTES, (off_t)b * HASH_BUCKET_BYTES) != HASH_BUCKET_BYTES)
+        return ERR_DB_FILE;
+
+    return NO_ERROR;
+}
+
+/*
+ *  db_hash_create / db_hash_exists
+ *      path:  path of the database file, emptied by the caller
+ *
+ *  db_hash_create() writes the directory of an empty hashed database: one
+ *  bucket, depth 0.  db_hash_exists() tells -z whether to keep a database
+ *  hashed.
+ *
+ *  returns:  db_hash_create: NO_ERROR on success, ERR_DB_FILE on failure
+ *            db_hash_exists: true if path has a hash directory
+ */
+int db_hash_create(const char *path)
+{
+    char hash_path[PATH_MAX];
+    uint32_t hdr[4] = { HASH_MAGIC, HASH_VERSION, 0, 1 };   //depth 0, 1 bucket
+    int hfd;
+    int rc = NO_ERROR;
+
+    if (db_sidecar_path(path, HASH_SIDECAR, hash_path) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    hfd = open(hash_path, O_RDWR | O_CREAT | O_TRUNC,
+               S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (hfd == -1)
+        return ERR_DB_FILE;
+
+    // only the header is written, directory entry 0 and the local depth of
+    // bucket 0 are the zeros of the sparse file
+    if (ftruncate(hfd, HASH_FILE_SIZE) == -1 ||
+        pwrite(hfd, hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr))
+        rc = ERR_DB_FILE;
+
+    close(hfd);
+    return rc;
+}
+
+bool db_hash_exists(const char *path)
+{
+    char hash_path[PATH_MAX];
+
+    return db_sidecar_path(path, HASH_SIDECAR, hash_path) == NO_ERROR &&
+           access(hash_path, F_OK) == 0;
+}
+
+/*
+ *  db_hash_open / db_hash_close
+ *      ctx:  database context
+ *
+ *  Maps the directory of a hashed database, db_register() calls this
+ *  before it looks at the other layouts.
+ *
+ *  returns:  NO_ERROR if the database is hashed, SRCH_NOT_FOUND if it has
+ *            no directory, ERR_DB_FILE if the directory is damaged
+ */
+int db_hash_open(sdb_ctx_t *ctx)
+{
+    char hash_path[PATH_MAX];
+    struct stat st;
+    hash_dir_t *h;
+    int hfd;
+
+    if (db_sidecar_path(ctx->path, HASH_SIDECAR, hash_path) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    hfd = open(hash_path, O_RDWR);
+    if (hfd == -1)
+        return SRCH_NOT_FOUND;
+
+    if (fstat(hfd, &st) == -1 || st.st_size != HASH_FILE_SIZE)
+    {
+        close(hfd);
+        return ERR_DB_FILE;
+    }
+
+    h = mmap(NULL, HASH_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, hfd, 0);
+    close(hfd);
+    if (h == MAP_FAILED)
+        return ERR_DB_FILE;
+
+    if (h->magic != HASH_MAGIC || h->version != HASH_VERSION ||
+        h->depth > HASH_MAX_DEPTH || h->buckets == 0)
+    {
+        munmap(h, HASH_FILE_SIZE);
+        return ERR_DB_FILE;
+    }
+
+    ctx->hash = h;
+    return NO_ERROR;
+}
+
+void db_hash_close(sdb_ctx_t *ctx)
+{
+    if (ctx->hash != NULL)
+        munmap(ctx->hash, HASH_FILE_SIZE);
+    ctx->hash = NULL;
+}
+
+/*
+ *  db_hashed
+ *      fd:  database file descriptor
+ *
+ *  returns:  true if the database uses the hashed layout
+ */
+bool db_hashed(int fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    return ctx != NULL && ctx->layout == DB_LAYOUT_HASH;
+}
+
+/*
+ *  db_hash_find
+ *      ctx:    database context of a hashed database
+ *      fd:     database file descriptor
+ *      id:     student id to look up
+ *      *slot:  receives the slot of the student, may be NULL
+ *      *s:     receives the student record, may be NULL
+ *
+ *  Reads the bucket of id and looks through it, see db_find().
+ *
+ *  returns:  NO_ERROR       student found
+ *            SRCH_NOT_FOUND student not in the database
+ *            ERR_DB_FILE    database file I/O issue
+ */
+int db_hash_find(sdb_ctx_t *ctx, int fd, int id, off_t *slot, student_t *s)
+{
+    student_t recs[HASH_BUCKET_SLOTS];
+    uint32_t b;
+    int i;
+
+    if ((id < MIN_STD_ID) || (id > HASH_MAX_STD_ID))
+        return SRCH_NOT_FOUND;
+
+    b = hash_bucket(ctx->hash, id);
+    if (read_bucket(fd, b, recs) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    for (i = 0; i < HASH_BUCKET_SLOTS; i++)
+    {
+        if (recs[i].id == id)
+        {
+            if (slot != NULL)
+                *slot = (off_t)b * HASH_BUCKET_SLOTS + i;
+            if (s != NULL)
+                memcpy(s, &recs[i], STUDENT_RECORD_SIZE);
+            return NO_ERROR;
+        }
+    }
+
+    return SRCH_NOT_FOUND;
+}
+
+/*
+ *  db_hash_owns
+ *      ctx:   database context of a hashed database
+ *      id:    id of the record in slot
+ *      slot:  where the record is
+ *
+ *  A split cut short by a crash leaves the records it moved in the old
+ *  bucket too, or in a new bucket the directory never got to point at,
+ *  see split_bucket().  Only the copy in the bucket the directory points
+ *  at counts: scans skip the others and adds reuse their slots.
+ *
+ *  returns:  true if slot is in the bucket of id
+ */
+bool db_hash_owns(const sdb_ctx_t *ctx, int id, off_t slot)
+{
+    return hash_bucket(ctx->hash, id) == (uint32_t)(slot / HASH_BUCKET_SLOTS);
+}
+
+/*
+ *  split_bucket
+ *      ctx:  database context of a hashed database
+ *      fd:   database file descriptor
+ *      b:    full bucket to split
+ *
+ *  Splits b on its next hash bit, doubling the directory if b already
+ *  uses all of them.  The log is checkpointed first: it records slot
+ *  images, and the records that move must not be written back to their
+ *  old slots by a replay.  The new bucket is written before the directory
+ *  points at it and the old bucket is cut down last, so a crash part way
+ *  leaves a moved record in both buckets rather than in neither.  The
+ *  copy the directory does not point at is ignored, see db_hash_owns(),
+ *  and dropped by the next split of its bucket.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on I/O errors or when the
+ *            directory is at HASH_MAX_DEPTH
+ */
+static int split_bucket(sdb_ctx_t *ctx, int fd, uint32_t b)
+{
+    student_t old_recs[HASH_BUCKET_SLOTS];
+    student_t new_recs[HASH_BUCKET_SLOTS];
+    hash_dir_t *h = ctx->hash;
+    uint32_t depth = h->local[b];
+    uint32_t nb = h->buckets;
+    uint32_t i;
+    int kept = 0;
+    int moved = 0;
+
+    if (depth == HASH_MAX_DEPTH || nb == HASH_DIR_MAX)
+        return ERR_DB_FILE;
+
+    if (wal_checkpoint(fd) != NO_ERROR || read_bucket(fd, b, old_recs) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    memset(new_recs, 0, sizeof(new_recs));
+    for (i = 0; i < HASH_BUCKET_SLOTS; i++)
+    {
+        if (old_recs[i].id == DELETED_STUDENT_ID ||
+            !db_hash_owns(ctx, old_recs[i].id, (off_t)b * HASH_BUCKET_SLOTS))
+            continue;
+        if (hash_id(old_recs[i].id) & (1u << depth))
+            new_recs[moved++] = old_recs[i];
+        else
+            old_recs[kept++] = old_recs[i];
+    }
+    memset(&old_recs[kept], 0, (HASH_BUCKET_SLOTS - kept) * STUDENT_RECORD_SIZE);
+
+    if (write_bucket(fd, nb, new_recs) != NO_ERROR || db_fsync(fd, true) == -1)
+        return ERR_DB_FILE;
+
+    if (depth == h->depth)
+    {
+        memcpy(&h->dir[1u << depth], h->dir, (1u << depth) * sizeof(uint32_t));
+        h->depth++;
+    }
+    for (i = 0; i < (1u << h->depth); i++)
+    {
+        if (h->dir[i] == b && (i & (1u << depth)))
+            h->dir[i] = nb;
+    }
+    h->local[b] = depth + 1;
+    h->local[nb] = depth + 1;
+    h->buckets++;
+    if (db_msync(h, HASH_FILE_SIZE, MS_SYNC) == -1)
+        return ERR_DB_FILE;
+
+    if (write_bucket(fd, b, old_recs) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    return NO_ERROR;
+}
+
+/*
+ *  db_hash_alloc
+ *      ctx:    database context of a hashed database
+ *      fd:     database file descriptor
+ *      id:     id of the student about to be added
+ *      *slot:  receives the slot to write the student to
+ *
+ *  Finds a free slot in the bucket of id, splitting the bucket for as long
+ *  as it is full.  A slot holding the leftover of a split is free.  The
+ *  caller holds the file lock exclusively.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on I/O errors
+ */
+int db_hash_alloc(sdb_ctx_t *ctx, int fd, int id, off_t *slot)
+{
+    student_t recs[HASH_BUCKET_SLOTS];
+    uint32_t b;
+    int i;
+
+    for (;;)
+    {
+        b = hash_bucket(ctx->hash, id);
+        if (read_bucket(fd, b, recs) != NO_ERROR)
+            return ERR_DB_FILE;
+
+        for (i = 0; i < HASH_BUCKET_SLOTS; i++)
+        {
+            *slot = (off_t)b * HASH_BUCKET_SLOTS + i;
+            if (recs[i].id == DELETED_STUDENT_ID || !db_hash_owns(ctx, recs[i].id, *slot))
+                return NO_ERROR;
+        }
+
+        if (split_bucket(ctx, fd, b) != NO_ERROR)
+            return ERR_DB_FILE;
+    }
+}
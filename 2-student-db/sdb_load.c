@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+//bytes handed to one iovec when writing a run of records, a run longer
+//than LOAD_IOV_BYTES * LOAD_IOV_MAX takes more than one pwritev()
+#define LOAD_IOV_BYTES  (1024 * 1024)
+#define LOAD_IOV_MAX    64
+
+//loads of at least this many records rebuild the name index from scratch
+//instead of inserting one key at a time
+#define LOAD_NAMES_REBUILD  1024
+
+//longest CSV line we accept, comfortably more than id + names + gpa
+#define LOAD_LINE_MAX   256
+
+typedef struct load_set {
+    student_t *recs;                //records read from the load file
+    int       count;                //records in use
+    int       size;                 //records allocated
+    int       errors;               //records rejected while reading
+} load_set_t;
+
+static int load_append(load_set_t *set, const student_t *s)
+{
+    if (set->count == set->size)
+    {
+        int size = set->size ? set->size * 2 : 1024;
+        student_t *recs = realloc(set->recs, size * sizeof(student_t));
+
+        if (recs == NULL)
+            return ERR_DB_FILE;
+        set->recs = recs;
+        set->size = size;
+    }
+
+    set->recs[set->count++] = *s;
+    return NO_ERROR;
+}
+
+/*
+ *  load_binary
+ *      f:    load file, positioned at the start
+ *      set:  receives the records
+ *
+ *  A packed file is a plain array of student_t, so another student.db works
+ *  as a load file too.  Empty slots are skipped.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on read or memory errors
+ */
+static int load_binary(FILE *f, load_set_t *set)
+{
+    student_t s;
+
+    while (fread(&s, STUDENT_RECORD_SIZE, 1, f) == 1)
+    {
+        if (memcmp(&s, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE) == 0)
+            continue;
+
+        // names in a packed file are not trusted to be terminated
+        s.fname[sizeof(s.fname) - 1] = '\0';
+        s.lname[sizeof(s.lname) - 1] = '\0';
+        if (load_append(set, &s) != NO_ERROR)
+            return ERR_DB_FILE;
+    }
+
+    return ferror(f) ? ERR_DB_FILE : NO_ERROR;
+}
+
+static char *csv_field(char **cursor)
+{
+    char *start = *cursor;
+    char *end;
+
+    if (start == NULL)
+        return NULL;
+
+    end = strchr(start, ',');
+    if (end != NULL)
+    {
+        *end = '\0';
+        *cursor = end + 1;
+    }
+    else
+    {
+        *cursor = NULL;
+    }
+
+    while (isspace((unsigned char)*start))
+        start++;
+    end = start + strlen(start);
+    while (end > start && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+
+    return start;
+}
+
+static bool csv_int(const char *field, int *value)
+{
+    char *end;
+    long v;
+
+    if (field == NULL || *field == '\0')
+        return false;
+
+    v = strtol(field, &end, 10);
+    if (*end != '\0' || v < INT_MIN || v > INT_MAX)
+        return false;
+
+    *value = (int)v;
+    return true;
+}
+
+/*
+ *  load_csv
+ *      f:     load file, positioned at the start
+ *      name:  file name, for error messages
+ *      set:   receives the records
+ *
+ *  Each line is "id,first_name,last_name,gpa" with the gpa as a 3 digit int
+ *  just like -a takes it.  Blank lines and lines starting with # are
+ *  skipped, and so is a header line whose id column is not a number.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on read or memory errors
+ *
+ *  console:  M_ERR_LOAD_LINE for every line that cannot be parsed
+ */
+static int load_csv(FILE *f, const char *name, load_set_t *set)
+{
+    char line[LOAD_LINE_MAX];
+    int line_no = 0;
+
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        char *cursor = line;
+        char *id_field;
+        char *fname;
+        char *lname;
+        char *gpa_field;
+        student_t s = {0};
+
+        line_no++;
+        id_field = csv_field(&cursor);
+        if (*id_field == '\0' || *id_field == '#')
+            continue;
+
+        fname = csv_field(&cursor);
+        lname = csv_field(&cursor);
+        gpa_field = csv_field(&cursor);
+
+        if (line_no == 1 && !isdigit((unsigned char)*id_field) &&
+            *id_field != '-' && *id_field != '+')
+            continue;   // header line
+
+        if (!csv_int(id_field, &s.id) || !csv_int(gpa_field, &s.gpa) ||
+            fname == NULL || lname == NULL || cursor != NULL)
+        {
+            printf(M_ERR_LOAD_LINE, line_no, name);
+            set->errors++;
+            continue;
+        }
+
+        strncpy(s.fname, fname, sizeof(s.fname) - 1);
+        strncpy(s.lname, lname, sizeof(s.lname) - 1);
+        if (load_append(set, &s) != NO_ERROR)
+            return ERR_DB_FILE;
+    }
+
+    return ferror(f) ? ERR_DB_FILE : NO_ERROR;
+}
+
+static int cmp_id(const void *a, const void *b)
+{
+    const student_t *sa = a;
+    const student_t *sb = b;
+
+    return (sa->id > sb->id) - (sa->id < sb->id);
+}
+
+/*
+ *  write_run
+ *      fd:    database file descriptor
+ *      slot:  slot of the first record
+ *      recs:  records for consecutive slots
+ *      n:     number of records
+ *
+ *  Writes a run of records that belong in consecutive slots with as few
+ *  pwritev() calls as possible.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on write errors
+ */
+static int write_run(int fd, off_t slot, const student_t *recs, int n)
+{
+    const char *data = (const char *)recs;
+    size_t left = (size_t)n * STUDENT_RECORD_SIZE;
+    off_t off = slot * STUDENT_RECORD_SIZE;
+
+    SDB_COUNT(records_written, n);
+    while (left > 0)
+    {
+        struct iovec iov[LOAD_IOV_MAX];
+        size_t total = 0;
+        ssize_t written;
+        int cnt = 0;
+
+        while (cnt < LOAD_IOV_MAX && total < left)
+        {
+            size_t len = left - total;
+
+            if (len > LOAD_IOV_BYTES)
+                len = LOAD_IOV_BYTES;
+            iov[cnt].iov_base = (void *)(data + total);
+            iov[cnt].iov_len = len;
+            total += len;
+            cnt++;
+        }
+
+        written = pwritev(fd, iov, cnt, off);
+        if (written <= 0)
+            return ERR_DB_FILE;
+
+        data += written;
+        off += written;
+        left -= written;
+    }
+
+    return NO_ERROR;
+}
+
+/*
+ *  load_locked
+ *      fd:   database file descriptor
+ *      set:  records to load, sorted by id
+ *
+ *  The part of bulk_load() that runs with every id of the load locked:
+ *  the checks against the database and the writes.
+ *
+ *  returns:  NO_ERROR on success, otherwise what bulk_load() returns
+ */
+static int load_locked(int fd, load_set_t *set)
+{
+    off_t slot;
+    bool present;
+    int rc;
+    int i;
+    int j;
+
+    // validate everything, nothing is loaded if anything is wrong
+    for (i = 0; i < set->count; i++)
+    {
+        student_t *s = &set->recs[i];
+
+        if (validate_range(s->id, s->gpa) != NO_ERROR)
+        {
+            printf(M_ERR_LOAD_RNG, s->id);
+            set->errors++;
+            continue;
+        }
+
+        if (i > 0 && set->recs[i - 1].id == s->id)
+        {
+            printf(M_ERR_DB_ADD_DUP, s->id);
+            set->errors++;
+            continue;
+        }
+
+        if (db_bitmap_test(fd, s->id, &present))
+            rc = present ? NO_ERROR : SRCH_NOT_FOUND;
+        else
+            rc = db_find(fd, s->id, NULL, NULL);
+        if (rc == NO_ERROR)
+        {
+            printf(M_ERR_DB_ADD_DUP, s->id);
+            set->errors++;
+        }
+        else if (rc != SRCH_NOT_FOUND)
+        {
+            printf(M_ERR_DB_READ);
+            return ERR_DB_FILE;
+        }
+    }
+
+    if (set->errors > 0)
+        return ERR_DB_OP;
+
+    // the load is not logged, it ends with its own fsync.  Fold the log
+    // into the database first so a replay can never undo part of the load
+    rc = wal_checkpoint(fd);
+
+    // write runs of records that land in consecutive slots, in a packed
+    // file every new record is appended so the whole load is one run, in
+    // a hashed one every record goes to its own bucket.  A compact file
+    // writes record by record, the names go through its dictionary, and
+    // with --pool the records go through the buffer pool, which writes
+    // them back in batches of its own
+    db_change_begin(fd);
+    for (i = 0; i < set->count && rc == NO_ERROR; )
+    {
+        int layout = db_ctx(fd)->layout;
+        int run = 1;
+
+        if (layout == DB_LAYOUT_DIRECT)
+        {
+            while (i + run < set->count &&
+                   set->recs[i + run].id == set->recs[i].id + run)
+                run++;
+        }
+        else if (layout == DB_LAYOUT_PACKED)
+            run = set->count - i;
+
+        if (db_alloc_slot(fd, set->recs[i].id, run, &slot) != NO_ERROR)
+        {
+            rc = ERR_DB_FILE;
+            break;
+        }
+
+        if (layout == DB_LAYOUT_COMPACT || db_pool_enabled(db_ctx(fd)))
+        {
+            for (j = 0; j < run && rc == NO_ERROR; j++)
+                rc = db_write_slot(fd, slot + j, &set->recs[i + j]);
+        }
+        else
+            rc = write_run(fd, slot, &set->recs[i], run);
+        db_lock_records(fd, SDB_LOCK_META, 1, true);
+        for (; run > 0 && rc == NO_ERROR; run--, i++, slot++)
+        {
+            rc = db_index_set(fd, set->recs[i].id, slot);
+            db_bitmap_set(fd, set->recs[i].id, true);
+            db_gpa_set(fd, set->recs[i].id, set->recs[i].gpa, true);
+            db_col_set(fd, set->recs[i].id, set->recs[i].gpa, true);
+            if (set->count < LOAD_NAMES_REBUILD)
+                db_names_insert(fd, &set->recs[i]);
+        }
+        db_unlock_records(fd, SDB_LOCK_META, 1);
+    }
+
+    if (rc == NO_ERROR)
+        rc = db_sync(fd, true);
+    if (rc == NO_ERROR)
+    {
+        if (set->count >= LOAD_NAMES_REBUILD)
+            db_names_rebuild(fd);
+        db_change_commit(fd);
+    }
+
+    if (rc != NO_ERROR)
+    {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    return NO_ERROR;
+}
+
+
+/*
+ *  bulk_load
+ *      fd:    linux file descriptor
+ *      file:  CSV file or packed student_t file to load
+ *
+ *  Loads many students in one go.  The whole file is read and checked
+ *  before anything is written: every record must pass validate_range() and
+ *  its id must be new to both the file and the database, otherwise nothing
+ *  is loaded.  A file containing NUL bytes is taken to be packed student_t
+ *  records, anything else is CSV (see load_csv()).
+ *
+ *  The records are sorted by id and written as runs of consecutive slots
+ *  with pwritev(), followed by one fsync() for the whole load.
+ *
+ *  returns:  <number>       number of students loaded
+ *            ERR_DB_FILE    database or load file I/O issue
+ *            ERR_DB_OP      the load file has invalid or duplicate students
+ *
+ *  console:  M_LOAD_OK         on success
+ *            M_ERR_LOAD_OPEN   the load file cannot be opened
+ *            M_ERR_LOAD_LINE   a CSV line cannot be parsed
+ *            M_ERR_LOAD_RNG    id or gpa out of range
+ *            M_ERR_DB_ADD_DUP  student in the file twice or already in db
+ *            M_ERR_DB_READ     error reading the load file or database
+ *            M_ERR_DB_WRITE    error writing to the database
+ */
+int bulk_load(int fd, char *file)
+{
+    load_set_t set = {0};
+    char probe[STUDENT_RECORD_SIZE];
+    size_t probed;
+    FILE *f;
+    int lo;
+    int hi;
+    int rc;
+
+    f = fopen(file, "r");
+    if (f == NULL)
+    {
+        printf(M_ERR_LOAD_OPEN, file);
+        return ERR_DB_FILE;
+    }
+
+    // a NUL in the first record's worth of bytes means binary records
+    probed = fread(probe, 1, sizeof(probe), f);
+    rewind(f);
+    if (memchr(probe, '\0', probed) != NULL)
+        rc = load_binary(f, &set);
+    else
+        rc = load_csv(f, file, &set);
+    fclose(f);
+
+    if (rc != NO_ERROR)
+    {
+        printf(M_ERR_DB_READ);
+        free(set.recs);
+        return ERR_DB_FILE;
+    }
+
+    // sorting makes duplicates in the file show up next to each other and
+    // lets one record lock cover every id in the load.  Loads of disjoint
+    // id ranges run side by side, adds inside the range wait for the load
+    qsort(set.recs, set.count, sizeof(student_t), cmp_id);
+    lo = (set.count > 0) ? set.recs[0].id : 0;
+    hi = (set.count > 0) ? set.recs[set.count - 1].id : 0;
+    if (lo < MIN_STD_ID)
+        lo = MIN_STD_ID;
+    if (hi > HASH_MAX_STD_ID)
+        hi = HASH_MAX_STD_ID;
+
+    // a hashed database moves records when a bucket splits, nothing else
+    // may look at it while the load goes on
+    if (db_lock(fd, db_hashed(fd)) != NO_ERROR ||
+        (lo <= hi && db_lock_records(fd, lo, hi - lo + 1, true) != NO_ERROR))
+    {
+        db_unlock(fd);
+        printf(M_ERR_DB_READ);
+        free(set.recs);
+        return ERR_DB_FILE;
+    }
+    rc = load_locked(fd, &set);
+    if (lo <= hi)
+        db_unlock_records(fd, lo, hi - lo + 1);
+    db_unlock(fd);
+
+    if (rc != NO_ERROR)
+    {
+        free(set.recs);
+        return rc;
+    }
+
+    printf(M_LOAD_OK, set.count);
+    free(set.recs);
+    return set.count;
+}
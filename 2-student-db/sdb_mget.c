@@ -0,0 +1,612 @@
+#define _GNU_SOURCE     //preadv()
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  Multi-get looks up a list of ids in one process.  Ids are taken in
+ *  batches of MGET_BATCH; the slot of every id in a batch is worked out
+ *  first, the same way db_find() does, and then all the records are read
+ *  at once:
+ *
+ *    - through an io_uring of MGET_RING_DEPTH reads, so the whole batch
+ *      is in flight with a couple of system calls,
+ *    - or, where io_uring is not there (older kernels, seccomp filters),
+ *      with the slots sorted and every run of consecutive slots read by a
+ *      single preadv() straight into the result records.
+ *
+ *  Results come out in input order.  A batch holds the record locks of the
+ *  id span it reads shared, like get_student() does for one id.  With the
+ *  mmap backend the records are a memory access away already, so the ids
+ *  simply go through db_find().
+ */
+
+#define MGET_BATCH          4096
+#define MGET_RING_DEPTH     256
+#define MGET_IOV_MAX        1024
+#define MGET_ID_MAX         16      //longest id token taken from the input
+
+typedef struct mget_ring {
+    int      fd;                    //-1 if io_uring is not used
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void     *sq_ptr;
+    void     *cq_ptr;
+    size_t   sq_len;
+    size_t   cq_len;
+    size_t   sqes_len;
+} mget_ring_t;
+
+typedef struct mget_slot {
+    off_t slot;
+    int   i;                        //position in the batch
+} mget_slot_t;
+
+typedef struct mget {
+    mget_ring_t ring;
+    int         ids[MGET_BATCH];    //ids as given
+    int         sfd[MGET_BATCH];    //shard of each id
+    int         sid[MGET_BATCH];    //id in its shard
+    int         pos[MGET_BATCH];    //batch positions of one shard
+    int         sub_ids[MGET_BATCH];
+    off_t       slots[MGET_BATCH];
+    mget_slot_t order[MGET_BATCH];
+    student_t   sub_out[MGET_BATCH];
+    student_t   out[MGET_BATCH];
+} mget_t;
+
+static void ring_close(mget_ring_t *r)
+{
+    if (r->sqes != NULL && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED)
+        munmap(r->sq_ptr, r->sq_len);
+    if (r->fd != -1)
+        close(r->fd);
+
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+/*
+ *  ring_open
+ *      r:  ring to set up
+ *
+ *  Sets up an io_uring with raw system calls, there is no liburing to
+ *  lean on.  The submission and completion rings and the submission
+ *  entries are mapped from the ring descriptor.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE if io_uring cannot be used,
+ *            r->fd is -1 then
+ */
+static int ring_open(mget_ring_t *r)
+{
+    struct io_uring_params p;
+    char *sq;
+    char *cq;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+
+    r->fd = (int)syscall(__NR_io_uring_setup, MGET_RING_DEPTH, &p);
+    if (r->fd < 0)
+    {
+        r->fd = -1;
+        return ERR_DB_FILE;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+    {
+        ring_close(r);
+        return ERR_DB_FILE;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_ptr = r->sq_ptr;
+    else
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED)
+    {
+        ring_close(r);
+        return ERR_DB_FILE;
+    }
+
+    sq = r->sq_ptr;
+    cq = r->cq_ptr;
+    r->entries = p.sq_entries;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return NO_ERROR;
+}
+
+/*
+ *  ring_read
+ *      r:      ring set up by ring_open()
+ *      fd:     database file descriptor
+ *      slots:  slot of every record to read, -1 to skip it
+ *      n:      number of slots
+ *      out:    receives the records, zeroed by the caller
+ *
+ *  Keeps up to the ring size of record reads in flight until every slot
+ *  has been read.  A read that comes back short or failed is done again
+ *  with pread(), which also covers kernels whose io_uring has no
+ *  IORING_OP_READ yet; those turn the ring off for the next batches.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on I/O errors
+ */
+static int ring_read(mget_ring_t *r, int fd, const off_t *slots, int n, student_t *out)
+{
+    unsigned inflight = 0;
+    bool no_read_op = false;
+    int next = 0;
+    int rc = NO_ERROR;
+
+    while (next < n || inflight > 0)
+    {
+        unsigned tail = *r->sq_tail;
+        unsigned head;
+        unsigned queued = 0;
+        int got;
+
+        while (next < n && inflight + queued < r->entries)
+        {
+            unsigned idx = tail & *r->sq_mask;
+            struct io_uring_sqe *sqe = &r->sqes[idx];
+
+            if (slots[next] < 0)
+            {
+                next++;
+                continue;
+            }
+
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->off = (uint64_t)slots[next] * STUDENT_RECORD_SIZE;
+            sqe->addr = (uint64_t)(uintptr_t)&out[next];
+            sqe->len = STUDENT_RECORD_SIZE;
+            sqe->user_data = (uint64_t)next;
+            r->sq_array[idx] = idx;
+            tail++;
+            queued++;
+            next++;
+        }
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+        inflight += queued;
+        if (inflight == 0)
+            break;
+
+        got = (int)syscall(__NR_io_uring_enter, r->fd, queued, 1,
+                           IORING_ENTER_GETEVENTS, NULL, 0);
+        if (got < 0 && errno != EINTR)
+        {
+            // the reads already queued may still land in out, the ring is
+            // not used again and the caller gives up on the batch
+            ring_close(r);
+            return ERR_DB_FILE;
+        }
+
+        head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            int i = (int)cqe->user_data;
+
+            if (cqe->res != STUDENT_RECORD_SIZE)
+            {
+                ssize_t got_bytes = pread(fd, &out[i], STUDENT_RECORD_SIZE,
+                                          slots[i] * STUDENT_RECORD_SIZE);
+
+                if (cqe->res == -EINVAL)
+                    no_read_op = true;
+                if (got_bytes == 0)
+                    memset(&out[i], 0, STUDENT_RECORD_SIZE);
+                else if (got_bytes != STUDENT_RECORD_SIZE)
+                    rc = ERR_DB_FILE;
+            }
+            head++;
+            inflight--;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    if (no_read_op)
+        ring_close(r);
+    return rc;
+}
+
+static int cmp_slot(const void *a, const void *b)
+{
+    off_t sa = ((const mget_slot_t *)a)->slot;
+    off_t sb = ((const mget_slot_t *)b)->slot;
+
+    return (sa > sb) - (sa < sb);
+}
+
+/*
+ *  vector_read
+ *      fd:     database file descriptor
+ *      slots:  slot of every record to read, -1 to skip it
+ *      n:      number of slots
+ *      order:  scratch space for n slots
+ *      out:    receives the records, zeroed by the caller
+ *
+ *  Sorts the slots and reads each run of consecutive slots with one
+ *  preadv(), scattering the records to where they sit in the batch.  Past
+ *  the end of the file the records stay zero.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on I/O errors
+ */
+static int vector_read(int fd, const off_t *slots, int n, mget_slot_t *order,
+                       student_t *out)
+{
+    struct iovec iov[MGET_IOV_MAX];
+    int k = 0;
+    int a;
+    int b;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (slots[i] >= 0)
+        {
+            order[k].slot = slots[i];
+            order[k].i = i;
+            k++;
+        }
+    }
+    qsort(order, k, sizeof(order[0]), cmp_slot);
+
+    for (a = 0; a < k; a = b)
+    {
+        for (b = a + 1; b < k && b - a < MGET_IOV_MAX &&
+             order[b].slot == order[b - 1].slot + 1; b++)
+            ;
+
+        for (i = a; i < b; i++)
+        {
+            iov[i - a].iov_base = &out[order[i].i];
+            iov[i - a].iov_len = STUDENT_RECORD_SIZE;
+        }
+
+        if (preadv(fd, iov, b - a, order[a].slot * STUDENT_RECORD_SIZE) == -1)
+            return ERR_DB_FILE;
+    }
+
+    return NO_ERROR;
+}
+
+/*
+ *  find_batch
+ *      m:    multi-get state, the ids are in m->sub_ids
+ *      fd:   database (or shard) file descriptor
+ *      n:    number of ids
+ *
+ *  Reads the students for n ids into m->sub_out, a student that is not in
+ *  the database comes back zeroed.  A record that does not carry the id it
+ *  was read for means the layout or index moved under us, those ids go
+ *  through db_find() which sorts that out.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on I/O errors
+ */
+static int find_batch(mget_t *m, int fd, int n)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+    student_t *out = m->sub_out;
+    bool packed;
+    bool direct;
+    int max;
+    int rc;
+    int i;
+
+    if (ctx == NULL)
+        return ERR_DB_FILE;
+
+    memset(out, 0, n * sizeof(student_t));
+    packed = (ctx->layout == DB_LAYOUT_PACKED);
+    direct = (ctx->layout == DB_LAYOUT_DIRECT);
+    max = (ctx->layout == DB_LAYOUT_HASH) ? HASH_MAX_STD_ID : MAX_STD_ID;
+
+    // a hashed database reads one bucket per id, db_find() does that
+    for (i = 0; i < n; i++)
+    {
+        int id = m->sub_ids[i];
+
+        if ((id < MIN_STD_ID) || (id > max))
+            m->slots[i] = -1;
+        else if (sdb_config.use_mmap || !(packed || direct))
+            m->slots[i] = -1;
+        else if (packed)
+            m->slots[i] = (ctx->idx[id] == 0) ? -1 : (off_t)ctx->idx[id] - 1;
+        else
+            m->slots[i] = id;
+    }
+
+    if (sdb_config.use_mmap)
+        rc = NO_ERROR;
+    else if (m->ring.fd != -1)
+        rc = ring_read(&m->ring, fd, m->slots, n, out);
+    else
+        rc = vector_read(fd, m->slots, n, m->order, out);
+    if (rc != NO_ERROR)
+        return rc;
+
+    for (i = 0; i < n; i++)
+    {
+        int id = m->sub_ids[i];
+
+        if (m->slots[i] >= 0)
+            SDB_COUNT(records_read, 1);
+        if (out[i].id == id && m->slots[i] >= 0)
+            continue;
+
+        if ((id < MIN_STD_ID) || (id > max) ||
+            (!sdb_config.use_mmap && direct && out[i].id == DELETED_STUDENT_ID))
+        {
+            memset(&out[i], 0, STUDENT_RECORD_SIZE);
+            continue;
+        }
+
+        rc = db_find(fd, id, NULL, &out[i]);
+        if (rc == ERR_DB_FILE)
+            return rc;
+        if (rc != NO_ERROR)
+            memset(&out[i], 0, STUDENT_RECORD_SIZE);
+    }
+
+    return NO_ERROR;
+}
+
+/*
+ *  get_batch
+ *      m:    multi-get state, the ids are in m->ids
+ *      fd:   database file descriptor
+ *      n:    number of ids
+ *
+ *  Looks up a batch of ids into m->out, shard by shard on a sharded
+ *  database.  Each shard holds the file lock and the record locks of the
+ *  id span it reads shared while it reads.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on I/O errors
+ */
+static int get_batch(mget_t *m, int fd, int n)
+{
+    int rc = NO_ERROR;
+    int i;
+    int j;
+
+    for (i = 0; i < n; i++)
+    {
+        int base;
+
+        m->sfd[i] = db_shard(fd, m->ids[i], &base);
+        m->sid[i] = m->ids[i] - base;
+    }
+
+    for (i = 0; i < n && rc == NO_ERROR; i++)
+    {
+        int sfd = m->sfd[i];
+        int lo = MAX_STD_ID + 1;
+        int hi = MIN_STD_ID - 1;
+        int k = 0;
+
+        if (sfd == -1)
+            continue;
+
+        for (j = i; j < n; j++)
+        {
+            if (m->sfd[j] != sfd)
+                continue;
+
+            m->pos[k] = j;
+            m->sub_ids[k++] = m->sid[j];
+            if (m->sid[j] >= MIN_STD_ID && m->sid[j] <= HASH_MAX_STD_ID)
+            {
+                lo = (m->sid[j] < lo) ? m->sid[j] : lo;
+                hi = (m->sid[j] > hi) ? m->sid[j] : hi;
+            }
+            m->sfd[j] = -1;
+        }
+
+        if (db_lock(sfd, false) != NO_ERROR)
+            return ERR_DB_FILE;
+        if (lo <= hi && db_lock_records(sfd, lo, hi - lo + 1, false) != NO_ERROR)
+        {
+            db_unlock(sfd);
+            return ERR_DB_FILE;
+        }
+
+        rc = find_batch(m, sfd, k);
+
+        if (lo <= hi)
+            db_unlock_records(sfd, lo, hi - lo + 1);
+        db_unlock(sfd);
+
+        for (j = 0; j < k; j++)
+        {
+            m->out[m->pos[j]] = m->sub_out[j];
+            if (m->out[m->pos[j]].id != DELETED_STUDENT_ID)
+                m->out[m->pos[j]].id = m->ids[m->pos[j]];
+        }
+    }
+
+    return rc;
+}
+
+/*
+ *  print_batch
+ *      m:        multi-get state with a batch looked up
+ *      n:        number of ids
+ *      *header:  whether the header has been printed yet
+ *
+ *  returns:  number of ids that were not found
+ */
+static int print_batch(mget_t *m, int n, bool *header)
+{
+    int missing = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        student_t *s = &m->out[i];
+
+        if (s->id == DELETED_STUDENT_ID)
+        {
+            printf(M_STD_NOT_FND_MSG, m->ids[i]);
+            missing++;
+            continue;
+        }
+
+        if (!*header)
+        {
+            printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST NAME", "LAST_NAME", "GPA");
+            *header = true;
+        }
+        printf(STUDENT_PRINT_FMT_STRING, s->id, s->fname, s->lname, s->gpa / 100.0);
+    }
+
+    return missing;
+}
+
+/*
+ *  get_students
+ *      fd:    database file descriptor
+ *      file:  file with the ids to look up, NULL or "-" for stdin
+ *
+ *  Looks up every id in file, the ids are separated by white space (one
+ *  per line, say).  The students found are printed under one header and
+ *  the ids not found with the message -f prints, both in input order.
+ *
+ *  returns:  number of ids that were not found
+ *            ERR_DB_FILE    database or id file I/O issue
+ *            ERR_DB_OP      the id file holds something that is not an id
+ *
+ *  console:  STUDENT_PRINT_HDR_STRING and a row for each student found
+ *            M_STD_NOT_FND_MSG for each id not found
+ *            M_ERR_LOAD_OPEN  the id file cannot be opened
+ *            M_ERR_MGET_ID    a token in the file is not an id
+ *            M_ERR_DB_READ    error reading the database
+ */
+int get_students(int fd, char *file)
+{
+    char tok[MGET_ID_MAX + 1];
+    bool header = false;
+    int missing = 0;
+    int rc = NO_ERROR;
+    int n = 0;
+    FILE *in = stdin;
+    mget_t *m;
+
+    if (file != NULL && strcmp(file, "-") != 0)
+    {
+        in = fopen(file, "r");
+        if (in == NULL)
+        {
+            printf(M_ERR_LOAD_OPEN, file);
+            return ERR_DB_FILE;
+        }
+    }
+
+    m = malloc(sizeof(*m));
+    if (m == NULL)
+    {
+        if (in != stdin)
+            fclose(in);
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    ring_open(&m->ring);
+
+    for (;;)
+    {
+        bool more = (fscanf(in, "%16s", tok) == 1);
+        char *end;
+        long id = 0;
+
+        if (more)
+        {
+            errno = 0;
+            id = strtol(tok, &end, 10);
+            if (*end != '\0' || errno != 0 || id < 0 || id > INT_MAX)
+            {
+                more = false;
+                rc = ERR_DB_OP;
+            }
+            else
+                m->ids[n++] = (int)id;
+        }
+
+        if (n == MGET_BATCH || (!more && n > 0))
+        {
+            if (get_batch(m, fd, n) != NO_ERROR)
+            {
+                rc = ERR_DB_FILE;
+                break;
+            }
+            missing += print_batch(m, n, &header);
+            n = 0;
+        }
+
+        if (!more)
+            break;
+    }
+
+    if (rc == NO_ERROR && ferror(in))
+        rc = ERR_DB_FILE;
+
+    if (rc == ERR_DB_OP)
+        printf(M_ERR_MGET_ID, tok);
+    else if (rc == ERR_DB_FILE)
+        printf(M_ERR_DB_READ);
+
+    ring_close(&m->ring);
+    free(m);
+    if (in != stdin)
+        fclose(in);
+
+    return (rc != NO_ERROR) ? rc : missing;
+}
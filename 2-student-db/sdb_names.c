@@ -0,0 +1,768 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  The last name index is a sidecar file (.student.db.name) holding a B+tree
+ *  of (last name, first name, id) keys.  Every node is one NAME_PAGE_SIZE
+ *  page read and written with pread()/pwrite(), so finding the first key of
+ *  a prefix costs one page per level of the tree.  Leaves are chained in
+ *  key order, a prefix query walks the chain until the last name stops
+ *  matching.
+ *
+ *  The tree is kept consistent with the same protocol as the occupancy
+ *  bitmap: db_names_begin() counts the change as in flight in the header,
+ *  the database and the tree are changed, and db_names_commit() takes it
+ *  off the count again, stamping the header with the database file once no
+ *  change is left in flight.  A tree with changes in flight or whose stamp
+ *  does not match is rebuilt from a scan on open.
+ *
+ *  Removing a key never merges or frees pages, a leaf can run empty and
+ *  stays in the chain.  The tree is rebuilt tight whenever the database is
+ *  rewritten by compress_db(), which is also the only way to give deleted
+ *  records' space back.
+ *
+ *  Changes hold an exclusive flock() on the index, queries a shared one.
+ */
+
+_Static_assert(sizeof(name_page_t) <= NAME_PAGE_SIZE, "name_page_t must fit a page");
+_Static_assert(sizeof(name_header_t) <= NAME_PAGE_SIZE, "name_header_t must fit a page");
+
+typedef struct key_set {
+    name_key_t *keys;               //keys collected from the database
+    int        count;               //keys in use
+    int        size;                //keys allocated
+} key_set_t;
+
+static void key_make(name_key_t *k, const student_t *s)
+{
+    memset(k, 0, sizeof(*k));
+    memcpy(k->lname, s->lname, strnlen(s->lname, sizeof(k->lname) - 1));
+    memcpy(k->fname, s->fname, strnlen(s->fname, sizeof(k->fname) - 1));
+    k->id = s->id;
+}
+
+static int key_cmp(const name_key_t *a, const name_key_t *b)
+{
+    int rc = strncmp(a->lname, b->lname, sizeof(a->lname));
+
+    if (rc == 0)
+        rc = strncmp(a->fname, b->fname, sizeof(a->fname));
+    if (rc == 0)
+        rc = (a->id > b->id) - (a->id < b->id);
+
+    return rc;
+}
+
+static int key_cmp_qsort(const void *a, const void *b)
+{
+    return key_cmp(a, b);
+}
+
+// first position whose key is >= k (lower) or > k (upper)
+static int key_search(const name_key_t *keys, int n, const name_key_t *k, bool upper)
+{
+    int lo = 0;
+    int hi = n;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        int rc = key_cmp(&keys[mid], k);
+
+        if (rc < 0 || (upper && rc == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static int page_read(int nfd, uint32_t pgno, name_page_t *page)
+{
+    if (pread(nfd, page, sizeof(*page), (off_t)pgno * NAME_PAGE_SIZE) != sizeof(*page))
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+static int page_write(int nfd, uint32_t pgno, const name_page_t *page)
+{
+    if (pwrite(nfd, page, sizeof(*page), (off_t)pgno * NAME_PAGE_SIZE) != sizeof(*page))
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+static int header_read(int nfd, name_header_t *hdr)
+{
+    if (pread(nfd, hdr, sizeof(*hdr), 0) != sizeof(*hdr))
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+static int header_write(int nfd, const name_header_t *hdr)
+{
+    if (pwrite(nfd, hdr, sizeof(*hdr), 0) != sizeof(*hdr))
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+static int collect_key(const student_t *s, off_t slot, void *arg)
+{
+    key_set_t *set = arg;
+
+    (void)slot;
+    if (set->count == set->size)
+    {
+        int size = set->size ? set->size * 2 : 1024;
+        name_key_t *keys = realloc(set->keys, size * sizeof(name_key_t));
+
+        if (keys == NULL)
+            return ERR_DB_FILE;
+        set->keys = keys;
+        set->size = size;
+    }
+
+    key_make(&set->keys[set->count++], s);
+    return NO_ERROR;
+}
+
+/*
+ *  build_level
+ *      nfd:     index file descriptor
+ *      hdr:     header, hdr->pages is the next free page
+ *      pages:   page numbers of the nodes on the level below
+ *      firsts:  smallest key under each of those nodes
+ *      n:       number of nodes on the level below
+ *
+ *  Writes one level of inner nodes over the level below and replaces pages
+ *  and firsts with the nodes just written.
+ *
+ *  returns:  number of nodes written, ERR_DB_FILE on write errors
+ */
+static int build_level(int nfd, name_header_t *hdr, uint32_t *pages,
+                       name_key_t *firsts, int n)
+{
+    name_page_t page;
+    int written = 0;
+    int i = 0;
+
+    while (i < n)
+    {
+        int take = n - i;
+        int j;
+
+        if (take > (int)NAME_INNER_KEYS + 1)
+            take = NAME_INNER_KEYS + 1;
+
+        memset(&page, 0, sizeof(page));
+        page.count = take - 1;
+        for (j = 0; j < take; j++)
+        {
+            page.inner.child[j] = pages[i + j];
+            if (j > 0)
+                page.inner.keys[j - 1] = firsts[i + j];
+        }
+
+        if (page_write(nfd, hdr->pages, &page) != NO_ERROR)
+            return ERR_DB_FILE;
+
+        firsts[written] = firsts[i];
+        pages[written++] = hdr->pages++;
+        i += take;
+    }
+
+    return written;
+}
+
+/*
+ *  names_rebuild
+ *      ctx:       database context with an open index
+ *      inflight:  changes in flight the new header counts
+ *
+ *  Throws the tree away and builds it again bottom up: the keys of every
+ *  record are collected with db_scan() and sorted, written out as full
+ *  leaves, then one level of inner nodes at a time is written over them
+ *  until a single root is left.  The caller holds the exclusive lock.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int names_rebuild(sdb_ctx_t *ctx, uint32_t inflight)
+{
+    name_header_t hdr = {0};
+    key_set_t set = {0};
+    name_page_t page;
+    uint32_t *pages = NULL;
+    name_key_t *firsts = NULL;
+    int nodes = 0;
+    int rc = NO_ERROR;
+    int i;
+
+    if (db_scan(ctx->fd, collect_key, &set) != NO_ERROR)
+    {
+        free(set.keys);
+        return ERR_DB_FILE;
+    }
+    qsort(set.keys, set.count, sizeof(name_key_t), key_cmp_qsort);
+
+    hdr.magic = NAME_MAGIC;
+    hdr.version = NAME_VERSION;
+    hdr.pages = 1;
+    hdr.height = 1;
+    hdr.count = set.count;
+    hdr.inflight = inflight;
+
+    // the leaf level, an empty tree is a single empty leaf
+    nodes = (set.count + NAME_LEAF_KEYS - 1) / NAME_LEAF_KEYS;
+    if (nodes == 0)
+        nodes = 1;
+    pages = malloc(nodes * sizeof(uint32_t));
+    firsts = malloc(nodes * sizeof(name_key_t));
+    if (pages == NULL || firsts == NULL || ftruncate(ctx->names_fd, 0) == -1)
+        rc = ERR_DB_FILE;
+
+    for (i = 0; i < nodes && rc == NO_ERROR; i++)
+    {
+        int start = i * NAME_LEAF_KEYS;
+        int take = set.count - start;
+
+        if (take > (int)NAME_LEAF_KEYS)
+            take = NAME_LEAF_KEYS;
+
+        memset(&page, 0, sizeof(page));
+        page.leaf = 1;
+        page.count = take;
+        page.next = (i + 1 < nodes) ? hdr.pages + 1 : 0;
+        if (take > 0)
+        {
+            memcpy(page.keys, &set.keys[start], take * sizeof(name_key_t));
+            firsts[i] = set.keys[start];
+        }
+
+        pages[i] = hdr.pages;
+        rc = page_write(ctx->names_fd, hdr.pages++, &page);
+    }
+
+    while (rc == NO_ERROR && nodes > 1)
+    {
+        nodes = build_level(ctx->names_fd, &hdr, pages, firsts, nodes);
+        if (nodes < 0)
+            rc = ERR_DB_FILE;
+        hdr.height++;
+    }
+
+    if (rc == NO_ERROR)
+    {
+        hdr.root = pages[0];
+        rc = db_stamp(ctx->fd, &hdr.stamp);
+    }
+    if (rc == NO_ERROR)
+        rc = header_write(ctx->names_fd, &hdr);
+
+    free(pages);
+    free(firsts);
+    free(set.keys);
+    return rc;
+}
+
+/*
+ *  insert_key
+ *      nfd:      index file descriptor
+ *      hdr:      header of the tree, updated as pages are added
+ *      pgno:     node to insert below
+ *      k:        key to insert
+ *      *up_key:  receives the separator if the node was split
+ *      *up_page: receives the new right hand node if the node was split
+ *
+ *  Inserts below pgno, splitting full nodes on the way back up.
+ *
+ *  returns:  1 if pgno was split, 0 if not, ERR_DB_FILE on I/O errors
+ */
+static int insert_key(int nfd, name_header_t *hdr, uint32_t pgno, const name_key_t *k,
+                      name_key_t *up_key, uint32_t *up_page)
+{
+    name_page_t page;
+    name_page_t right;
+    int pos;
+    int rc;
+
+    if (page_read(nfd, pgno, &page) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    if (page.leaf)
+    {
+        name_key_t keys[NAME_LEAF_KEYS + 1];
+        int n = page.count;
+        int half;
+
+        pos = key_search(page.keys, n, k, false);
+        if (pos < n && key_cmp(&page.keys[pos], k) == 0)
+            return 0;   // already indexed
+        hdr->count++;
+
+        if (n < (int)NAME_LEAF_KEYS)
+        {
+            memmove(&page.keys[pos + 1], &page.keys[pos], (n - pos) * sizeof(name_key_t));
+            page.keys[pos] = *k;
+            page.count++;
+            return (page_write(nfd, pgno, &page) == NO_ERROR) ? 0 : ERR_DB_FILE;
+        }
+
+        // full, split the keys between this leaf and a new one after it
+        memcpy(keys, page.keys, pos * sizeof(name_key_t));
+        keys[pos] = *k;
+        memcpy(&keys[pos + 1], &page.keys[pos], (n - pos) * sizeof(name_key_t));
+        half = (n + 1) / 2;
+
+        memset(&right, 0, sizeof(right));
+        right.leaf = 1;
+        right.count = n + 1 - half;
+        right.next = page.next;
+        memcpy(right.keys, &keys[half], right.count * sizeof(name_key_t));
+
+        page.count = half;
+        page.next = hdr->pages;
+        memcpy(page.keys, keys, half * sizeof(name_key_t));
+
+        *up_key = right.keys[0];
+        *up_page = hdr->pages++;
+    }
+    else
+    {
+        name_key_t keys[NAME_INNER_KEYS + 1];
+        uint32_t child[NAME_INNER_KEYS + 2];
+        name_key_t sep;
+        uint32_t new_page;
+        int n = page.count;
+        int half;
+
+        pos = key_search(page.inner.keys, n, k, true);
+        rc = insert_key(nfd, hdr, page.inner.child[pos], k, &sep, &new_page);
+        if (rc <= 0)
+            return rc;
+
+        // the child split, its new sibling goes right after it
+        memcpy(keys, page.inner.keys, pos * sizeof(name_key_t));
+        keys[pos] = sep;
+        memcpy(&keys[pos + 1], &page.inner.keys[pos], (n - pos) * sizeof(name_key_t));
+        memcpy(child, page.inner.child, (pos + 1) * sizeof(uint32_t));
+        child[pos + 1] = new_page;
+        memcpy(&child[pos + 2], &page.inner.child[pos + 1], (n - pos) * sizeof(uint32_t));
+        n++;
+
+        if (n <= (int)NAME_INNER_KEYS)
+        {
+            memcpy(page.inner.keys, keys, n * sizeof(name_key_t));
+            memcpy(page.inner.child, child, (n + 1) * sizeof(uint32_t));
+            page.count = n;
+            return (page_write(nfd, pgno, &page) == NO_ERROR) ? 0 : ERR_DB_FILE;
+        }
+
+        // full, the middle key moves up and the rest is split in two
+        half = n / 2;
+
+        memset(&right, 0, sizeof(right));
+        right.count = n - half - 1;
+        memcpy(right.inner.keys, &keys[half + 1], right.count * sizeof(name_key_t));
+        memcpy(right.inner.child, &child[half + 1], (right.count + 1) * sizeof(uint32_t));
+
+        page.count = half;
+        memcpy(page.inner.keys, keys, half * sizeof(name_key_t));
+        memcpy(page.inner.child, child, (half + 1) * sizeof(uint32_t));
+
+        *up_key = keys[half];
+        *up_page = hdr->pages++;
+    }
+
+    if (page_write(nfd, *up_page, &right) != NO_ERROR ||
+        page_write(nfd, pgno, &page) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    return 1;
+}
+
+/*
+ *  find_leaf
+ *      nfd:    index file descriptor
+ *      hdr:    header of the tree
+ *      k:      key to look for
+ *      *pgno:  receives the page number of the leaf
+ *      *page:  receives the leaf
+ *
+ *  Walks from the root to the leaf that k belongs in, one page per level.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on I/O errors
+ */
+static int find_leaf(int nfd, const name_header_t *hdr, const name_key_t *k,
+                     uint32_t *pgno, name_page_t *page)
+{
+    uint32_t level;
+
+    *pgno = hdr->root;
+    for (level = 0; level < hdr->height; level++)
+    {
+        if (page_read(nfd, *pgno, page) != NO_ERROR)
+            return ERR_DB_FILE;
+        if (page->leaf)
+            return NO_ERROR;
+        *pgno = page->inner.child[key_search(page->inner.keys, page->count, k, true)];
+    }
+
+    return ERR_DB_FILE;     // deeper than the header says, corrupt
+}
+
+// a change to the tree failed part way.  The header on disk still counts
+// the change as in flight, stop using the index so the next open rebuilds it
+static void names_drop(sdb_ctx_t *ctx)
+{
+    close(ctx->names_fd);
+    ctx->names_fd = -1;
+}
+
+/*
+ *  db_names_open
+ *      ctx:  database context, layout already worked out
+ *
+ *  Opens the last name index of the database, creating or rebuilding it
+ *  when needed.  If the index cannot be used ctx->names_fd stays -1 and
+ *  name queries fall back to scanning the database.
+ *
+ *  returns:  NO_ERROR if the index is usable, ERR_DB_FILE otherwise
+ */
+int db_names_open(sdb_ctx_t *ctx)
+{
+    char names_path[PATH_MAX];
+    name_header_t hdr;
+    int rc = NO_ERROR;
+
+    ctx->names_fd = -1;
+    if (db_sidecar_path(ctx->path, NAME_SIDECAR, names_path) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    ctx->names_fd = open(names_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (ctx->names_fd == -1)
+        return ERR_DB_FILE;
+
+    if (flock(ctx->names_fd, LOCK_EX) == -1)
+    {
+        names_drop(ctx);
+        return ERR_DB_FILE;
+    }
+
+    if (header_read(ctx->names_fd, &hdr) != NO_ERROR ||
+        hdr.magic != NAME_MAGIC || hdr.version != NAME_VERSION ||
+        hdr.inflight != 0 || !db_stamp_matches(ctx->fd, &hdr.stamp))
+        rc = names_rebuild(ctx, 0);
+
+    flock(ctx->names_fd, LOCK_UN);
+    if (rc != NO_ERROR)
+        names_drop(ctx);
+
+    return rc;
+}
+
+/*
+ *  db_names_close
+ *      ctx:  database context
+ */
+void db_names_close(sdb_ctx_t *ctx)
+{
+    if (ctx->names_fd != -1)
+        close(ctx->names_fd);
+    ctx->names_fd = -1;
+}
+
+/*
+ *  db_names_begin / db_names_insert / db_names_remove / db_names_commit
+ *      fd:  database file descriptor
+ *      *s:  record whose key is added or removed
+ *
+ *  Bracket a change to the database, see the protocol at the top of this
+ *  file.  Inserting a key that is already there or removing one that is
+ *  not is a no-op.  These are no-ops without an index.
+ */
+void db_names_begin(int fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+    name_header_t hdr;
+
+    if (ctx == NULL || ctx->names_fd == -1)
+        return;
+
+    flock(ctx->names_fd, LOCK_EX);
+    if (header_read(ctx->names_fd, &hdr) == NO_ERROR)
+    {
+        hdr.inflight++;
+        if (header_write(ctx->names_fd, &hdr) != NO_ERROR)
+            names_drop(ctx);
+    }
+    else
+    {
+        names_drop(ctx);
+    }
+
+    if (ctx->names_fd != -1)
+        flock(ctx->names_fd, LOCK_UN);
+}
+
+void db_names_insert(int fd, const student_t *s)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+    name_header_t hdr;
+    name_page_t root;
+    name_key_t k;
+    name_key_t up_key;
+    uint32_t up_page;
+    int rc;
+
+    if (ctx == NULL || ctx->names_fd == -1)
+        return;
+
+    key_make(&k, s);
+    flock(ctx->names_fd, LOCK_EX);
+
+    rc = header_read(ctx->names_fd, &hdr);
+    if (rc == NO_ERROR)
+        rc = insert_key(ctx->names_fd, &hdr, hdr.root, &k, &up_key, &up_page);
+
+    // the root split, grow the tree by one level
+    if (rc == 1)
+    {
+        memset(&root, 0, sizeof(root));
+        root.count = 1;
+        root.inner.keys[0] = up_key;
+        root.inner.child[0] = hdr.root;
+        root.inner.child[1] = up_page;
+        hdr.root = hdr.pages++;
+        hdr.height++;
+        rc = page_write(ctx->names_fd, hdr.root, &root);
+    }
+
+    if (rc == NO_ERROR)
+        rc = header_write(ctx->names_fd, &hdr);
+
+    if (rc != NO_ERROR)
+        names_drop(ctx);
+    else
+        flock(ctx->names_fd, LOCK_UN);
+}
+
+void db_names_remove(int fd, const student_t *s)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+    name_header_t hdr;
+    name_page_t page;
+    name_key_t k;
+    uint32_t pgno;
+    int rc;
+    int pos;
+
+    if (ctx == NULL || ctx->names_fd == -1)
+        return;
+
+    key_make(&k, s);
+    flock(ctx->names_fd, LOCK_EX);
+
+    rc = header_read(ctx->names_fd, &hdr);
+    if (rc == NO_ERROR)
+        rc = find_leaf(ctx->names_fd, &hdr, &k, &pgno, &page);
+
+    if (rc == NO_ERROR)
+    {
+        pos = key_search(page.keys, page.count, &k, false);
+        if (pos < page.count && key_cmp(&page.keys[pos], &k) == 0)
+        {
+            memmove(&page.keys[pos], &page.keys[pos + 1],
+                    (page.count - pos - 1) * sizeof(name_key_t));
+            page.count--;
+            hdr.count--;
+            rc = page_write(ctx->names_fd, pgno, &page);
+            if (rc == NO_ERROR)
+                rc = header_write(ctx->names_fd, &hdr);
+        }
+    }
+
+    if (rc != NO_ERROR)
+        names_drop(ctx);
+    else
+        flock(ctx->names_fd, LOCK_UN);
+}
+
+void db_names_commit(int fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+    name_header_t hdr;
+
+    if (ctx == NULL || ctx->names_fd == -1)
+        return;
+
+    flock(ctx->names_fd, LOCK_EX);
+    if (header_read(ctx->names_fd, &hdr) == NO_ERROR)
+    {
+        // a rebuild by another process may already have cleared the count
+        if (hdr.inflight > 0)
+            hdr.inflight--;
+        if (hdr.inflight == 0)
+            db_stamp(fd, &hdr.stamp);
+        header_write(ctx->names_fd, &hdr);
+    }
+    flock(ctx->names_fd, LOCK_UN);
+}
+
+/*
+ *  db_names_rebuild
+ *      fd:  database file descriptor
+ *
+ *  Builds the index again from the database, cheaper than inserting the
+ *  keys one at a time after a large change such as a bulk load.  It runs
+ *  inside the change, the changes in flight are carried over to the new
+ *  header and db_names_commit() still ends the change.
+ */
+void db_names_rebuild(int fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+    name_header_t hdr;
+
+    if (ctx == NULL || ctx->names_fd == -1)
+        return;
+
+    flock(ctx->names_fd, LOCK_EX);
+    if (header_read(ctx->names_fd, &hdr) != NO_ERROR || hdr.inflight == 0)
+        hdr.inflight = 1;
+    if (names_rebuild(ctx, hdr.inflight) != NO_ERROR)
+        names_drop(ctx);
+    else
+        flock(ctx->names_fd, LOCK_UN);
+}
+
+typedef struct prefix_filter {
+    const char *prefix;             //last name prefix to match
+    size_t     len;                 //strlen(prefix)
+    key_set_t  set;                 //matching keys
+} prefix_filter_t;
+
+static bool prefix_match(const char *lname, const prefix_filter_t *filter)
+{
+    return strncmp(lname, filter->prefix, filter->len) == 0;
+}
+
+static int collect_match(const student_t *s, off_t slot, void *arg)
+{
+    prefix_filter_t *filter = arg;
+
+    if (!prefix_match(s->lname, filter))
+        return NO_ERROR;
+    return collect_key(s, slot, &filter->set);
+}
+
+/*
+ *  visit_id
+ *      fd:      database file descriptor
+ *      k:       key found for the id
+ *      fn/arg:  callback of db_names_scan()
+ *
+ *  Reads the record behind a key and hands it to the callback.  A record
+ *  that is gone or has been renamed since the key was read is skipped.
+ *
+ *  returns:  NO_ERROR, ERR_DB_FILE or whatever the callback returned
+ */
+static int visit_id(int fd, const name_key_t *k, db_scan_fn fn, void *arg)
+{
+    name_key_t now;
+    student_t s;
+    off_t slot;
+    int rc;
+
+    rc = db_find(fd, k->id, &slot, &s);
+    if (rc == SRCH_NOT_FOUND)
+        return NO_ERROR;
+    if (rc != NO_ERROR)
+        return rc;
+
+    key_make(&now, &s);
+    if (key_cmp(&now, k) != 0)
+        return NO_ERROR;
+
+    return fn(&s, slot, arg);
+}
+
+/*
+ *  db_names_scan
+ *      fd:      database file descriptor
+ *      prefix:  last name prefix, "" matches everybody
+ *      fn:      callback, called for every matching record
+ *      arg:     passed through to fn
+ *
+ *  Visits the students whose last name starts with prefix in name order
+ *  (last name, first name, id).  With the index this descends to the first
+ *  possible key and walks the leaf chain, reading only the matching
+ *  records.  Without one every record is scanned and the matches sorted.
+ *
+ *  returns:  NO_ERROR after visiting every match, ERR_DB_FILE on I/O
+ *            errors, or whatever fn returned to stop the scan
+ */
+int db_names_scan(int fd, const char *prefix, db_scan_fn fn, void *arg)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+    prefix_filter_t filter = { prefix, strlen(prefix), {0} };
+    name_header_t hdr;
+    name_page_t page;
+    name_key_t lo;
+    uint32_t pgno;
+    int rc;
+    int i;
+
+    if (ctx == NULL)
+        return ERR_DB_FILE;
+
+    if (ctx->names_fd == -1)
+    {
+        rc = db_scan(fd, collect_match, &filter);
+        if (rc == NO_ERROR)
+            qsort(filter.set.keys, filter.set.count, sizeof(name_key_t), key_cmp_qsort);
+        for (i = 0; i < filter.set.count && rc == NO_ERROR; i++)
+            rc = visit_id(fd, &filter.set.keys[i], fn, arg);
+        free(filter.set.keys);
+        return rc;
+    }
+
+    // the smallest key with this prefix: empty first name, id 0
+    memset(&lo, 0, sizeof(lo));
+    strncpy(lo.lname, prefix, sizeof(lo.lname) - 1);
+
+    if (flock(ctx->names_fd, LOCK_SH) == -1)
+        return ERR_DB_FILE;
+
+    rc = header_read(ctx->names_fd, &hdr);
+    if (rc == NO_ERROR)
+        rc = find_leaf(ctx->names_fd, &hdr, &lo, &pgno, &page);
+
+    i = (rc == NO_ERROR) ? key_search(page.keys, page.count, &lo, false) : 0;
+    while (rc == NO_ERROR)
+    {
+        if (i == page.count)
+        {
+            if (page.next == 0)
+                break;
+            rc = page_read(ctx->names_fd, page.next, &page);
+            i = 0;
+            continue;
+        }
+
+        if (!prefix_match(page.keys[i].lname, &filter))
+            break;
+        rc = visit_id(fd, &page.keys[i++], fn, arg);
+    }
+
+    flock(ctx->names_fd, LOCK_UN);
+    return rc;
+}
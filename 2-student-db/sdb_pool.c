@@ -0,0 +1,455 @@
+#define _GNU_SOURCE     //O_DIRECT
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  The buffer pool keeps pages of POOL_PAGE_SLOTS records of the database
+ *  file in memory for processes that live long enough to use them again,
+ *  sdbsc --serve and bulk loads (--pool=N).  db_read_slot() and
+ *  db_write_slot() go through it, a page is read on the first access and
+ *  stays until CLOCK picks its frame for another page.  Scans and -F read
+ *  the file as before, they would only push everything else out.
+ *
+ *  Writes only change the frame and mark the slot dirty.  Dirty slots are
+ *  written back together, sorted by page and with runs of consecutive
+ *  slots in one pwritev(), at the end of every change (db_change_commit()),
+ *  before a scan or a sync, and when a dirty frame is evicted.  Only the
+ *  slots that changed are written: other processes change other records
+ *  of the same page under their own record locks.
+ *
+ *  Every change bumps the change count in the bitmap header when it
+ *  commits, before its record locks are released.  A pool whose count no
+ *  longer matches drops its pages, so a record read under its record lock
+ *  is never older than the last change to it.  The pool's own commits
+ *  keep the pages when no other change came in between.
+ *
+ *  With --direct pages are read with O_DIRECT into page aligned frames, the
+ *  pool replaces the page cache instead of keeping a second copy.  Frames
+ *  whose every slot is dirty are written back with O_DIRECT too, partly
+ *  dirty ones with buffered writes of the dirty slots, which the kernel
+ *  writes out before any O_DIRECT read of the page.
+ *
+ *  The pool is only used on direct and packed databases with a bitmap and
+ *  without the mmap backend, it is private to one process and one thread.
+ */
+
+#define POOL_IOV_MAX    1024
+
+typedef struct pool_frame {
+    off_t    page;                  //page held, -1 if the frame is free
+    uint64_t dirty;                 //slots changed since the last write back
+    int      valid;                 //slots of the page inside the file
+    int      next;                  //next frame in the same hash chain
+    bool     ref;                   //CLOCK reference bit
+} pool_frame_t;
+
+typedef struct pool_batch {
+    int          fd;
+    off_t        off;               //file offset of the first byte
+    size_t       len;               //bytes gathered so far
+    int          cnt;
+    struct iovec iov[POOL_IOV_MAX];
+} pool_batch_t;
+
+struct sdb_pool {
+    int          frames;
+    int          hand;              //CLOCK hand
+    int          direct_fd;         //O_DIRECT descriptor, -1 if not in use
+    uint32_t     changes;           //bitmap change count the pages are from
+    uint32_t     buckets;           //hash chains, a power of two
+    int          *head;             //first frame of every chain, -1 if none
+    int          *order;            //scratch for write back
+    pool_frame_t *frame;
+    char         *data;             //frames * POOL_PAGE_BYTES, page aligned
+    pool_batch_t batch[2];          //buffered and O_DIRECT write back
+};
+
+static char *frame_data(const sdb_pool_t *p, int f)
+{
+    return p->data + (size_t)f * POOL_PAGE_BYTES;
+}
+
+static uint32_t page_bucket(const sdb_pool_t *p, off_t page)
+{
+    return (uint32_t)page & (p->buckets - 1);
+}
+
+static int frame_lookup(const sdb_pool_t *p, off_t page)
+{
+    int f;
+
+    for (f = p->head[page_bucket(p, page)]; f != -1; f = p->frame[f].next)
+    {
+        if (p->frame[f].page == page)
+            return f;
+    }
+    return -1;
+}
+
+static void frame_unlink(sdb_pool_t *p, int f)
+{
+    int *link = &p->head[page_bucket(p, p->frame[f].page)];
+
+    while (*link != f)
+        link = &p->frame[*link].next;
+    *link = p->frame[f].next;
+    p->frame[f].page = -1;
+}
+
+/*
+ *  db_pool_enabled
+ *      ctx:  database context
+ *
+ *  returns:  true if db_read_slot() and db_write_slot() go through the pool
+ */
+bool db_pool_enabled(const sdb_ctx_t *ctx)
+{
+    return sdb_config.pool_pages > 0 && !sdb_config.use_mmap && ctx->bmp != NULL &&
+           (ctx->layout == DB_LAYOUT_DIRECT || ctx->layout == DB_LAYOUT_PACKED);
+}
+
+// the pool of ctx, set up on first use.  NULL if there is no memory for it
+static sdb_pool_t *pool_get(sdb_ctx_t *ctx)
+{
+    sdb_pool_t *p = ctx->pool;
+    void *data;
+    int f;
+
+    if (p != NULL)
+        return p;
+
+    p = calloc(1, sizeof(*p));
+    if (p == NULL)
+        return NULL;
+
+    p->frames = sdb_config.pool_pages;
+    for (p->buckets = 1; p->buckets < (uint32_t)p->frames; p->buckets <<= 1)
+        ;
+    p->head = malloc(p->buckets * sizeof(int));
+    p->order = malloc(p->frames * sizeof(int));
+    p->frame = malloc(p->frames * sizeof(pool_frame_t));
+    if (p->head == NULL || p->order == NULL || p->frame == NULL ||
+        posix_memalign(&data, POOL_PAGE_BYTES, (size_t)p->frames * POOL_PAGE_BYTES) != 0)
+    {
+        free(p->head);
+        free(p->order);
+        free(p->frame);
+        free(p);
+        return NULL;
+    }
+    p->data = data;
+
+    memset(p->head, -1, p->buckets * sizeof(int));
+    for (f = 0; f < p->frames; f++)
+        p->frame[f].page = -1;
+
+    // without O_DIRECT support (tmpfs) the pool still works, buffered
+    p->direct_fd = sdb_config.direct_io ? open(ctx->path, O_RDWR | O_DIRECT) : -1;
+    p->changes = __atomic_load_n(&ctx->bmp->changes, __ATOMIC_ACQUIRE);
+    ctx->pool = p;
+    return p;
+}
+
+// write the gathered iovecs of b and start over
+static int batch_write(pool_batch_t *b)
+{
+    int rc = NO_ERROR;
+
+    if (b->cnt > 0 && pwritev(b->fd, b->iov, b->cnt, b->off) != (ssize_t)b->len)
+        rc = ERR_DB_FILE;
+    b->cnt = 0;
+    b->len = 0;
+    return rc;
+}
+
+// add len bytes at off to the batch, writing it first if they do not follow on
+static int batch_add(pool_batch_t *b, char *base, size_t len, off_t off)
+{
+    if (b->cnt > 0 && (b->cnt == POOL_IOV_MAX || b->off + (off_t)b->len != off) &&
+        batch_write(b) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    if (b->cnt == 0)
+        b->off = off;
+    b->iov[b->cnt].iov_base = base;
+    b->iov[b->cnt].iov_len = len;
+    b->cnt++;
+    b->len += len;
+    return NO_ERROR;
+}
+
+static int by_page(const void *a, const void *b, void *arg)
+{
+    const pool_frame_t *frame = arg;
+    off_t pa = frame[*(const int *)a].page;
+    off_t pb = frame[*(const int *)b].page;
+
+    return (pa > pb) - (pa < pb);
+}
+
+/*
+ *  pool_flush
+ *      ctx:  database context
+ *      p:    its pool
+ *
+ *  Writes every dirty slot back in file order.  Whole dirty pages go out
+ *  with O_DIRECT when the pool has a direct descriptor, the rest as runs
+ *  of dirty slots.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on write errors
+ */
+static int pool_flush(sdb_ctx_t *ctx, sdb_pool_t *p)
+{
+    pool_batch_t *buffered = &p->batch[0];
+    pool_batch_t *direct = &p->batch[1];
+    int n = 0;
+    int rc = NO_ERROR;
+    int i;
+
+    for (i = 0; i < p->frames; i++)
+    {
+        if (p->frame[i].page >= 0 && p->frame[i].dirty != 0)
+            p->order[n++] = i;
+    }
+    if (n == 0)
+        return NO_ERROR;
+    qsort_r(p->order, n, sizeof(int), by_page, p->frame);
+
+    buffered->fd = ctx->fd;
+    direct->fd = p->direct_fd;
+    for (i = 0; i < n && rc == NO_ERROR; i++)
+    {
+        pool_frame_t *f = &p->frame[p->order[i]];
+        char *data = frame_data(p, p->order[i]);
+        off_t off = f->page * POOL_PAGE_BYTES;
+        int s = 0;
+
+        if (p->direct_fd != -1 && f->dirty == UINT64_MAX)
+        {
+            rc = batch_add(direct, data, POOL_PAGE_BYTES, off);
+            f->dirty = 0;
+            continue;
+        }
+
+        while (s < POOL_PAGE_SLOTS && rc == NO_ERROR)
+        {
+            int e;
+
+            if (!(f->dirty >> s & 1))
+            {
+                s++;
+                continue;
+            }
+            for (e = s; e < POOL_PAGE_SLOTS && (f->dirty >> e & 1); e++)
+                ;
+            rc = batch_add(buffered, data + s * STUDENT_RECORD_SIZE,
+                           (size_t)(e - s) * STUDENT_RECORD_SIZE,
+                           off + s * STUDENT_RECORD_SIZE);
+            s = e;
+        }
+        f->dirty = 0;
+    }
+
+    if (batch_write(buffered) != NO_ERROR || batch_write(direct) != NO_ERROR)
+        rc = ERR_DB_FILE;
+    return rc;
+}
+
+/*
+ *  pool_check
+ *      ctx:  database context
+ *      p:    its pool
+ *
+ *  Drops every page once another process committed a change, see the
+ *  change count in the bitmap header.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE if dirty slots could not be
+ *            written back first
+ */
+static int pool_check(sdb_ctx_t *ctx, sdb_pool_t *p)
+{
+    uint32_t changes = __atomic_load_n(&ctx->bmp->changes, __ATOMIC_ACQUIRE);
+    int f;
+
+    if (changes == p->changes)
+        return NO_ERROR;
+
+    if (pool_flush(ctx, p) != NO_ERROR)
+        return ERR_DB_FILE;
+    for (f = 0; f < p->frames; f++)
+        p->frame[f].page = -1;
+    memset(p->head, -1, p->buckets * sizeof(int));
+    p->changes = changes;
+    return NO_ERROR;
+}
+
+// CLOCK: the first frame whose reference bit is clear, writing back every
+// dirty slot if that frame has some
+static int pool_victim(sdb_ctx_t *ctx, sdb_pool_t *p)
+{
+    for (;;)
+    {
+        int f = p->hand;
+
+        p->hand = (p->hand + 1) % p->frames;
+        if (p->frame[f].page < 0)
+            return f;
+        if (p->frame[f].ref)
+        {
+            p->frame[f].ref = false;
+            continue;
+        }
+        if (p->frame[f].dirty != 0 && pool_flush(ctx, p) != NO_ERROR)
+            return ERR_DB_FILE;
+        frame_unlink(p, f);
+        return f;
+    }
+}
+
+/*
+ *  pool_page
+ *      ctx:   database context
+ *      p:     its pool
+ *      page:  page of the file
+ *
+ *  returns:  the frame holding page, reading it in if needed, or
+ *            ERR_DB_FILE on I/O errors
+ */
+static int pool_page(sdb_ctx_t *ctx, sdb_pool_t *p, off_t page)
+{
+    int fd = (p->direct_fd != -1) ? p->direct_fd : ctx->fd;
+    ssize_t n;
+    int f;
+
+    if (pool_check(ctx, p) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    f = frame_lookup(p, page);
+    if (f >= 0)
+    {
+        p->frame[f].ref = true;
+        return f;
+    }
+
+    f = pool_victim(ctx, p);
+    if (f < 0)
+        return f;
+
+    n = pread(fd, frame_data(p, f), POOL_PAGE_BYTES, page * POOL_PAGE_BYTES);
+    if (n < 0)
+        return ERR_DB_FILE;
+    memset(frame_data(p, f) + n, 0, POOL_PAGE_BYTES - n);
+
+    p->frame[f].page = page;
+    p->frame[f].dirty = 0;
+    p->frame[f].valid = (int)(n / STUDENT_RECORD_SIZE);
+    p->frame[f].ref = true;
+    p->frame[f].next = p->head[page_bucket(p, page)];
+    p->head[page_bucket(p, page)] = f;
+    return f;
+}
+
+/*
+ *  db_pool_read / db_pool_write
+ *      ctx:   database context, db_pool_enabled() is true
+ *      slot:  record slot
+ *      *s:    record to read into or write from
+ *
+ *  db_read_slot() and db_write_slot() through the pool.  With
+ *  SDB_SYNC_FULL a write is written back and synced straight away.
+ *
+ *  returns:  NO_ERROR       record transferred
+ *            SRCH_NOT_FOUND slot is past the end of the file (read only)
+ *            ERR_DB_FILE    I/O error or no memory for the pool
+ */
+int db_pool_read(sdb_ctx_t *ctx, off_t slot, student_t *s)
+{
+    sdb_pool_t *p = pool_get(ctx);
+    int i = (int)(slot % POOL_PAGE_SLOTS);
+    int f;
+
+    if (p == NULL || (f = pool_page(ctx, p, slot / POOL_PAGE_SLOTS)) < 0)
+        return ERR_DB_FILE;
+
+    if (i >= p->frame[f].valid)
+        return SRCH_NOT_FOUND;
+
+    memcpy(s, frame_data(p, f) + i * STUDENT_RECORD_SIZE, STUDENT_RECORD_SIZE);
+    return NO_ERROR;
+}
+
+int db_pool_write(sdb_ctx_t *ctx, off_t slot, const student_t *s)
+{
+    sdb_pool_t *p = pool_get(ctx);
+    int i = (int)(slot % POOL_PAGE_SLOTS);
+    int f;
+
+    if (p == NULL || (f = pool_page(ctx, p, slot / POOL_PAGE_SLOTS)) < 0)
+        return ERR_DB_FILE;
+
+    memcpy(frame_data(p, f) + i * STUDENT_RECORD_SIZE, s, STUDENT_RECORD_SIZE);
+    p->frame[f].dirty |= (uint64_t)1 << i;
+    if (i >= p->frame[f].valid)
+        p->frame[f].valid = i + 1;
+
+    if (sdb_config.sync_policy == SDB_SYNC_FULL &&
+        (pool_flush(ctx, p) != NO_ERROR || db_fsync(ctx->fd, true) == -1))
+        return ERR_DB_FILE;
+
+    return NO_ERROR;
+}
+
+/*
+ *  db_pool_flush / db_pool_committed / db_pool_close
+ *      ctx:  database context
+ *
+ *  db_pool_flush() writes the dirty slots back, anything that reads the
+ *  file itself calls it first.  db_pool_committed() is called under the
+ *  meta lock after a change of this process bumped the change count, the
+ *  pages stay if nobody else committed since the pool last looked.
+ *  db_pool_close() writes back and frees the pool.
+ *
+ *  returns:  db_pool_flush: NO_ERROR on success, ERR_DB_FILE on errors
+ */
+int db_pool_flush(sdb_ctx_t *ctx)
+{
+    return (ctx->pool != NULL) ? pool_flush(ctx, ctx->pool) : NO_ERROR;
+}
+
+void db_pool_committed(sdb_ctx_t *ctx)
+{
+    sdb_pool_t *p = ctx->pool;
+
+    if (p != NULL && ctx->bmp != NULL &&
+        __atomic_load_n(&ctx->bmp->changes, __ATOMIC_ACQUIRE) == p->changes + 1)
+        p->changes++;
+}
+
+void db_pool_close(sdb_ctx_t *ctx)
+{
+    sdb_pool_t *p = ctx->pool;
+
+    if (p == NULL)
+        return;
+
+    pool_flush(ctx, p);
+    if (p->direct_fd != -1)
+        close(p->direct_fd);
+    free(p->data);
+    free(p->head);
+    free(p->order);
+    free(p->frame);
+    free(p);
+    ctx->pool = NULL;
+}
@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  -q filters students with a small predicate language:
+ *
+ *      expr   := and ( "||" and )*
+ *      and    := unary ( "&&" unary )*
+ *      unary  := "!" unary | "(" expr ")" | field op value
+ *      field  := id | gpa | fname | lname
+ *      op     := == | = | != | < | <= | > | >= | ^=
+ *
+ *  ids are numbers, GPAs 3 digit ints like everywhere else on the command
+ *  line (350), or with a decimal point (3.50).  Names are compared byte by
+ *  byte like the last name index does, quoted with ' or " or as a bare
+ *  word, and ^= matches a prefix.  For example
+ *
+ *      sdbsc -q "gpa>=350 && lname^='Sm'"
+ *
+ *  db_query_compile() parses the text once into postfix ops, the scan then
+ *  runs db_query_match() over every record without formatting the ones it
+ *  rejects.  It also works out what every match must satisfy, the id and
+ *  GPA ranges and the last name prefix of the comparisons joined to the
+ *  top with && only, so query_db() can serve the query from an index.
+ */
+
+typedef struct parser {
+    const char  *p;                 //next character
+    sdb_query_t *q;
+    bool        failed;
+} parser_t;
+
+static void parse_or(parser_t *ps);
+
+static void skip_space(parser_t *ps)
+{
+    while (isspace((unsigned char)*ps->p))
+        ps->p++;
+}
+
+// consume tok if the input continues with it
+static bool accept(parser_t *ps, const char *tok)
+{
+    size_t len = strlen(tok);
+
+    skip_space(ps);
+    if (strncmp(ps->p, tok, len) != 0)
+        return false;
+
+    ps->p += len;
+    return true;
+}
+
+static query_op_t *emit(parser_t *ps, int code)
+{
+    query_op_t *op;
+
+    if (ps->q->count == QUERY_MAX_OPS)
+    {
+        ps->failed = true;
+        return NULL;
+    }
+
+    op = &ps->q->op[ps->q->count++];
+    memset(op, 0, sizeof(*op));
+    op->code = (uint8_t)code;
+    return op;
+}
+
+static bool parse_field(parser_t *ps, int *field)
+{
+    static const struct { const char *name; int field; } fields[] = {
+        { "id", QF_ID }, { "gpa", QF_GPA }, { "fname", QF_FNAME }, { "lname", QF_LNAME },
+    };
+    size_t len = 0;
+    size_t i;
+
+    skip_space(ps);
+    while (isalpha((unsigned char)ps->p[len]))
+        len++;
+
+    for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+    {
+        if (strlen(fields[i].name) == len && strncmp(ps->p, fields[i].name, len) == 0)
+        {
+            ps->p += len;
+            *field = fields[i].field;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool parse_cmp(parser_t *ps, int *cmp)
+{
+    // longest first, "<=" before "<"
+    static const struct { const char *tok; int cmp; } ops[] = {
+        { "==", QC_EQ }, { "!=", QC_NE }, { "<=", QC_LE }, { ">=", QC_GE },
+        { "^=", QC_PREFIX }, { "=", QC_EQ }, { "<", QC_LT }, { ">", QC_GT },
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+    {
+        if (accept(ps, ops[i].tok))
+        {
+            *cmp = ops[i].cmp;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// an id, or a GPA as a 3 digit int or with a decimal point
+static bool parse_number(parser_t *ps, int field, int32_t *num)
+{
+    char *end;
+    long whole;
+
+    skip_space(ps);
+    whole = strtol(ps->p, &end, 10);
+    if (end == ps->p)
+        return false;
+
+    if (field == QF_GPA && *end == '.')
+    {
+        double gpa = strtod(ps->p, &end);
+
+        whole = (long)(gpa * 100.0 + 0.5);
+    }
+
+    ps->p = end;
+    *num = (int32_t)whole;
+    return true;
+}
+
+static bool parse_name(parser_t *ps, query_op_t *op)
+{
+    char quote = '\0';
+    size_t len = 0;
+
+    skip_space(ps);
+    if (*ps->p == '\'' || *ps->p == '"')
+    {
+        quote = *ps->p++;
+
+        while (ps->p[len] != '\0' && ps->p[len] != quote)
+            len++;
+        if (ps->p[len] != quote)
+            return false;
+    }
+    else
+    {
+        while (isalnum((unsigned char)ps->p[len]) || ps->p[len] == '_' || ps->p[len] == '-')
+            len++;
+        if (len == 0)
+            return false;
+    }
+
+    if (len >= QUERY_MAX_STR)
+        return false;
+
+    memcpy(op->str, ps->p, len);
+    op->len = (uint8_t)len;
+    ps->p += len + (quote != '\0');
+    return true;
+}
+
+static void parse_test(parser_t *ps)
+{
+    const char *start;
+    query_op_t *op;
+    int field;
+    int cmp;
+
+    skip_space(ps);
+    start = ps->p;
+    if (!parse_field(ps, &field) || !parse_cmp(ps, &cmp))
+    {
+        ps->p = start;
+        ps->failed = true;
+        return;
+    }
+
+    op = emit(ps, QOP_TEST);
+    if (op == NULL)
+        return;
+
+    op->field = (uint8_t)field;
+    op->cmp = (uint8_t)cmp;
+    if (field == QF_ID || field == QF_GPA)
+        ps->failed = (cmp == QC_PREFIX) || !parse_number(ps, field, &op->num);
+    else
+        ps->failed = !parse_name(ps, op);
+}
+
+static void parse_unary(parser_t *ps)
+{
+    if (accept(ps, "!"))
+    {
+        parse_unary(ps);
+        if (!ps->failed)
+            emit(ps, QOP_NOT);
+    }
+    else if (accept(ps, "("))
+    {
+        parse_or(ps);
+        if (!ps->failed && !accept(ps, ")"))
+            ps->failed = true;
+    }
+    else
+        parse_test(ps);
+}
+
+static void parse_and(parser_t *ps)
+{
+    parse_unary(ps);
+    while (!ps->failed && accept(ps, "&&"))
+    {
+        parse_unary(ps);
+        if (!ps->failed)
+            emit(ps, QOP_AND);
+    }
+}
+
+static void parse_or(parser_t *ps)
+{
+    parse_and(ps);
+    while (!ps->failed && accept(ps, "||"))
+    {
+        parse_and(ps);
+        if (!ps->failed)
+            emit(ps, QOP_OR);
+    }
+}
+
+// narrow [*lo, *hi] by what a numeric comparison lets through
+static void narrow(int cmp, int num, int *lo, int *hi)
+{
+    if ((cmp == QC_EQ || cmp == QC_GE) && num > *lo)
+        *lo = num;
+    if (cmp == QC_GT && num < INT_MAX && num + 1 > *lo)
+        *lo = num + 1;
+    if ((cmp == QC_EQ || cmp == QC_LE) && num < *hi)
+        *hi = num;
+    if (cmp == QC_LT && num > INT_MIN && num - 1 < *hi)
+        *hi = num - 1;
+}
+
+/*
+ *  find_required
+ *      q:  query with its ops compiled
+ *
+ *  Replays the ops keeping, for every value on the stack, the set of
+ *  comparisons it needs to be true.  A comparison needs itself, && needs
+ *  both sides and || or ! nothing in particular.  What is left for the
+ *  whole query narrows its id and GPA ranges and gives the prefix.
+ */
+static void find_required(sdb_query_t *q)
+{
+    uint64_t need[QUERY_MAX_OPS];
+    int sp = 0;
+    int i;
+
+    q->id_lo = MIN_STD_ID;
+    q->id_hi = INT_MAX;
+    q->gpa_lo = MIN_STD_GPA;
+    q->gpa_hi = MAX_STD_GPA;
+    q->prefix[0] = '\0';
+
+    for (i = 0; i < q->count; i++)
+    {
+        switch (q->op[i].code)
+        {
+        case QOP_TEST:
+            need[sp++] = (uint64_t)1 << i;
+            break;
+        case QOP_AND:
+            sp--;
+            need[sp - 1] |= need[sp];
+            break;
+        case QOP_OR:
+            sp--;
+            need[sp - 1] = 0;
+            break;
+        default:
+            need[sp - 1] = 0;
+            break;
+        }
+    }
+
+    for (i = 0; i < q->count; i++)
+    {
+        const query_op_t *op = &q->op[i];
+
+        if (!(need[0] & ((uint64_t)1 << i)))
+            continue;
+
+        if (op->field == QF_ID)
+            narrow(op->cmp, op->num, &q->id_lo, &q->id_hi);
+        else if (op->field == QF_GPA)
+            narrow(op->cmp, op->num, &q->gpa_lo, &q->gpa_hi);
+        else if (op->field == QF_LNAME && (op->cmp == QC_EQ || op->cmp == QC_PREFIX) &&
+                 op->len > strlen(q->prefix))
+            memcpy(q->prefix, op->str, sizeof(q->prefix));
+    }
+}
+
+/*
+ *  db_query_compile
+ *      text:  the -q expression
+ *      *q:    receives the compiled query
+ *      *err:  set to where parsing stopped on failure
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_OP if text is not a valid query
+ */
+int db_query_compile(const char *text, sdb_query_t *q, const char **err)
+{
+    parser_t ps = { text, q, false };
+
+    memset(q, 0, sizeof(*q));
+    parse_or(&ps);
+    skip_space(&ps);
+    if (ps.failed || *ps.p != '\0' || q->count == 0)
+    {
+        *err = ps.p;
+        return ERR_DB_OP;
+    }
+
+    find_required(q);
+    return NO_ERROR;
+}
+
+static bool test(const query_op_t *op, const student_t *s)
+{
+    int rc;
+
+    switch (op->field)
+    {
+    case QF_ID:
+        rc = (s->id > op->num) - (s->id < op->num);
+        break;
+    case QF_GPA:
+        rc = (s->gpa > op->num) - (s->gpa < op->num);
+        break;
+    case QF_FNAME:
+        rc = strncmp(s->fname, op->str, (op->cmp == QC_PREFIX) ? op->len : sizeof(s->fname));
+        break;
+    default:
+        rc = strncmp(s->lname, op->str, (op->cmp == QC_PREFIX) ? op->len : sizeof(s->lname));
+        break;
+    }
+
+    switch (op->cmp)
+    {
+    case QC_NE:
+        return rc != 0;
+    case QC_LT:
+        return rc < 0;
+    case QC_LE:
+        return rc <= 0;
+    case QC_GT:
+        return rc > 0;
+    case QC_GE:
+        return rc >= 0;
+    default:
+        return rc == 0;
+    }
+}
+
+/*
+ *  db_query_match
+ *      q:  compiled query
+ *      s:  student to test
+ *
+ *  returns:  true if s passes the query
+ */
+bool db_query_match(const sdb_query_t *q, const student_t *s)
+{
+    bool stack[QUERY_MAX_OPS];
+    int sp = 0;
+    int i;
+
+    for (i = 0; i < q->count; i++)
+    {
+        const query_op_t *op = &q->op[i];
+
+        switch (op->code)
+        {
+        case QOP_TEST:
+            stack[sp++] = test(op, s);
+            break;
+        case QOP_AND:
+            sp--;
+            stack[sp - 1] = stack[sp - 1] && stack[sp];
+            break;
+        case QOP_OR:
+            sp--;
+            stack[sp - 1] = stack[sp - 1] || stack[sp];
+            break;
+        default:
+            stack[sp - 1] = !stack[sp - 1];
+            break;
+        }
+    }
+
+    return stack[0];
+}
@@ -0,0 +1,499 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  sdbsc --serve keeps the database and all of its sidecars open and
+ *  answers requests on a Unix domain socket next to the database
+ *  (.student.db.sock).  sdbsc --connect sends the command line to it
+ *  instead of opening the database itself, and prints the answer exactly
+ *  like the command would have.
+ *
+ *  The socket is SOCK_SEQPACKET so every request and every reply is one
+ *  message.  A request is one fixed size srv_request_t.  A reply is a
+ *  srv_reply_t followed by up to SRV_BATCH_RECORDS student_t, a print of
+ *  the whole database is sent as several replies with more set on all but
+ *  the last.
+ *
+ *  The server is a single thread polling the listening socket and every
+ *  connected client, requests are handled one at a time so the storage
+ *  engine never sees two at once.  It stays in the foreground until it
+ *  gets SIGINT or SIGTERM.
+ */
+
+#define SRV_MAX_CLIENTS     64
+#define SRV_BACKLOG         16
+
+static volatile sig_atomic_t srv_stop;
+
+static void srv_signal(int sig)
+{
+    (void)sig;
+    srv_stop = 1;
+}
+
+static int srv_address(struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (db_sidecar_path(DB_FILE, SOCK_SIDECAR, addr->sun_path) != NO_ERROR ||
+        strlen(addr->sun_path) >= sizeof(addr->sun_path))
+        return ERR_DB_FILE;
+
+    return NO_ERROR;
+}
+
+// true if nobody is listening on the socket file any more
+static bool srv_stale(const struct sockaddr_un *addr)
+{
+    int probe = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    bool stale;
+
+    if (probe == -1)
+        return false;
+
+    stale = connect(probe, (const struct sockaddr *)addr, sizeof(*addr)) == -1 &&
+            errno == ECONNREFUSED;
+    close(probe);
+    return stale;
+}
+
+typedef struct srv_batch {
+    int        sock;                //client the records go to
+    srv_reply_t reply;              //header of the reply being filled
+    student_t  recs[SRV_BATCH_RECORDS];
+} srv_batch_t;
+
+static int srv_send(int sock, const srv_reply_t *reply, const student_t *recs)
+{
+    struct iovec iov[2];
+    struct msghdr msg = {0};
+
+    iov[0].iov_base = (void *)reply;
+    iov[0].iov_len = sizeof(*reply);
+    iov[1].iov_base = (void *)recs;
+    iov[1].iov_len = reply->count * sizeof(student_t);
+
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (reply->count > 0) ? 2 : 1;
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1)
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+static int batch_record(const student_t *s, off_t slot, void *arg)
+{
+    srv_batch_t *batch = arg;
+
+    (void)slot;
+    batch->recs[batch->reply.count++] = *s;
+    if (batch->reply.count < SRV_BATCH_RECORDS)
+        return NO_ERROR;
+
+    batch->reply.more = 1;
+    if (srv_send(batch->sock, &batch->reply, batch->recs) != NO_ERROR)
+        return ERR_DB_FILE;
+    batch->reply.count = 0;
+    return NO_ERROR;
+}
+
+/*
+ *  srv_handle
+ *      fd:    database file descriptor
+ *      sock:  client socket
+ *      req:   request read from the client
+ *
+ *  Runs one request with the same functions the command line uses.  Their
+ *  console output goes wherever the server's stdout goes, the client
+ *  prints its own from the reply.
+ *
+ *  returns:  NO_ERROR if the reply was sent, ERR_DB_FILE if the client is
+ *            gone
+ */
+static int srv_handle(int fd, int sock, srv_request_t *req)
+{
+    srv_batch_t *batch;
+    srv_reply_t reply = {0};
+    student_t s = {0};
+    int rc;
+
+    req->fname[sizeof(req->fname) - 1] = '\0';
+    req->lname[sizeof(req->lname) - 1] = '\0';
+
+    switch (req->op)
+    {
+    case SRV_OP_ADD:
+    case SRV_OP_UPDATE:
+        if (validate_range(req->id, req->gpa) != NO_ERROR)
+        {
+            reply.rc = EXIT_FAIL_ARGS;
+            break;
+        }
+        if (req->op == SRV_OP_ADD)
+            reply.rc = add_student(fd, req->id, req->fname, req->lname, req->gpa);
+        else
+            reply.rc = update_student(fd, req->id, req->fname, req->lname, req->gpa);
+        break;
+
+    case SRV_OP_GET:
+        reply.rc = get_student(fd, req->id, &s);
+        if (reply.rc == NO_ERROR)
+            reply.count = 1;
+        break;
+
+    case SRV_OP_DEL:
+        reply.rc = del_student(fd, req->id);
+        break;
+
+    case SRV_OP_COUNT:
+        rc = count_db_records(fd);
+        if (rc < 0)
+            reply.rc = rc;
+        else
+            reply.total = (uint32_t)rc;
+        break;
+
+    case SRV_OP_PRINT:
+        batch = malloc(sizeof(*batch));
+        if (batch == NULL)
+        {
+            reply.rc = ERR_DB_FILE;
+            break;
+        }
+        memset(&batch->reply, 0, sizeof(batch->reply));
+        batch->sock = sock;
+        rc = db_scan(fd, batch_record, batch);
+        batch->reply.rc = rc;
+        batch->reply.more = 0;
+        rc = srv_send(sock, &batch->reply, batch->recs);
+        free(batch);
+        return rc;
+
+    default:
+        reply.rc = EXIT_NOT_IMPL;
+        break;
+    }
+
+    fflush(stdout);
+    return srv_send(sock, &reply, &s);
+}
+
+/*
+ *  serve_db
+ *      fd:  database file descriptor from open_db()
+ *
+ *  Listens on the server socket of the database and answers requests
+ *  until SIGINT or SIGTERM.  A socket file left behind by a server that
+ *  is no longer running is replaced, a live one is not.
+ *
+ *  returns:  NO_ERROR after a clean shutdown, ERR_DB_FILE if the socket
+ *            cannot be set up
+ *
+ *  console:  M_SRV_READY      once the server accepts requests
+ *            M_ERR_SRV_SOCK   the socket cannot be created
+ */
+int serve_db(int fd)
+{
+    struct pollfd fds[SRV_MAX_CLIENTS + 1];
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    int nfds = 1;
+    int lsock;
+    int i;
+
+    if (srv_address(&addr) != NO_ERROR ||
+        (lsock = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1)
+    {
+        printf(M_ERR_SRV_SOCK, addr.sun_path);
+        return ERR_DB_FILE;
+    }
+
+    // a socket nobody answers on is left over from a server that died
+    if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) == -1 &&
+        (errno != EADDRINUSE || !srv_stale(&addr) || unlink(addr.sun_path) == -1 ||
+         bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) == -1))
+    {
+        printf(M_ERR_SRV_SOCK, addr.sun_path);
+        close(lsock);
+        return ERR_DB_FILE;
+    }
+
+    if (listen(lsock, SRV_BACKLOG) == -1)
+    {
+        printf(M_ERR_SRV_SOCK, addr.sun_path);
+        close(lsock);
+        return ERR_DB_FILE;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = srv_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf(M_SRV_READY, DB_FILE, addr.sun_path);
+    fflush(stdout);
+
+    // the functions handling requests print like they do on the command
+    // line, nobody is reading that
+    freopen("/dev/null", "w", stdout);
+
+    fds[0].fd = lsock;
+    fds[0].events = POLLIN;
+
+    while (!srv_stop)
+    {
+        if (poll(fds, nfds, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (i = nfds - 1; i >= 1; i--)
+        {
+            srv_request_t req;
+            ssize_t n;
+
+            if (fds[i].revents == 0)
+                continue;
+
+            n = (fds[i].revents & POLLIN) ? recv(fds[i].fd, &req, sizeof(req), 0) : 0;
+            if (n == sizeof(req) && srv_handle(fd, fds[i].fd, &req) == NO_ERROR)
+                continue;
+
+            // closed, broken or not speaking the protocol
+            close(fds[i].fd);
+            fds[i] = fds[--nfds];
+        }
+
+        if ((fds[0].revents & POLLIN) && nfds <= SRV_MAX_CLIENTS)
+        {
+            int csock = accept(lsock, NULL, NULL);
+
+            if (csock != -1)
+            {
+                fds[nfds].fd = csock;
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                nfds++;
+            }
+        }
+    }
+
+    for (i = 1; i < nfds; i++)
+        close(fds[i].fd);
+    close(lsock);
+    unlink(addr.sun_path);
+    return NO_ERROR;
+}
+
+/*
+ *  remote_request
+ *      req:    request to send
+ *      *rc:    receives the status of the reply
+ *      *total: receives the record count of a count request
+ *      fn:     called for every record that comes back
+ *      arg:    passed through to fn
+ *
+ *  Connects to the server, sends one request and reads replies until the
+ *  last one.
+ *
+ *  returns:  NO_ERROR if the server answered, ERR_DB_FILE if it cannot be
+ *            reached or the reply is garbled
+ */
+static int remote_request(const srv_request_t *req, int *rc, uint32_t *total,
+                          db_scan_fn fn, void *arg)
+{
+    struct sockaddr_un addr;
+    srv_reply_t *reply;
+    char *buff;
+    size_t len = sizeof(srv_reply_t) + SRV_BATCH_RECORDS * sizeof(student_t);
+    int sock;
+    int result = ERR_DB_FILE;
+
+    if (srv_address(&addr) != NO_ERROR ||
+        (sock = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1)
+        return ERR_DB_FILE;
+
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        send(sock, req, sizeof(*req), MSG_NOSIGNAL) != sizeof(*req) ||
+        (buff = malloc(len)) == NULL)
+    {
+        close(sock);
+        return ERR_DB_FILE;
+    }
+    reply = (srv_reply_t *)buff;
+
+    for (;;)
+    {
+        const student_t *recs = (const student_t *)(buff + sizeof(srv_reply_t));
+        ssize_t n = recv(sock, buff, len, 0);
+        uint32_t i;
+
+        if (n < (ssize_t)sizeof(srv_reply_t) ||
+            (size_t)n != sizeof(srv_reply_t) + reply->count * sizeof(student_t))
+            break;
+
+        for (i = 0; i < reply->count; i++)
+            fn(&recs[i], i, arg);
+
+        if (!reply->more)
+        {
+            *rc = reply->rc;
+            *total = reply->total;
+            result = NO_ERROR;
+            break;
+        }
+    }
+
+    free(buff);
+    close(sock);
+    return result;
+}
+
+static int remote_print(const student_t *s, off_t slot, void *arg)
+{
+    int *printed = arg;
+
+    (void)slot;
+    if (!*printed)
+        printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST NAME", "LAST_NAME", "GPA");
+    *printed = 1;
+    printf(STUDENT_PRINT_FMT_STRING, s->id, s->fname, s->lname, s->gpa / 100.0);
+    return NO_ERROR;
+}
+
+static int remote_get(const student_t *s, off_t slot, void *arg)
+{
+    (void)slot;
+    *(student_t *)arg = *s;
+    return NO_ERROR;
+}
+
+/*
+ *  remote_main
+ *      argc, argv:  command line without the engine options
+ *
+ *  The thin client.  Turns -a, -c, -d, -f, -p and -u into a request for
+ *  the server and prints the reply with the same messages the command
+ *  prints when it runs against the database itself.
+ *
+ *  returns:  exit code for the shell
+ *
+ *  console:  the messages of the command, M_ERR_SRV_CONNECT if there is no
+ *            server, M_ERR_SRV_OPT for commands the server does not take
+ */
+int remote_main(int argc, char *argv[])
+{
+    srv_request_t req = {0};
+    student_t s = {0};
+    uint32_t total = 0;
+    int printed = 0;
+    int rc;
+
+    switch (argv[1][1])
+    {
+    case 'a':
+    case 'u':
+        if (argc != 6)
+        {
+            usage(argv[0]);
+            return EXIT_FAIL_ARGS;
+        }
+        req.op = (argv[1][1] == 'a') ? SRV_OP_ADD : SRV_OP_UPDATE;
+        req.id = atoi(argv[2]);
+        req.gpa = atoi(argv[5]);
+        strncpy(req.fname, argv[3], sizeof(req.fname) - 1);
+        strncpy(req.lname, argv[4], sizeof(req.lname) - 1);
+        break;
+    case 'd':
+    case 'f':
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            return EXIT_FAIL_ARGS;
+        }
+        req.op = (argv[1][1] == 'd') ? SRV_OP_DEL : SRV_OP_GET;
+        req.id = atoi(argv[2]);
+        break;
+    case 'c':
+        req.op = SRV_OP_COUNT;
+        break;
+    case 'p':
+        req.op = SRV_OP_PRINT;
+        break;
+    default:
+        printf(M_ERR_SRV_OPT, argv[1]);
+        return EXIT_FAIL_ARGS;
+    }
+
+    if (remote_request(&req, &rc, &total,
+                       (req.op == SRV_OP_PRINT) ? remote_print : remote_get,
+                       (req.op == SRV_OP_PRINT) ? (void *)&printed : (void *)&s) != NO_ERROR)
+    {
+        printf(M_ERR_SRV_CONNECT);
+        return EXIT_FAIL_DB;
+    }
+
+    if (rc == ERR_DB_FILE)
+    {
+        printf(M_ERR_DB_READ);
+        return EXIT_FAIL_DB;
+    }
+
+    // the server checks ids and GPAs against the limits of the database it
+    // has open
+    switch (req.op)
+    {
+    case SRV_OP_ADD:
+    case SRV_OP_UPDATE:
+        if (rc == EXIT_FAIL_ARGS)
+        {
+            printf(M_ERR_STD_RNG);
+            return EXIT_FAIL_ARGS;
+        }
+        if (rc == NO_ERROR)
+            printf((req.op == SRV_OP_ADD) ? M_STD_ADDED : M_STD_UPDATED, req.id);
+        else if (rc == ERR_DB_OP)
+            printf((req.op == SRV_OP_ADD) ? M_ERR_DB_ADD_DUP : M_STD_NOT_FND_MSG, req.id);
+        break;
+    case SRV_OP_DEL:
+        if (rc == NO_ERROR)
+            printf(M_STD_DEL_MSG, req.id);
+        else if (rc == ERR_DB_OP)
+            printf(M_STD_NOT_FND_MSG, req.id);
+        break;
+    case SRV_OP_GET:
+        if (rc == NO_ERROR)
+            print_student(&s);
+        else if (rc == SRCH_NOT_FOUND)
+            printf(M_STD_NOT_FND_MSG, req.id);
+        break;
+    case SRV_OP_COUNT:
+        if (rc == NO_ERROR && total == 0)
+            printf(M_DB_EMPTY);
+        else if (rc == NO_ERROR)
+            printf(M_DB_RECORD_CNT, (int)total);
+        break;
+    case SRV_OP_PRINT:
+        if (rc == NO_ERROR && !printed)
+            printf(M_DB_EMPTY);
+        break;
+    }
+
+    return (rc < 0) ? EXIT_FAIL_DB : EXIT_OK;
+}
@@ -0,0 +1,460 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  A sharded database spreads its students over several database files by
+ *  id range.  The manifest (.student.db.shards) is a small text file with
+ *  one line per shard:
+ *
+ *      first_id last_id path
+ *
+ *  Every shard is an ordinary database file with its own sidecars, locks
+ *  and log.  It covers at most MAX_STD_ID ids and stores the student with
+ *  id first_id + n - 1 as student n, so everything below this file keeps
+ *  working with ids 1 to MAX_STD_ID.  The paths can be edited to put the
+ *  shards on different disks.
+ *
+ *  The descriptor of the manifest stands for the whole database.  The
+ *  public functions in sdbsc.c route single students to their shard with
+ *  db_shard() and scan or count all of them with db_shard_scan() and
+ *  db_shard_count().
+ */
+
+#define SHARD_SETS      2
+
+typedef struct shard {
+    int  first_id;                  //id of the first student in the shard
+    int  last_id;                   //id of the last one
+    int  fd;                        //the shard's database file
+    char path[PATH_MAX];
+} shard_t;
+
+typedef struct shard_set {
+    int     fd;                     //manifest, -1 if the entry is free
+    int     count;
+    shard_t shards[SHARD_MAX];
+} shard_set_t;
+
+static shard_set_t shard_sets[SHARD_SETS] = { { .fd = -1 }, { .fd = -1 } };
+
+static shard_set_t *shard_set(int fd)
+{
+    int i;
+
+    for (i = 0; i < SHARD_SETS; i++)
+    {
+        if (shard_sets[i].fd != -1 && shard_sets[i].fd == fd)
+            return &shard_sets[i];
+    }
+
+    return NULL;
+}
+
+static void shards_release(shard_set_t *set)
+{
+    int i;
+
+    for (i = 0; i < set->count; i++)
+    {
+        db_unregister(set->shards[i].fd);
+        close(set->shards[i].fd);
+    }
+    set->fd = -1;
+    set->count = 0;
+}
+
+/*
+ *  manifest_read
+ *      f:    manifest, positioned at the start
+ *      set:  receives the shards, not opened yet
+ *
+ *  Blank lines and lines starting with # are skipped.  Shards have to be
+ *  listed in id order, must not overlap and cover at most MAX_STD_ID ids.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE if the manifest is invalid
+ */
+static int manifest_read(FILE *f, shard_set_t *set)
+{
+    char line[PATH_MAX + 64];
+    int prev_last = MIN_STD_ID - 1;
+
+    set->count = 0;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        shard_t *sh = &set->shards[set->count];
+        char *path;
+        int used;
+
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+
+        if (set->count == SHARD_MAX ||
+            sscanf(line, "%d %d %n", &sh->first_id, &sh->last_id, &used) != 2)
+            return ERR_DB_FILE;
+
+        path = line + used;
+        path[strcspn(path, "\r\n")] = '\0';
+        if (path[0] == '\0' || strlen(path) >= PATH_MAX ||
+            sh->first_id <= prev_last || sh->last_id < sh->first_id ||
+            sh->last_id - sh->first_id >= MAX_STD_ID)
+            return ERR_DB_FILE;
+
+        strcpy(sh->path, path);
+        prev_last = sh->last_id;
+        set->count++;
+    }
+
+    return (set->count > 0) ? NO_ERROR : ERR_DB_FILE;
+}
+
+/*
+ *  db_shards_create
+ *      path:  path of the database file, for example "student.db"
+ *      n:     number of shards, 1 or less makes the database unsharded
+ *
+ *  Writes a manifest for n shards of MAX_STD_ID ids each, stored in
+ *  path.0 to path.<n-1>.  Used when the database is emptied with -z, the
+ *  shards of the old manifest are removed first, and so are the sidecars
+ *  path had as a single file.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+int db_shards_create(const char *path, int n)
+{
+    char manifest[PATH_MAX];
+    shard_set_t old;
+    FILE *f;
+    int i;
+
+    if (db_sidecar_path(path, SHARD_SIDECAR, manifest) != NO_ERROR ||
+        n > SHARD_MAX)
+        return ERR_DB_FILE;
+
+    f = fopen(manifest, "r");
+    if (f != NULL)
+    {
+        if (manifest_read(f, &old) == NO_ERROR)
+        {
+            for (i = 0; i < old.count; i++)
+            {
+                db_remove_sidecars(old.shards[i].path);
+                unlink(old.shards[i].path);
+            }
+        }
+        fclose(f);
+    }
+
+    if (n <= 1)
+    {
+        unlink(manifest);
+        return NO_ERROR;
+    }
+
+    // the records move to the shards, nothing may describe the single file
+    db_remove_sidecars(path);
+
+    f = fopen(manifest, "w");
+    if (f == NULL)
+        return ERR_DB_FILE;
+
+    fprintf(f, "# first_id last_id path\n");
+    for (i = 0; i < n; i++)
+        fprintf(f, "%d %d %s.%d\n", i * MAX_STD_ID + MIN_STD_ID,
+                (i + 1) * MAX_STD_ID, path, i);
+
+    return (fclose(f) == 0) ? NO_ERROR : ERR_DB_FILE;
+}
+
+/*
+ *  db_shards_open
+ *      path:      path of the database file
+ *      truncate:  empty every shard
+ *
+ *  Opens every shard of a sharded database, see db_replace_empty() for how
+ *  a shard is emptied.
+ *
+ *  returns:  descriptor standing for the database on success
+ *            SRCH_NOT_FOUND the database is not sharded
+ *            ERR_DB_FILE    the manifest or a shard cannot be opened
+ */
+int db_shards_open(const char *path, bool truncate)
+{
+    char manifest[PATH_MAX];
+    shard_set_t *set = NULL;
+    FILE *f;
+    int fd;
+    int i;
+
+    if (db_sidecar_path(path, SHARD_SIDECAR, manifest) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    fd = open(manifest, O_RDONLY);
+    if (fd == -1)
+        return SRCH_NOT_FOUND;
+
+    for (i = 0; i < SHARD_SETS && set == NULL; i++)
+    {
+        if (shard_sets[i].fd == -1)
+            set = &shard_sets[i];
+    }
+
+    f = fdopen(dup(fd), "r");
+    if (set == NULL || f == NULL || manifest_read(f, set) != NO_ERROR)
+    {
+        if (f != NULL)
+            fclose(f);
+        close(fd);
+        return ERR_DB_FILE;
+    }
+    fclose(f);
+
+    set->fd = fd;
+    for (i = 0; i < set->count; i++)
+    {
+        shard_t *sh = &set->shards[i];
+
+        sh->fd = -1;
+        if (truncate && db_replace_empty(sh->path) != NO_ERROR)
+            break;
+
+        sh->fd = open(sh->path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+        if (sh->fd == -1)
+            break;
+
+        if (db_register(sh->fd, sh->path) == NULL)
+        {
+            close(sh->fd);
+            break;
+        }
+    }
+
+    if (i < set->count)
+    {
+        set->count = i;
+        shards_release(set);
+        close(fd);
+        return ERR_DB_FILE;
+    }
+
+    return fd;
+}
+
+/*
+ *  db_shards_close
+ *      fd:  descriptor returned from db_shards_open()
+ *
+ *  Closes every shard, the caller still closes fd.
+ *
+ *  returns:  true if fd was a sharded database
+ */
+bool db_shards_close(int fd)
+{
+    shard_set_t *set = shard_set(fd);
+
+    if (set == NULL)
+        return false;
+
+    shards_release(set);
+    return true;
+}
+
+/*
+ *  db_sharded / db_shard / db_shard_max_id
+ *      fd:     database file descriptor
+ *      id:     student id
+ *      *base:  receives what to take off id to get the id in the shard
+ *
+ *  db_shard() returns the shard descriptor for id, which is fd itself with
+ *  a base of 0 if the database is not sharded.  Ids outside every shard go
+ *  to the first one with a base of 0, where they are never found.
+ *  db_shard_max_id() is the largest id an open database can take.
+ */
+bool db_sharded(int fd)
+{
+    return shard_set(fd) != NULL;
+}
+
+int db_shard(int fd, int id, int *base)
+{
+    shard_set_t *set = shard_set(fd);
+    int i;
+
+    *base = 0;
+    if (set == NULL)
+        return fd;
+
+    for (i = 0; i < set->count; i++)
+    {
+        if (id >= set->shards[i].first_id && id <= set->shards[i].last_id)
+        {
+            *base = set->shards[i].first_id - MIN_STD_ID;
+            return set->shards[i].fd;
+        }
+    }
+
+    return set->shards[0].fd;
+}
+
+int db_shard_max_id(void)
+{
+    int max = MAX_STD_ID;
+    int i;
+
+    for (i = 0; i < SHARD_SETS; i++)
+    {
+        shard_set_t *set = &shard_sets[i];
+
+        if (set->fd != -1 && set->shards[set->count - 1].last_id > max)
+            max = set->shards[set->count - 1].last_id;
+    }
+
+    return max;
+}
+
+/*
+ *  db_shard_count
+ *      fd:  database file descriptor
+ *
+ *  returns:  the number of students from the occupancy bitmaps of every
+ *            shard, -1 if one of them has no bitmap
+ */
+int db_shard_count(int fd)
+{
+    shard_set_t *set = shard_set(fd);
+    int total = 0;
+    int i;
+
+    if (set == NULL)
+        return db_bitmap_count(fd);
+
+    for (i = 0; i < set->count; i++)
+    {
+        int count = db_bitmap_count(set->shards[i].fd);
+
+        if (count < 0)
+            return -1;
+        total += count;
+    }
+
+    return total;
+}
+
+typedef struct shard_scan {
+    shard_t    *shard;
+    db_scan_fn fn;
+    void       *part;
+    int        base;
+    int        rc;
+} shard_scan_t;
+
+// hand fn the record with the id it has outside the shard
+static int shard_visit(const student_t *s, off_t slot, void *arg)
+{
+    shard_scan_t *sc = arg;
+    student_t rec = *s;
+
+    rec.id += sc->base;
+    return sc->fn(&rec, slot, sc->part);
+}
+
+static void *shard_worker(void *arg)
+{
+    shard_scan_t *sc = arg;
+
+    sc->rc = db_scan(sc->shard->fd, shard_visit, sc);
+    return NULL;
+}
+
+/*
+ *  db_shard_visit
+ *      fd, fn, arg:  see db_scan()
+ *
+ *  db_scan() for a database that may be sharded, one shard after the other
+ *  in the calling thread, for callers that keep state across every record
+ *  such as db_sort_scan().
+ *
+ *  returns:  NO_ERROR, ERR_DB_FILE or what fn returned, like db_scan()
+ */
+int db_shard_visit(int fd, db_scan_fn fn, void *arg)
+{
+    shard_set_t *set = shard_set(fd);
+    shard_scan_t sc;
+    int rc = NO_ERROR;
+    int i;
+
+    if (set == NULL)
+        return db_scan(fd, fn, arg);
+
+    for (i = 0; i < set->count && rc == NO_ERROR; i++)
+    {
+        sc.shard = &set->shards[i];
+        sc.fn = fn;
+        sc.part = arg;
+        sc.base = set->shards[i].first_id - MIN_STD_ID;
+        rc = db_scan(sc.shard->fd, shard_visit, &sc);
+    }
+
+    return rc;
+}
+
+/*
+ *  db_shard_scan
+ *      fd, fn, merge, part_size, arg:  see db_scan_parallel()
+ *
+ *  db_scan_parallel() for a database that may be sharded.  Every shard is
+ *  scanned by a thread of its own into its own part, the parts are merged
+ *  in shard order, which is id order for direct addressed shards.
+ *
+ *  returns:  NO_ERROR, ERR_DB_FILE or what fn returned, like db_scan()
+ */
+int db_shard_scan(int fd, db_scan_fn fn, db_merge_fn merge, size_t part_size,
+                  void *arg)
+{
+    shard_set_t *set = shard_set(fd);
+    pthread_t tids[SHARD_MAX];
+    shard_scan_t scans[SHARD_MAX];
+    bool started[SHARD_MAX];
+    char *parts;
+    int rc = NO_ERROR;
+    int i;
+
+    if (set == NULL)
+        return db_scan_parallel(fd, fn, merge, part_size, arg);
+
+    parts = calloc(set->count, part_size);
+    if (parts == NULL)
+        return ERR_DB_FILE;
+
+    for (i = 0; i < set->count; i++)
+    {
+        scans[i].shard = &set->shards[i];
+        scans[i].fn = fn;
+        scans[i].part = parts + (size_t)i * part_size;
+        scans[i].base = set->shards[i].first_id - MIN_STD_ID;
+        started[i] = pthread_create(&tids[i], NULL, shard_worker, &scans[i]) == 0;
+        if (!started[i])
+            shard_worker(&scans[i]);
+    }
+
+    for (i = 0; i < set->count; i++)
+    {
+        if (started[i])
+            pthread_join(tids[i], NULL);
+        if (rc == NO_ERROR)
+            rc = scans[i].rc;
+        merge(scans[i].part, arg);
+    }
+
+    free(parts);
+    return rc;
+}
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  Snapshots are copies of the database file made with db_clone(), so on a
+ *  file system with reflinks a snapshot costs a few metadata writes however
+ *  big the database is, and elsewhere it copies only the data extents.
+ *  Only the database file goes into the snapshot.  Every sidecar can be
+ *  rebuilt from it, and is when a restored database is opened.
+ */
+
+/*
+ *  snapshot_file
+ *      fd:    database file descriptor
+ *      name:  path of the snapshot
+ *      mode:  open() flags for the snapshot
+ *
+ *  Opens the snapshot and makes sure it is not the database itself, which
+ *  snapshot_db() would truncate and restore_db() would replace by itself.
+ *
+ *  returns:  descriptor of the snapshot, ERR_DB_FILE if it cannot be opened,
+ *            ERR_DB_OP if it is the database
+ */
+static int snapshot_file(int fd, char *name, int mode)
+{
+    struct stat db_st;
+    struct stat st;
+    int sfd;
+
+    sfd = open(name, mode, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (sfd == -1)
+    {
+        printf(M_ERR_SNAP_OPEN, name);
+        return ERR_DB_FILE;
+    }
+
+    if (fstat(fd, &db_st) == -1 || fstat(sfd, &st) == -1 ||
+        (st.st_dev == db_st.st_dev && st.st_ino == db_st.st_ino))
+    {
+        printf(M_ERR_SNAP_BAD, name);
+        close(sfd);
+        return ERR_DB_OP;
+    }
+
+    return sfd;
+}
+
+/*
+ *  snapshot_db
+ *      fd:    database file descriptor
+ *      name:  path of the snapshot to write, replaced if it exists
+ *
+ *  Takes a snapshot of the database.  Writers are held off with the
+ *  exclusive lock while the file is cloned, so the snapshot holds every
+ *  change that returned before it and none of the ones after.  The
+ *  snapshot is fsynced before the lock is given back.
+ *
+ *  returns:  NO_ERROR       snapshot written
+ *            ERR_DB_FILE    database or snapshot file I/O issue
+ *            ERR_DB_OP      name is the database itself
+ *
+ *  console:  M_SNAP_OK        on success
+ *            M_ERR_SNAP_OPEN  the snapshot file cannot be created
+ *            M_ERR_SNAP_BAD   name is the database itself
+ *            M_ERR_DB_READ    error locking the database
+ *            M_ERR_DB_WRITE   error copying the database
+ */
+int snapshot_db(int fd, char *name)
+{
+    int sfd;
+    int rc = NO_ERROR;
+
+    sfd = snapshot_file(fd, name, O_WRONLY | O_CREAT);
+    if (sfd < 0)
+        return sfd;
+
+    if (db_lock(fd, true) != NO_ERROR)
+    {
+        printf(M_ERR_DB_READ);
+        close(sfd);
+        return ERR_DB_FILE;
+    }
+
+    if (ftruncate(sfd, 0) == -1 || db_clone(fd, sfd) != NO_ERROR ||
+        db_fsync(sfd, false) == -1)
+        rc = ERR_DB_FILE;
+
+    db_unlock(fd);
+    close(sfd);
+
+    if (rc != NO_ERROR)
+    {
+        printf(M_ERR_DB_WRITE);
+        return rc;
+    }
+
+    printf(M_SNAP_OK, name);
+    return NO_ERROR;
+}
+
+/*
+ *  restore_db
+ *      fd:    database file descriptor, closed by this function whether
+ *             it succeeds or not
+ *      name:  path of a snapshot written by snapshot_db()
+ *
+ *  Replaces the database with a copy of the snapshot, the snapshot itself
+ *  is left as it is so it can be restored again.  Like compress_db() the
+ *  database file is replaced, so the database is reopened and its new
+ *  descriptor returned.
+ *
+ *  returns:  <number>       the fd of the restored database file
+ *            ERR_DB_FILE    database or snapshot file I/O issue
+ *            ERR_DB_OP      name is the database or not a database file
+ *
+ *  console:  M_SNAP_RESTORED  on success
+ *            M_ERR_SNAP_OPEN  the snapshot cannot be opened
+ *            M_ERR_SNAP_BAD   name is the database or not a database file
+ *            M_ERR_DB_CREATE  error replacing the database file
+ *            M_ERR_DB_OPEN    error opening the restored database
+ */
+int restore_db(int fd, char *name)
+{
+    struct stat st;
+    int sfd;
+    int rc;
+
+    sfd = snapshot_file(fd, name, O_RDONLY);
+    if (sfd < 0)
+    {
+        close_db(fd);
+        return sfd;
+    }
+
+    if (fstat(sfd, &st) == -1 || !S_ISREG(st.st_mode) ||
+        st.st_size % STUDENT_RECORD_SIZE != 0)
+    {
+        printf(M_ERR_SNAP_BAD, name);
+        close(sfd);
+        close_db(fd);
+        return ERR_DB_OP;
+    }
+
+    close_db(fd);
+    rc = db_restore(DB_FILE, sfd);
+    close(sfd);
+    if (rc != NO_ERROR)
+    {
+        printf(M_ERR_DB_CREATE);
+        return ERR_DB_FILE;
+    }
+
+    fd = open_db(DB_FILE, false);
+    if (fd < 0)
+        return ERR_DB_FILE;
+
+    printf(M_SNAP_RESTORED, name);
+    return fd;
+}
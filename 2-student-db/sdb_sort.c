@@ -0,0 +1,394 @@
+#define _GNU_SOURCE     //O_TMPFILE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  -p --sort=lname|fname|gpa prints the students in name or GPA order with
+ *  an external merge sort that never holds more than sdb_config.sort_kb KB
+ *  of records (--sort-mem=KB).
+ *
+ *  The scan copies records into the buffer.  Whenever it fills up it is
+ *  sorted with qsort() and written out as a run to an unnamed O_TMPFILE in
+ *  the directory of the database, the file goes away with its descriptor.
+ *  A database that fits in the buffer is never written out, it is sorted
+ *  and visited from memory.
+ *
+ *  Runs are merged SORT_MERGE_WAY at a time through a heap, the buffer is
+ *  split between the runs being read and, for the passes that write merged
+ *  runs to a new file, the output.  Passes continue until SORT_MERGE_WAY
+ *  runs or fewer are left, the last merge goes straight to the callback.
+ */
+
+typedef int (*sort_cmp_fn)(const void *a, const void *b);
+
+typedef struct sort_run {
+    off_t  off;                     //file offset of the first record
+    size_t count;                   //records in the run
+} sort_run_t;
+
+typedef struct sort {
+    sort_cmp_fn cmp;
+    student_t   *recs;              //the buffer
+    size_t      count;              //records in the buffer
+    size_t      cap;                //records the buffer holds
+    int         fd;                 //run file, -1 until the first run
+    off_t       end;                //bytes in the run file
+    sort_run_t  *runs;              //runs in the run file
+    int         nruns;
+    int         size;               //runs allocated
+    char        dir[PATH_MAX];      //where the run files go
+} sort_t;
+
+typedef struct sort_input {
+    student_t *buf;                 //part of the buffer for this run
+    size_t    pos;                  //next record in buf
+    size_t    n;                    //records in buf
+    off_t     next;                 //file offset of the next unread record
+    size_t    left;                 //records of the run not read yet
+} sort_input_t;
+
+static int cmp_id(const student_t *a, const student_t *b)
+{
+    return (a->id > b->id) - (a->id < b->id);
+}
+
+static int by_lname(const void *a, const void *b)
+{
+    const student_t *x = a;
+    const student_t *y = b;
+    int rc = strncmp(x->lname, y->lname, sizeof(x->lname));
+
+    if (rc == 0)
+        rc = strncmp(x->fname, y->fname, sizeof(x->fname));
+    return (rc != 0) ? rc : cmp_id(x, y);
+}
+
+static int by_fname(const void *a, const void *b)
+{
+    const student_t *x = a;
+    const student_t *y = b;
+    int rc = strncmp(x->fname, y->fname, sizeof(x->fname));
+
+    if (rc == 0)
+        rc = strncmp(x->lname, y->lname, sizeof(x->lname));
+    return (rc != 0) ? rc : cmp_id(x, y);
+}
+
+static int by_gpa(const void *a, const void *b)
+{
+    const student_t *x = a;
+    const student_t *y = b;
+    int rc = (x->gpa > y->gpa) - (x->gpa < y->gpa);
+
+    return (rc != 0) ? rc : cmp_id(x, y);
+}
+
+static int run_file(const sort_t *st)
+{
+    return open(st->dir, O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+}
+
+static int write_all(int fd, const void *buf, size_t len, off_t off)
+{
+    const char *p = buf;
+
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, p, len, off);
+
+        if (n <= 0)
+            return ERR_DB_FILE;
+        p += n;
+        off += n;
+        len -= (size_t)n;
+    }
+
+    return NO_ERROR;
+}
+
+static int read_all(int fd, void *buf, size_t len, off_t off)
+{
+    char *p = buf;
+
+    while (len > 0)
+    {
+        ssize_t n = pread(fd, p, len, off);
+
+        if (n <= 0)
+            return ERR_DB_FILE;
+        p += n;
+        off += n;
+        len -= (size_t)n;
+    }
+
+    return NO_ERROR;
+}
+
+// sort the buffer and write it to the run file as a new run
+static int write_run(sort_t *st)
+{
+    size_t len = st->count * STUDENT_RECORD_SIZE;
+
+    if (st->nruns == st->size)
+    {
+        int size = (st->size == 0) ? 64 : st->size * 2;
+        sort_run_t *runs = realloc(st->runs, size * sizeof(sort_run_t));
+
+        if (runs == NULL)
+            return ERR_DB_FILE;
+        st->runs = runs;
+        st->size = size;
+    }
+
+    if (st->fd == -1 && (st->fd = run_file(st)) == -1)
+        return ERR_DB_FILE;
+
+    qsort(st->recs, st->count, STUDENT_RECORD_SIZE, st->cmp);
+    if (write_all(st->fd, st->recs, len, st->end) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    st->runs[st->nruns].off = st->end;
+    st->runs[st->nruns].count = st->count;
+    st->nruns++;
+    st->end += (off_t)len;
+    st->count = 0;
+    return NO_ERROR;
+}
+
+static int collect_record(const student_t *s, off_t slot, void *arg)
+{
+    sort_t *st = arg;
+
+    (void)slot;
+    if (st->count == st->cap && write_run(st) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    st->recs[st->count++] = *s;
+    return NO_ERROR;
+}
+
+// read the next part of a run once its buffer is used up
+static int refill(int fd, sort_input_t *in, size_t per)
+{
+    size_t n = (in->left < per) ? in->left : per;
+
+    if (in->pos < in->n || n == 0)
+        return NO_ERROR;
+
+    if (read_all(fd, in->buf, n * STUDENT_RECORD_SIZE, in->next) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    in->next += (off_t)(n * STUDENT_RECORD_SIZE);
+    in->left -= n;
+    in->pos = 0;
+    in->n = n;
+    return NO_ERROR;
+}
+
+static bool heap_less(const sort_t *st, const sort_input_t *in, int a, int b)
+{
+    return st->cmp(&in[a].buf[in[a].pos], &in[b].buf[in[b].pos]) < 0;
+}
+
+static void heap_down(const sort_t *st, const sort_input_t *in, int *heap, int n, int i)
+{
+    for (;;)
+    {
+        int least = i;
+        int l = 2 * i + 1;
+        int r = l + 1;
+        int t;
+
+        if (l < n && heap_less(st, in, heap[l], heap[least]))
+            least = l;
+        if (r < n && heap_less(st, in, heap[r], heap[least]))
+            least = r;
+        if (least == i)
+            return;
+
+        t = heap[i];
+        heap[i] = heap[least];
+        heap[least] = t;
+        i = least;
+    }
+}
+
+/*
+ *  merge_runs
+ *      st:       sort state, its buffer is split between the runs
+ *      runs, k:  the runs of st->fd to merge, at most SORT_MERGE_WAY
+ *      out_fd:   file to write the merged run to at out_off, or -1 to
+ *                hand the records to fn instead
+ *      fn, arg:  callback for the records in order when out_fd is -1, the
+ *                slot it gets is the position in that order
+ *
+ *  returns:  NO_ERROR, ERR_DB_FILE or what fn returned
+ */
+static int merge_runs(sort_t *st, const sort_run_t *runs, int k, int out_fd,
+                      off_t out_off, db_scan_fn fn, void *arg)
+{
+    sort_input_t in[SORT_MERGE_WAY];
+    int heap[SORT_MERGE_WAY];
+    size_t per = st->cap / (size_t)(k + 1);
+    student_t *out = st->recs + (size_t)k * per;
+    size_t out_n = 0;
+    off_t rank = 0;
+    int n = 0;
+    int rc = NO_ERROR;
+    int i;
+
+    for (i = 0; i < k; i++)
+    {
+        in[i].buf = st->recs + (size_t)i * per;
+        in[i].pos = 0;
+        in[i].n = 0;
+        in[i].next = runs[i].off;
+        in[i].left = runs[i].count;
+        if (refill(st->fd, &in[i], per) != NO_ERROR)
+            return ERR_DB_FILE;
+        if (in[i].n > 0)
+            heap[n++] = i;
+    }
+    for (i = n / 2 - 1; i >= 0; i--)
+        heap_down(st, in, heap, n, i);
+
+    while (n > 0 && rc == NO_ERROR)
+    {
+        sort_input_t *top = &in[heap[0]];
+        const student_t *s = &top->buf[top->pos++];
+
+        if (out_fd == -1)
+            rc = fn(s, rank++, arg);
+        else
+        {
+            out[out_n++] = *s;
+            if (out_n == per)
+            {
+                rc = write_all(out_fd, out, out_n * STUDENT_RECORD_SIZE, out_off);
+                out_off += (off_t)(out_n * STUDENT_RECORD_SIZE);
+                out_n = 0;
+            }
+        }
+
+        if (rc == NO_ERROR && refill(st->fd, top, per) != NO_ERROR)
+            rc = ERR_DB_FILE;
+        if (top->pos == top->n)
+            heap[0] = heap[--n];
+        heap_down(st, in, heap, n, 0);
+    }
+
+    if (rc == NO_ERROR && out_n > 0)
+        rc = write_all(out_fd, out, out_n * STUDENT_RECORD_SIZE, out_off);
+
+    return rc;
+}
+
+// merge the runs SORT_MERGE_WAY at a time into a new run file
+static int merge_pass(sort_t *st)
+{
+    int fd = run_file(st);
+    off_t end = 0;
+    int nruns = 0;
+    int rc = NO_ERROR;
+    int i;
+
+    if (fd == -1)
+        return ERR_DB_FILE;
+
+    for (i = 0; i < st->nruns && rc == NO_ERROR; i += SORT_MERGE_WAY)
+    {
+        int k = (st->nruns - i < SORT_MERGE_WAY) ? st->nruns - i : SORT_MERGE_WAY;
+        sort_run_t run = { end, 0 };
+        int j;
+
+        for (j = 0; j < k; j++)
+            run.count += st->runs[i + j].count;
+
+        rc = merge_runs(st, &st->runs[i], k, fd, end, NULL, NULL);
+        end += (off_t)(run.count * STUDENT_RECORD_SIZE);
+        st->runs[nruns++] = run;
+    }
+
+    close(st->fd);
+    st->fd = fd;
+    st->end = end;
+    st->nruns = nruns;
+    return rc;
+}
+
+/*
+ *  db_sort_scan
+ *      fd:   database file descriptor
+ *      key:  SDB_SORT_LNAME, SDB_SORT_FNAME or SDB_SORT_GPA
+ *      fn:   callback for every non empty record, in key order.  The slot
+ *            it gets is the position in that order
+ *      arg:  passed through to fn
+ *
+ *  db_scan() in key order rather than slot order, in sdb_config.sort_kb KB
+ *  of memory whatever the size of the database, see the top of this file.
+ *
+ *  returns:  NO_ERROR       every record visited
+ *            ERR_DB_FILE    database or run file I/O issue, or no memory
+ *            <other>        whatever fn returned to stop the scan
+ */
+int db_sort_scan(int fd, int key, db_scan_fn fn, void *arg)
+{
+    static const sort_cmp_fn cmps[] = { NULL, by_lname, by_fname, by_gpa };
+    sdb_ctx_t *ctx = db_ctx(fd);
+    sort_t st;
+    char path[PATH_MAX];
+    size_t i;
+    int rc;
+
+    if (key <= SDB_SORT_NONE || key > SDB_SORT_GPA)
+        return ERR_DB_FILE;
+
+    memset(&st, 0, sizeof(st));
+    st.cmp = cmps[key];
+    st.fd = -1;
+    st.cap = (size_t)sdb_config.sort_kb * 1024 / STUDENT_RECORD_SIZE;
+    if (st.cap < SORT_MERGE_WAY + 1)
+        st.cap = SORT_MERGE_WAY + 1;
+    snprintf(path, sizeof(path), "%s", (ctx != NULL) ? ctx->path : DB_FILE);
+    snprintf(st.dir, sizeof(st.dir), "%s", dirname(path));
+
+    st.recs = malloc(st.cap * STUDENT_RECORD_SIZE);
+    if (st.recs == NULL)
+        return ERR_DB_FILE;
+
+    rc = db_shard_visit(fd, collect_record, &st);
+
+    if (rc == NO_ERROR && st.fd == -1)
+    {
+        // everything fit, no run was written
+        qsort(st.recs, st.count, STUDENT_RECORD_SIZE, st.cmp);
+        for (i = 0; i < st.count && rc == NO_ERROR; i++)
+            rc = fn(&st.recs[i], (off_t)i, arg);
+    }
+    else if (rc == NO_ERROR)
+    {
+        if (st.count > 0)
+            rc = write_run(&st);
+        while (rc == NO_ERROR && st.nruns > SORT_MERGE_WAY)
+            rc = merge_pass(&st);
+        if (rc == NO_ERROR)
+            rc = merge_runs(&st, st.runs, st.nruns, -1, 0, fn, arg);
+    }
+
+    if (st.fd != -1)
+        close(st.fd);
+    free(st.runs);
+    free(st.recs);
+    return rc;
+}
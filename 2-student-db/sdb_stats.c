@@ -0,0 +1,273 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  -S (or --stats=FILE) reports what one sdbsc command cost, phase by
+ *  phase: opening the database, running the operation, flushing its output
+ *  and closing.  Every phase gets its wall, user and system time, the read
+ *  and write type syscalls and bytes the kernel accounted to the process
+ *  (/proc/self/io, stdout and sockets included), the records the storage
+ *  engine scanned, read and wrote, and the syncs it did and how long it
+ *  waited for them.
+ *
+ *  The engine counts into sdb_stats whether or not -S was given, a relaxed
+ *  atomic add per chunk or record is cheaper than asking.  Syncs go through
+ *  db_fsync() and db_msync() so they are counted and timed in one place.
+ */
+
+#define STATS_MAX_PHASES    8
+
+typedef struct stats_phase {
+    const char      *name;
+    sdb_counters_t  start;          //totals when the phase began
+    sdb_counters_t  used;           //what the phase used
+} stats_phase_t;
+
+sdb_counters_t sdb_stats;
+
+static stats_phase_t phases[STATS_MAX_PHASES];
+static int nphases;
+static bool in_phase;
+
+// what reading /proc/self/io has cost so far, kept out of the report
+static uint64_t probe_reads;
+static uint64_t probe_bytes;
+
+static uint64_t elapsed_us(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static uint64_t tv_us(const struct timeval *tv)
+{
+    return (uint64_t)tv->tv_sec * 1000000 + (uint64_t)tv->tv_usec;
+}
+
+/*
+ *  read_totals
+ *      *c:  receives the totals of the process so far
+ *
+ *  /proc/self/io is read with a single read(), whose own syscall and bytes
+ *  are taken back out.  Fields the kernel does not account (no
+ *  /proc/self/io) stay 0.
+ */
+static void read_totals(sdb_counters_t *c)
+{
+    struct rusage ru;
+    char buff[512];
+    char *line;
+    char *next;
+    ssize_t n = -1;
+    int fd;
+
+    memset(c, 0, sizeof(*c));
+    c->records_scanned = __atomic_load_n(&sdb_stats.records_scanned, __ATOMIC_RELAXED);
+    c->records_read = __atomic_load_n(&sdb_stats.records_read, __ATOMIC_RELAXED);
+    c->records_written = __atomic_load_n(&sdb_stats.records_written, __ATOMIC_RELAXED);
+    c->syncs = __atomic_load_n(&sdb_stats.syncs, __ATOMIC_RELAXED);
+    c->sync_us = __atomic_load_n(&sdb_stats.sync_us, __ATOMIC_RELAXED);
+
+    fd = open("/proc/self/io", O_RDONLY);
+    if (fd != -1)
+    {
+        n = read(fd, buff, sizeof(buff) - 1);
+        close(fd);
+    }
+    if (n > 0)
+        buff[n] = '\0';
+    for (line = (n > 0) ? buff : NULL; line != NULL; line = next)
+    {
+        unsigned long long v;
+
+        next = strchr(line, '\n');
+        if (next != NULL)
+            *next++ = '\0';
+        if (sscanf(line, "rchar: %llu", &v) == 1)
+            c->bytes_read = v - probe_bytes;
+        else if (sscanf(line, "wchar: %llu", &v) == 1)
+            c->bytes_written = v;
+        else if (sscanf(line, "syscr: %llu", &v) == 1)
+            c->read_syscalls = v - probe_reads;
+        else if (sscanf(line, "syscw: %llu", &v) == 1)
+            c->write_syscalls = v;
+    }
+    if (n > 0)
+    {
+        probe_reads++;
+        probe_bytes += (uint64_t)n;
+    }
+
+    getrusage(RUSAGE_SELF, &ru);
+    c->user_us = tv_us(&ru.ru_utime);
+    c->sys_us = tv_us(&ru.ru_stime);
+    c->wall_us = elapsed_us(CLOCK_MONOTONIC);
+}
+
+/*
+ *  db_stats_phase
+ *      name:  phase that starts now, NULL to only end the current one
+ *
+ *  Ends the current phase and starts the next.  A no-op without -S.
+ */
+void db_stats_phase(const char *name)
+{
+    sdb_counters_t now;
+    uint64_t *from;
+    uint64_t *to;
+    uint64_t *used;
+    size_t i;
+
+    if (!sdb_config.stats)
+        return;
+
+    read_totals(&now);
+    if (in_phase)
+    {
+        from = (uint64_t *)&phases[nphases - 1].start;
+        to = (uint64_t *)&now;
+        used = (uint64_t *)&phases[nphases - 1].used;
+        for (i = 0; i < sizeof(now) / sizeof(uint64_t); i++)
+            used[i] = to[i] - from[i];
+        in_phase = false;
+    }
+
+    if (name != NULL && nphases < STATS_MAX_PHASES)
+    {
+        phases[nphases].name = name;
+        phases[nphases].start = now;
+        nphases++;
+        in_phase = true;
+    }
+}
+
+static void add_counters(sdb_counters_t *sum, const sdb_counters_t *c)
+{
+    uint64_t *s = (uint64_t *)sum;
+    const uint64_t *v = (const uint64_t *)c;
+    size_t i;
+
+    for (i = 0; i < sizeof(*c) / sizeof(uint64_t); i++)
+        s[i] += v[i];
+}
+
+static void print_text(const char *name, const sdb_counters_t *c)
+{
+    fprintf(stderr, M_STATS_PHASE, name,
+            c->wall_us / 1000.0, c->user_us / 1000.0, c->sys_us / 1000.0,
+            (unsigned long long)c->read_syscalls, (unsigned long long)c->bytes_read,
+            (unsigned long long)c->write_syscalls, (unsigned long long)c->bytes_written,
+            (unsigned long long)c->records_scanned, (unsigned long long)c->records_read,
+            (unsigned long long)c->records_written,
+            (unsigned long long)c->syncs, c->sync_us / 1000.0);
+}
+
+static void print_json(FILE *out, const char *name, const sdb_counters_t *c)
+{
+    fprintf(out, "{\"phase\": \"%s\", \"wall_us\": %llu, \"user_us\": %llu, "
+            "\"sys_us\": %llu, \"read_syscalls\": %llu, \"bytes_read\": %llu, "
+            "\"write_syscalls\": %llu, \"bytes_written\": %llu, "
+            "\"records_scanned\": %llu, \"records_read\": %llu, "
+            "\"records_written\": %llu, \"syncs\": %llu, \"sync_us\": %llu}",
+            name,
+            (unsigned long long)c->wall_us, (unsigned long long)c->user_us,
+            (unsigned long long)c->sys_us, (unsigned long long)c->read_syscalls,
+            (unsigned long long)c->bytes_read, (unsigned long long)c->write_syscalls,
+            (unsigned long long)c->bytes_written, (unsigned long long)c->records_scanned,
+            (unsigned long long)c->records_read, (unsigned long long)c->records_written,
+            (unsigned long long)c->syncs, (unsigned long long)c->sync_us);
+}
+
+/*
+ *  db_stats_report
+ *      op:  the option that ran, for example "-f"
+ *
+ *  Ends the current phase and reports every phase and their total, as
+ *  text on stderr or as one JSON object in sdb_config.stats_file.  A no-op
+ *  without -S.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE if the JSON file cannot be
+ *            written
+ */
+int db_stats_report(const char *op)
+{
+    sdb_counters_t total;
+    FILE *out;
+    int i;
+
+    if (!sdb_config.stats)
+        return NO_ERROR;
+
+    db_stats_phase(NULL);
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < nphases; i++)
+        add_counters(&total, &phases[i].used);
+
+    if (sdb_config.stats_file == NULL)
+    {
+        for (i = 0; i < nphases; i++)
+            print_text(phases[i].name, &phases[i].used);
+        print_text("total", &total);
+        return NO_ERROR;
+    }
+
+    out = fopen(sdb_config.stats_file, "w");
+    if (out == NULL)
+        return ERR_DB_FILE;
+
+    fprintf(out, "{\"op\": \"%s\", \"phases\": [", op);
+    for (i = 0; i < nphases; i++)
+    {
+        fprintf(out, "%s\n  ", (i == 0) ? "" : ",");
+        print_json(out, phases[i].name, &phases[i].used);
+    }
+    fprintf(out, "],\n \"total\": ");
+    print_json(out, "total", &total);
+    fprintf(out, "}\n");
+
+    return (fclose(out) == 0) ? NO_ERROR : ERR_DB_FILE;
+}
+
+/*
+ *  db_fsync / db_msync
+ *      fd:         file to sync
+ *      data_only:  fdatasync() rather than fsync()
+ *      addr, len, flags:  as for msync()
+ *
+ *  fsync(), fdatasync() and msync() for the storage engine, counted and
+ *  timed for -S.
+ *
+ *  returns:  what the system call returned
+ */
+int db_fsync(int fd, bool data_only)
+{
+    uint64_t start = elapsed_us(CLOCK_MONOTONIC);
+    int rc = data_only ? fdatasync(fd) : fsync(fd);
+
+    SDB_COUNT(syncs, 1);
+    SDB_COUNT(sync_us, elapsed_us(CLOCK_MONOTONIC) - start);
+    return rc;
+}
+
+int db_msync(void *addr, size_t len, int flags)
+{
+    uint64_t start = elapsed_us(CLOCK_MONOTONIC);
+    int rc = msync(addr, len, flags);
+
+    SDB_COUNT(syncs, 1);
+    SDB_COUNT(sync_us, elapsed_us(CLOCK_MONOTONIC) - start);
+    return rc;
+}
@@ -0,0 +1,1847 @@
+#define _GNU_SOURCE     //mremap()
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <linux/fs.h>     //FICLONE
+#include <unistd.h>
+#include <stdbool.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>    //empty slot tests, see skip_empty()
+#endif
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+//The CLI only ever has one or two databases open at once (compress_db()
+//briefly has two) plus the shards of a sharded one, the table leaves some
+//head room for other tools
+#define SDB_MAX_OPEN    32
+
+//number of records read per pread() when rebuilding the index
+#define IDX_SCAN_RECORDS    1024
+
+//buffer db_clone() copies through where copy_file_range() is not there
+#define CLONE_BUFF_BYTES    (64 * 1024)
+
+//bytes db_scan() reads per pread(), 1MB
+#define SCAN_CHUNK_BYTES    (1024 * 1024)
+#define SCAN_CHUNK_RECORDS  (SCAN_CHUNK_BYTES / STUDENT_RECORD_SIZE)
+
+//db_scan_parallel() only starts threads for files of at least
+//PSCAN_MIN_BYTES, and splits them in PSCAN_RANGES_PER_THREAD ranges per
+//thread so a thread that hits a hole moves on to the next range
+#define PSCAN_MIN_BYTES         (4 * 1024 * 1024)
+#define PSCAN_RANGES_PER_THREAD 4
+#define PSCAN_MAX_THREADS       64
+#define PSCAN_PAGE              4096
+
+static sdb_ctx_t db_table[SDB_MAX_OPEN];
+
+sdb_config_t sdb_config = {
+    .use_mmap = SDB_MMAP,
+    .sync_policy = SDB_SYNC_NONE,
+    .auto_compact = true,
+    .use_wal = true,
+    .commit_every = 1,
+    .commit_ms = 0,
+    .serve = false,
+    .remote = false,
+    .scan_threads = 0,
+    .shards = 0,
+    .layout = -1,
+    .pool_pages = 0,
+    .direct_io = false,
+    .stats = false,
+    .stats_file = NULL,
+    .sort_key = SDB_SORT_NONE,
+    .sort_kb = SORT_MEM_KB,
+};
+
+static bool record_empty(const student_t *s)
+{
+    return memcmp(s, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE) == 0;
+}
+
+/*
+ *  classify
+ *      recs:  records read by a scan
+ *      n:     number of records, at most SCAN_CHUNK_RECORDS
+ *      live:  receives one bit per record, set for the non empty ones
+ *
+ *  An empty slot is 64 zero bytes.  Where the CPU has them every record is
+ *  tested with two 32 byte AVX2 loads or four 16 byte SSE2 loads instead
+ *  of a memcmp(), the scan then only looks at the set bits.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void classify_avx2(const student_t *recs, size_t n, uint64_t *live)
+{
+    size_t i;
+
+    // four records a step, four empty slots cost one test
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        const __m256i *p = (const __m256i *)&recs[i];
+        __m256i a = _mm256_or_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p + 1));
+        __m256i b = _mm256_or_si256(_mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3));
+        __m256i c = _mm256_or_si256(_mm256_loadu_si256(p + 4), _mm256_loadu_si256(p + 5));
+        __m256i d = _mm256_or_si256(_mm256_loadu_si256(p + 6), _mm256_loadu_si256(p + 7));
+        __m256i all = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+
+        if (_mm256_testz_si256(all, all))
+            continue;
+        live[i / 64] |= ((uint64_t)!_mm256_testz_si256(a, a) |
+                         (uint64_t)!_mm256_testz_si256(b, b) << 1 |
+                         (uint64_t)!_mm256_testz_si256(c, c) << 2 |
+                         (uint64_t)!_mm256_testz_si256(d, d) << 3) << (i % 64);
+    }
+    for (; i < n; i++)
+        live[i / 64] |= (uint64_t)!record_empty(&recs[i]) << (i % 64);
+}
+
+__attribute__((target("sse2")))
+static void classify_sse2(const student_t *recs, size_t n, uint64_t *live)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        const __m128i *p = (const __m128i *)&recs[i];
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+                                 _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+
+        live[i / 64] |= (uint64_t)(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff)
+                        << (i % 64);
+    }
+}
+#endif
+
+static void classify(const student_t *recs, size_t n, uint64_t *live)
+{
+    size_t i;
+
+    memset(live, 0, (n + 63) / 64 * sizeof(uint64_t));
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        classify_avx2(recs, n, live);
+        return;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        classify_sse2(recs, n, live);
+        return;
+    }
+#endif
+    for (i = 0; i < n; i++)
+        live[i / 64] |= (uint64_t)!record_empty(&recs[i]) << (i % 64);
+}
+
+// bytes per slot in the file of ctx
+static off_t record_bytes(const sdb_ctx_t *ctx)
+{
+    return (ctx->layout == DB_LAYOUT_COMPACT) ? COMPACT_RECORD_SIZE : STUDENT_RECORD_SIZE;
+}
+
+/*
+ *  db_sidecar_path
+ *      path:    path of the database file, for example "student.db"
+ *      suffix:  sidecar suffix, for example IDX_SIDECAR
+ *      out:     buffer of PATH_MAX bytes that receives the sidecar path
+ *
+ *  Sidecar files are hidden files in the same directory as the database,
+ *  for example dir/student.db -> dir/.student.db.idx
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE if the path is too long
+ */
+int db_sidecar_path(const char *path, const char *suffix, char *out)
+{
+    const char *base = strrchr(path, '/');
+    int n;
+
+    if (base == NULL)
+        n = snprintf(out, PATH_MAX, ".%s%s", path, suffix);
+    else
+        n = snprintf(out, PATH_MAX, "%.*s/.%s%s", (int)(base - path), path,
+                     base + 1, suffix);
+
+    if (n < 0 || n >= PATH_MAX)
+        return ERR_DB_FILE;
+
+    return NO_ERROR;
+}
+
+/*
+ *  db_remove_sidecars
+ *      path:  path of the database file
+ *
+ *  Removes every sidecar of a database, used when the database is emptied
+ *  so nothing describing the old contents is left behind.
+ */
+void db_remove_sidecars(const char *path)
+{
+    static const char *suffixes[] = {
+        IDX_SIDECAR, BMP_SIDECAR, WAL_SIDECAR, NAME_SIDECAR, GPA_SIDECAR, COL_SIDECAR,
+        HASH_SIDECAR, DICT_SIDECAR, DICT_ALT_SIDECAR,
+    };
+    char sidecar[PATH_MAX];
+    size_t i;
+
+    for (i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++)
+    {
+        if (db_sidecar_path(path, suffixes[i], sidecar) == NO_ERROR)
+            unlink(sidecar);
+    }
+}
+
+/*
+ *  index_unmap / index_map
+ *      ctx:     database context
+ *      create:  create the index file if it does not exist yet
+ *
+ *  The index is a sparse file of IDX_FILE_SIZE bytes that is mapped shared
+ *  so that lookups are a memory access and updates a memory store.
+ *
+ *  returns:  NO_ERROR on success, SRCH_NOT_FOUND if the index file does not
+ *            exist and create is false, ERR_DB_FILE on I/O errors
+ */
+static void index_unmap(sdb_ctx_t *ctx)
+{
+    if (ctx->idx != NULL)
+        munmap(ctx->idx, IDX_FILE_SIZE);
+    ctx->idx = NULL;
+}
+
+static int index_map(sdb_ctx_t *ctx, bool create)
+{
+    char idx_path[PATH_MAX];
+    struct stat st;
+    void *map;
+    int ifd;
+
+    if (ctx->idx != NULL)
+        return NO_ERROR;
+
+    if (db_sidecar_path(ctx->path, IDX_SIDECAR, idx_path) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    ifd = open(idx_path, O_RDWR | (create ? O_CREAT : 0),
+               S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (ifd == -1)
+        return create ? ERR_DB_FILE : SRCH_NOT_FOUND;
+
+    if (fstat(ifd, &st) == -1 ||
+        (st.st_size != IDX_FILE_SIZE && ftruncate(ifd, IDX_FILE_SIZE) == -1))
+    {
+        close(ifd);
+        return ERR_DB_FILE;
+    }
+
+    map = mmap(NULL, IDX_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ifd, 0);
+    close(ifd);
+    if (map == MAP_FAILED)
+        return ERR_DB_FILE;
+
+    ctx->idx = map;
+    return NO_ERROR;
+}
+
+/*
+ *  index_current
+ *      ctx:  database context with a mapped index
+ *
+ *  An index only describes the file it was built for.  If the database was
+ *  removed and created again (empty, or a different inode) the index is
+ *  left over from the old file, it is dropped and the file treated as
+ *  direct addressed.
+ *
+ *  returns:  true if the index belongs to the database file
+ */
+static bool index_current(sdb_ctx_t *ctx)
+{
+    char idx_path[PATH_MAX];
+    struct stat st;
+
+    if (fstat(ctx->fd, &st) == 0 && st.st_size > 0 &&
+        ctx->idx[0] == (uint32_t)st.st_ino)
+        return true;
+
+    index_unmap(ctx);
+    if (db_sidecar_path(ctx->path, IDX_SIDECAR, idx_path) == NO_ERROR)
+        unlink(idx_path);
+    return false;
+}
+
+/*
+ *  index_rebuild
+ *      ctx:  database context
+ *
+ *  Rebuilds the index of a packed database from a scan of the database
+ *  file and maps it.  Used when a packed file shows up without an index
+ *  (older files written before the index existed) or when the index
+ *  disagrees with the database file.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on I/O errors
+ */
+static int index_rebuild(sdb_ctx_t *ctx)
+{
+    char idx_path[PATH_MAX];
+
+    index_unmap(ctx);
+    if (db_sidecar_path(ctx->path, IDX_SIDECAR, idx_path) != NO_ERROR ||
+        db_pool_flush(ctx) != NO_ERROR)
+        return ERR_DB_FILE;
+    if (db_index_build(ctx->fd, idx_path) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    ctx->layout = DB_LAYOUT_PACKED;
+    return index_map(ctx, false);
+}
+
+/*
+ *  map_resize / map_refresh
+ *      ctx:  database context
+ *      len:  number of bytes the mapping should cover
+ *
+ *  The mmap backend maps exactly the current size of the database file.
+ *  map_resize() moves the mapping to a new length with mremap(), the caller
+ *  makes sure the file is at least that long.  map_refresh() picks up size
+ *  changes made through other descriptors or processes.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int map_resize(sdb_ctx_t *ctx, size_t len)
+{
+    void *map;
+
+    if (len == ctx->map_len)
+        return NO_ERROR;
+
+    if (len == 0)
+    {
+        munmap(ctx->map, ctx->map_len);
+        map = NULL;
+    }
+    else if (ctx->map == NULL)
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->fd, 0);
+    else
+        map = mremap(ctx->map, ctx->map_len, len, MREMAP_MAYMOVE);
+
+    if (map == MAP_FAILED)
+        return ERR_DB_FILE;
+
+    ctx->map = map;
+    ctx->map_len = len;
+    return NO_ERROR;
+}
+
+static int map_refresh(sdb_ctx_t *ctx)
+{
+    struct stat st;
+
+    if (ctx->layout == DB_LAYOUT_COMPACT)
+        return NO_ERROR;
+
+    if (fstat(ctx->fd, &st) == -1)
+        return ERR_DB_FILE;
+
+    return map_resize(ctx, (size_t)st.st_size);
+}
+
+/*
+ *  map_sync
+ *      ctx:    database context
+ *      off:    first byte that changed
+ *      len:    number of bytes that changed
+ *      flags:  MS_ASYNC or MS_SYNC
+ *
+ *  msync() wants a page aligned start address, round the range out.
+ */
+static int map_sync(sdb_ctx_t *ctx, off_t off, size_t len, int flags)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    off_t start = off - (off % page);
+
+    if (db_msync((char *)ctx->map + start, len + (off - start), flags) == -1)
+        return ERR_DB_FILE;
+
+    return NO_ERROR;
+}
+
+/*
+ *  db_register
+ *      fd:    file descriptor returned from open()
+ *      path:  path the file was opened with
+ *
+ *  Creates the context for a database file and works out its layout.  A
+ *  database with a hash directory is hashed, one with an index sidecar is
+ *  packed.  Without either, slot 0 tells the layouts apart: ids start at
+ *  MIN_STD_ID so slot 0 is always empty in a direct addressed file, but
+ *  holds the first record of a packed file.
+ *
+ *  returns:  pointer to the context, NULL if the table is full or the path
+ *            is too long
+ */
+sdb_ctx_t *db_register(int fd, const char *path)
+{
+    sdb_ctx_t *ctx = NULL;
+    student_t first;
+    int rc;
+    int i;
+
+    for (i = 0; i < SDB_MAX_OPEN; i++)
+    {
+        if (db_table[i].path[0] == '\0')
+        {
+            ctx = &db_table[i];
+            break;
+        }
+    }
+
+    if (ctx == NULL || strlen(path) >= PATH_MAX)
+        return NULL;
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->fd = fd;
+    ctx->wal_fd = -1;
+    ctx->names_fd = -1;
+    ctx->layout = DB_LAYOUT_DIRECT;
+    strcpy(ctx->path, path);
+
+    // a compact file says so in slot 0, it is never mapped
+    rc = db_dict_open(ctx);
+    if (rc == NO_ERROR)
+        ctx->layout = DB_LAYOUT_COMPACT;
+    if ((rc != NO_ERROR && rc != SRCH_NOT_FOUND) ||
+        (sdb_config.use_mmap && map_refresh(ctx) != NO_ERROR))
+    {
+        db_dict_close(ctx);
+        memset(ctx, 0, sizeof(*ctx));
+        return NULL;
+    }
+
+    if (ctx->layout == DB_LAYOUT_COMPACT)
+        rc = NO_ERROR;
+    else if ((rc = db_hash_open(ctx)) == NO_ERROR)
+        ctx->layout = DB_LAYOUT_HASH;
+    else if (rc != SRCH_NOT_FOUND)
+    {
+        map_resize(ctx, 0);
+        memset(ctx, 0, sizeof(*ctx));
+        return NULL;
+    }
+    else if (index_map(ctx, false) == NO_ERROR && index_current(ctx))
+        ctx->layout = DB_LAYOUT_PACKED;
+    else if (db_read_slot(fd, 0, &first) == NO_ERROR &&
+             first.id != DELETED_STUDENT_ID)
+        index_rebuild(ctx);
+
+    // a log left by a crash is replayed before anything trusts the file,
+    // the bitmap notices the replay through its stamp and rebuilds
+    if (wal_open(ctx) != NO_ERROR && sdb_config.use_wal)
+    {
+        db_dict_close(ctx);
+        db_hash_close(ctx);
+        index_unmap(ctx);
+        map_resize(ctx, 0);
+        memset(ctx, 0, sizeof(*ctx));
+        return NULL;
+    }
+
+    // without a bitmap counts and duplicate checks read the database,
+    // without the name and GPA indexes and the columns their queries do.
+    // They have an entry for every id up to MAX_STD_ID, a hashed database
+    // goes without
+    if (ctx->layout != DB_LAYOUT_HASH)
+    {
+        db_bitmap_open(ctx);
+        db_names_open(ctx);
+        db_gpa_open(ctx);
+        db_col_open(ctx);
+    }
+
+    return ctx;
+}
+
+/*
+ *  db_ctx
+ *      fd:  database file descriptor
+ *
+ *  Looks up the context of an open database.  Descriptors that did not come
+ *  from open_db() are registered on first use as DB_FILE.
+ *
+ *  returns:  pointer to the context, NULL if none could be created
+ */
+sdb_ctx_t *db_ctx(int fd)
+{
+    int i;
+
+    for (i = 0; i < SDB_MAX_OPEN; i++)
+    {
+        if (db_table[i].path[0] != '\0' && db_table[i].fd == fd)
+            return &db_table[i];
+    }
+
+    return db_register(fd, DB_FILE);
+}
+
+/*
+ *  db_unregister
+ *      fd:  database file descriptor
+ *
+ *  Releases the context of a database, the caller still closes the fd.
+ */
+void db_unregister(int fd)
+{
+    int i;
+
+    for (i = 0; i < SDB_MAX_OPEN; i++)
+    {
+        if (db_table[i].path[0] != '\0' && db_table[i].fd == fd)
+        {
+            db_pool_close(&db_table[i]);
+            wal_close(&db_table[i]);
+            db_hash_close(&db_table[i]);
+            db_dict_close(&db_table[i]);
+            index_unmap(&db_table[i]);
+            db_bitmap_close(&db_table[i]);
+            db_names_close(&db_table[i]);
+            db_gpa_close(&db_table[i]);
+            db_col_close(&db_table[i]);
+            map_resize(&db_table[i], 0);
+            memset(&db_table[i], 0, sizeof(db_table[i]));
+        }
+    }
+}
+
+/*
+ *  db_max_id
+ *
+ *  validate_range() takes ids up to what the open database can hold:
+ *  HASH_MAX_STD_ID for a hashed one, otherwise see db_shard_max_id().
+ *
+ *  returns:  the largest student id the open database takes
+ */
+int db_max_id(void)
+{
+    int i;
+
+    for (i = 0; i < SDB_MAX_OPEN; i++)
+    {
+        if (db_table[i].path[0] != '\0' && db_table[i].layout == DB_LAYOUT_HASH)
+            return HASH_MAX_STD_ID;
+    }
+
+    return db_shard_max_id();
+}
+
+/*
+ *  db_read_slot / db_write_slot
+ *      fd:    database file descriptor
+ *      slot:  record slot, the byte offset is slot * STUDENT_RECORD_SIZE
+ *      *s:    record to read into or write from
+ *
+ *  With the mmap backend records are copied straight out of and into the
+ *  mapping, writes past the end of the file grow it with ftruncate() and
+ *  the mapping with mremap().  Otherwise these are a pread()/pwrite().
+ *  A compact database encodes and decodes through its dictionary instead,
+ *  see db_dict_read(), and with --pool records go through the buffer pool,
+ *  see db_pool_read().  Writes honour sdb_config.sync_policy.
+ *
+ *  returns:  NO_ERROR       record transferred
+ *            SRCH_NOT_FOUND slot is past the end of the file (read only)
+ *            ERR_DB_FILE    I/O error or short transfer
+ */
+int db_read_slot(int fd, off_t slot, student_t *s)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+    off_t off = slot * STUDENT_RECORD_SIZE;
+    ssize_t n;
+
+    SDB_COUNT(records_read, 1);
+    if (ctx != NULL && ctx->layout == DB_LAYOUT_COMPACT)
+        return db_dict_read(ctx, fd, slot, s);
+    if (ctx != NULL && db_pool_enabled(ctx))
+        return db_pool_read(ctx, slot, s);
+
+    if (ctx != NULL && sdb_config.use_mmap)
+    {
+        if ((size_t)(off + STUDENT_RECORD_SIZE) > ctx->map_len &&
+            map_refresh(ctx) != NO_ERROR)
+            return ERR_DB_FILE;
+
+        if ((size_t)off >= ctx->map_len)
+            return SRCH_NOT_FOUND;
+        if ((size_t)(off + STUDENT_RECORD_SIZE) > ctx->map_len)
+            return ERR_DB_FILE;
+
+        memcpy(s, &ctx->map[slot], STUDENT_RECORD_SIZE);
+        return NO_ERROR;
+    }
+
+    n = pread(fd, s, STUDENT_RECORD_SIZE, off);
+    if (n == 0)
+        return SRCH_NOT_FOUND;
+    if (n != STUDENT_RECORD_SIZE)
+        return ERR_DB_FILE;
+
+    return NO_ERROR;
+}
+
+static int write_slot(sdb_ctx_t *ctx, int fd, off_t slot, const student_t *s)
+{
+    off_t off = slot * STUDENT_RECORD_SIZE;
+    size_t end = (size_t)(off + STUDENT_RECORD_SIZE);
+
+    if (ctx != NULL && ctx->layout == DB_LAYOUT_COMPACT)
+        return db_dict_write(ctx, fd, slot, s);
+    if (ctx != NULL && db_pool_enabled(ctx))
+        return db_pool_write(ctx, slot, s);
+
+    if (ctx != NULL && sdb_config.use_mmap)
+    {
+        if (end > ctx->map_len && map_refresh(ctx) != NO_ERROR)
+            return ERR_DB_FILE;
+
+        if (end > ctx->map_len &&
+            (ftruncate(fd, (off_t)end) == -1 || map_resize(ctx, end) != NO_ERROR))
+            return ERR_DB_FILE;
+
+        memcpy(&ctx->map[slot], s, STUDENT_RECORD_SIZE);
+
+        if (sdb_config.sync_policy == SDB_SYNC_ASYNC)
+            return map_sync(ctx, off, STUDENT_RECORD_SIZE, MS_ASYNC);
+        if (sdb_config.sync_policy == SDB_SYNC_FULL)
+            return map_sync(ctx, off, STUDENT_RECORD_SIZE, MS_SYNC);
+        return NO_ERROR;
+    }
+
+    if (pwrite(fd, s, STUDENT_RECORD_SIZE, off) != STUDENT_RECORD_SIZE)
+        return ERR_DB_FILE;
+
+    if (sdb_config.sync_policy == SDB_SYNC_FULL && db_fsync(fd, true) == -1)
+        return ERR_DB_FILE;
+
+    return NO_ERROR;
+}
+
+int db_write_slot(int fd, off_t slot, const student_t *s)
+{
+    SDB_COUNT(records_written, 1);
+    return write_slot(db_ctx(fd), fd, slot, s);
+}
+
+/*
+ *  db_sync
+ *      fd:     database file descriptor
+ *      force:  wait for the data to reach the disk whatever the policy is
+ *
+ *  Flushes changes according to sdb_config.sync_policy, del_student() forces
+ *  a full flush like it always has.  With the mmap backend a full flush
+ *  also fsyncs the file when it has grown past the mapping.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+int db_sync(int fd, bool force)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+    int policy = force ? SDB_SYNC_FULL : sdb_config.sync_policy;
+
+    if (ctx != NULL && db_pool_flush(ctx) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    if (policy == SDB_SYNC_NONE)
+        return NO_ERROR;
+
+    // names reach the disk before the records that use them
+    if (ctx != NULL && policy == SDB_SYNC_FULL && db_dict_sync(ctx) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    if (ctx != NULL && ctx->map_len > 0)
+    {
+        struct stat st;
+
+        if (map_sync(ctx, 0, ctx->map_len,
+                     policy == SDB_SYNC_FULL ? MS_SYNC : MS_ASYNC) != NO_ERROR)
+            return ERR_DB_FILE;
+
+        // records past the mapping were written with pwrite(), by the bulk
+        // loader or by another process, msync() does not cover them
+        if (policy != SDB_SYNC_FULL ||
+            (fstat(fd, &st) == 0 && (size_t)st.st_size <= ctx->map_len))
+            return NO_ERROR;
+    }
+
+    if (policy == SDB_SYNC_FULL && db_fsync(fd, false) == -1)
+        return ERR_DB_FILE;
+
+    return NO_ERROR;
+}
+
+/*
+ *  db_lock / db_unlock
+ *      fd:         database file descriptor
+ *      exclusive:  true for an exclusive lock, false for a shared one
+ *
+ *  Whole file advisory lock (flock()).  Anything that changes records holds
+ *  it shared for the whole change, the records themselves are kept apart
+ *  with db_lock_records().  Operations on the whole file hold it exclusive:
+ *  punching out blocks, compress_db() and emptying the database with -z.
+ *
+ *  The last two replace the file with a new one under the exclusive lock.
+ *  Whoever was waiting on the old file notices once it gets the lock, and
+ *  reopens the database on the same descriptor before locking again.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+int db_lock(int fd, bool exclusive)
+{
+    char path[PATH_MAX];
+    sdb_ctx_t *ctx;
+    struct stat st;
+    struct stat now;
+    int nfd;
+
+    for (;;)
+    {
+        if (flock(fd, exclusive ? LOCK_EX : LOCK_SH) == -1)
+            return ERR_DB_FILE;
+
+        ctx = db_ctx(fd);
+        if (ctx == NULL || fstat(fd, &st) == -1 || stat(ctx->path, &now) == -1 ||
+            (st.st_dev == now.st_dev && st.st_ino == now.st_ino))
+            return NO_ERROR;
+
+        flock(fd, LOCK_UN);
+        strcpy(path, ctx->path);
+        nfd = open(path, O_RDWR);
+        if (nfd == -1)
+            return ERR_DB_FILE;
+
+        db_unregister(fd);
+        if (dup2(nfd, fd) == -1)
+        {
+            close(nfd);
+            return ERR_DB_FILE;
+        }
+        close(nfd);
+
+        if (db_register(fd, path) == NULL)
+            return ERR_DB_FILE;
+    }
+}
+
+void db_unlock(int fd)
+{
+    flock(fd, LOCK_UN);
+}
+
+static int lock_range(int fd, int id, int n, short type)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = (off_t)id * STUDENT_RECORD_SIZE;
+    fl.l_len = (off_t)n * STUDENT_RECORD_SIZE;
+
+#ifdef F_OFD_SETLKW
+    if (fcntl(fd, F_OFD_SETLKW, &fl) == 0)
+        return NO_ERROR;
+    if (errno != EINVAL)
+        return ERR_DB_FILE;
+#endif
+    // kernels without open file description locks, fall back to the
+    // process owned kind
+    if (fcntl(fd, F_SETLKW, &fl) == -1)
+        return ERR_DB_FILE;
+
+    return NO_ERROR;
+}
+
+/*
+ *  db_lock_records / db_unlock_records
+ *      fd:         database file descriptor
+ *      id:         first student id to lock
+ *      n:          number of consecutive ids
+ *      exclusive:  true to change the students, false to read them
+ *
+ *  Byte-range locks (fcntl() F_OFD_SETLKW) over id * STUDENT_RECORD_SIZE for
+ *  n records, the records themselves in a direct addressed file.  A packed
+ *  file is locked over the same ranges, there they stand for the ids and not
+ *  the slots, which is what keeps two adds of one id apart.  The locks belong
+ *  to the open file description, so closing some other descriptor of the
+ *  file does not drop them the way it drops classic POSIX locks.
+ *
+ *  SDB_LOCK_META is an id past the last student, its lock guards the state
+ *  the sidecars share between all students: counters, bucket lists and
+ *  the end of a packed file.  It is only ever taken last and held briefly.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+int db_lock_records(int fd, int id, int n, bool exclusive)
+{
+    return lock_range(fd, id, n, exclusive ? F_WRLCK : F_RDLCK);
+}
+
+void db_unlock_records(int fd, int id, int n)
+{
+    lock_range(fd, id, n, F_UNLCK);
+}
+
+/*
+ *  db_replace_empty / db_restore
+ *      path:  database file to replace
+ *      src:   descriptor of the snapshot to restore
+ *
+ *  Replace the whole database, with an empty file for -z or with a copy of
+ *  a snapshot for -r.  The new file starts over with its own sidecars, so
+ *  every sidecar of the old one goes; a packed snapshot gets its index
+ *  written before it shows up.  Rather than truncating or rewriting the
+ *  file under other users of it, the new file is renamed over it while the
+ *  old one is locked exclusively, see db_lock().
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int replace_file(const char *path, int src)
+{
+    char tmp_path[PATH_MAX];
+    char idx_path[PATH_MAX];
+    char tmp_idx_path[PATH_MAX];
+    student_t first;
+    bool packed = false;
+    int fd;
+    int tfd;
+    int rc = NO_ERROR;
+
+    if (db_sidecar_path(path, TMP_SIDECAR, tmp_path) != NO_ERROR ||
+        db_sidecar_path(path, IDX_SIDECAR, idx_path) != NO_ERROR ||
+        db_sidecar_path(tmp_path, IDX_SIDECAR, tmp_idx_path) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (fd == -1)
+        return ERR_DB_FILE;
+
+    if (flock(fd, LOCK_EX) == -1)
+    {
+        close(fd);
+        return ERR_DB_FILE;
+    }
+
+    tfd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC,
+               S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (tfd == -1)
+        rc = ERR_DB_FILE;
+    else if (src >= 0)
+    {
+        // slot 0 tells a packed snapshot apart, see db_register()
+        if (db_clone(src, tfd) != NO_ERROR || db_fsync(tfd, false) == -1)
+            rc = ERR_DB_FILE;
+        else if (pread(tfd, &first, sizeof(first), 0) == sizeof(first) &&
+                 first.id != DELETED_STUDENT_ID)
+        {
+            packed = true;
+            rc = db_index_build(tfd, tmp_idx_path);
+        }
+    }
+
+    if (tfd != -1)
+    {
+        close(tfd);
+        if (rc == NO_ERROR)
+        {
+            db_remove_sidecars(path);
+            if ((packed && rename(tmp_idx_path, idx_path) != 0) ||
+                rename(tmp_path, path) != 0)
+                rc = ERR_DB_FILE;
+        }
+        else
+        {
+            unlink(tmp_idx_path);
+            unlink(tmp_path);
+        }
+    }
+
+    close(fd);
+    return rc;
+}
+
+int db_replace_empty(const char *path)
+{
+    return replace_file(path, -1);
+}
+
+int db_restore(const char *path, int src)
+{
+    return replace_file(path, src);
+}
+
+/*
+ *  copy_extent
+ *      src, dst:    descriptors to copy between
+ *      start, end:  byte range to copy, at the same offsets in dst
+ *
+ *  copy_file_range() keeps the copy in the kernel and lets the file system
+ *  share blocks where it can.  It is not there on every kernel and file
+ *  system pair, then the range goes through a buffer instead.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on I/O errors
+ */
+static int copy_extent(int src, int dst, off_t start, off_t end)
+{
+    char buff[CLONE_BUFF_BYTES];
+    off_t in = start;
+    off_t out = start;
+    ssize_t n;
+
+    while (in < end)
+    {
+        n = copy_file_range(src, &in, dst, &out, end - in, 0);
+        if (n > 0)
+            continue;
+        if (n == 0)
+            return ERR_DB_FILE;
+        if (errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP &&
+            errno != EINVAL)
+            return ERR_DB_FILE;
+        break;
+    }
+
+    while (in < end)
+    {
+        size_t want = (end - in < CLONE_BUFF_BYTES) ? end - in : CLONE_BUFF_BYTES;
+
+        n = pread(src, buff, want, in);
+        if (n <= 0 || pwrite(dst, buff, n, in) != n)
+            return ERR_DB_FILE;
+        in += n;
+    }
+
+    return NO_ERROR;
+}
+
+/*
+ *  block_bytes
+ *      fd:  database file descriptor
+ *
+ *  returns:  the file system block size, the unit holes can be punched in
+ */
+static off_t block_bytes(int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || st.st_blksize <= 0 ||
+        st.st_blksize % STUDENT_RECORD_SIZE != 0)
+        return 4096;
+
+    return st.st_blksize;
+}
+
+/*
+ *  punch_if_empty
+ *      fd:     database file descriptor
+ *      start:  first byte of a file system block
+ *      len:    length of the block, shorter for a partial last block
+ *      buff:   scratch space of at least len bytes
+ *
+ *  Gives the storage of a block back to the file system if every slot in
+ *  it is empty.  The file keeps its size and the block reads back as zeros,
+ *  so id based addressing is not affected.  Must be called with the
+ *  exclusive lock held.
+ *
+ *  returns:  1 if the block was punched, 0 if it holds a student or the
+ *            file system cannot punch holes, ERR_DB_FILE on read errors
+ */
+static int punch_if_empty(int fd, off_t start, off_t len, char *buff)
+{
+    off_t i;
+
+    if (pread(fd, buff, len, start) != len)
+        return ERR_DB_FILE;
+
+    for (i = 0; i < len; i++)
+    {
+        if (buff[i] != 0)
+            return 0;
+    }
+
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, len) == -1)
+        return 0;
+
+    return 1;
+}
+
+/*
+ *  db_punch_block
+ *      fd:    database file descriptor
+ *      slot:  slot that was just emptied
+ *
+ *  Called after a delete, punches out the file system block holding slot
+ *  once all of its slots are empty.
+ *
+ *  returns:  1 if the block was punched, 0 if not, ERR_DB_FILE on errors
+ */
+int db_punch_block(int fd, off_t slot)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+    off_t blk = block_bytes(fd);
+    off_t start;
+    struct stat st;
+    char *buff;
+    int rc;
+
+    if (ctx == NULL)
+        return ERR_DB_FILE;
+    start = slot * record_bytes(ctx);
+    start -= start % blk;
+    if (fstat(fd, &st) == -1)
+        return ERR_DB_FILE;
+    if (start + blk > st.st_size)
+        blk = st.st_size - start;
+    if (blk <= 0)
+        return 0;
+
+    buff = malloc(blk);
+    if (buff == NULL)
+        return ERR_DB_FILE;
+
+    if (db_lock(fd, true) != NO_ERROR)
+    {
+        free(buff);
+        return ERR_DB_FILE;
+    }
+    rc = punch_if_empty(fd, start, blk, buff);
+    db_unlock(fd);
+
+    free(buff);
+    return rc;
+}
+
+/*
+ *  next_extent
+ *      fd:      database file descriptor
+ *      from:    byte offset to start looking at
+ *      size:    size of the file
+ *      rec:     bytes per record
+ *      *start:  receives the first byte of the next data extent
+ *      *end:    receives the byte after the extent
+ *
+ *  Finds the next range of the file that has storage behind it using
+ *  lseek(SEEK_DATA/SEEK_HOLE), holes read back as zeros so they can never
+ *  hold a student.  On file systems without hole support the rest of the
+ *  file is returned as one extent.  The range is widened to whole records.
+ *
+ *  returns:  NO_ERROR       extent found
+ *            SRCH_NOT_FOUND no data after from
+ *            ERR_DB_FILE    lseek() failed
+ */
+static int next_extent(int fd, off_t from, off_t size, off_t rec, off_t *start,
+                       off_t *end)
+{
+    off_t data;
+    off_t hole;
+
+    if (from >= size)
+        return SRCH_NOT_FOUND;
+
+    data = lseek(fd, from, SEEK_DATA);
+    if (data == -1)
+    {
+        if (errno == ENXIO)
+            return SRCH_NOT_FOUND;
+        if (errno != EINVAL)
+            return ERR_DB_FILE;
+        data = from;
+        hole = size;
+    }
+    else
+    {
+        hole = lseek(fd, data, SEEK_HOLE);
+        if (hole == -1 || hole > size)
+            hole = size;
+    }
+
+    *start = data - (data % rec);
+    *end = hole + (rec - hole % rec) % rec;
+    if (*end > size)
+        *end = size - (size % rec);
+    return NO_ERROR;
+}
+
+/*
+ *  db_clone
+ *      src:  descriptor of the database file to copy
+ *      dst:  descriptor of an empty file, open for writing
+ *
+ *  Copies a database file for snapshots and restores.  On file systems
+ *  with reflinks (btrfs, XFS) FICLONE makes dst share the blocks of src,
+ *  nothing is copied until one of them is written.  Elsewhere the data
+ *  extents are copied one by one and the holes between them stay holes,
+ *  so a sparse direct addressed file stays sparse.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on I/O errors
+ */
+int db_clone(int src, int dst)
+{
+    struct stat st;
+    off_t pos = 0;
+    off_t start;
+    off_t end;
+    int rc;
+
+    if (ioctl(dst, FICLONE, src) == 0)
+        return NO_ERROR;
+
+    if (fstat(src, &st) == -1 || ftruncate(dst, st.st_size) == -1)
+        return ERR_DB_FILE;
+
+    while ((rc = next_extent(src, pos, st.st_size, STUDENT_RECORD_SIZE, &start, &end)) == NO_ERROR &&
+           end > pos)
+    {
+        if (copy_extent(src, dst, start, end) != NO_ERROR)
+            return ERR_DB_FILE;
+        pos = end;
+    }
+
+    return (rc == ERR_DB_FILE) ? ERR_DB_FILE : NO_ERROR;
+}
+
+// scan_range() for a compact file, every record is decoded into s
+static int scan_compact(sdb_ctx_t *ctx, int fd, off_t from, off_t to,
+                        compact_rec_t *buff, db_scan_fn fn, void *arg)
+{
+    student_t s;
+    off_t start;
+    off_t end;
+    off_t pos = from;
+    int rc;
+
+    while ((rc = next_extent(fd, pos, to, COMPACT_RECORD_SIZE, &start, &end)) == NO_ERROR)
+    {
+        for (pos = start; pos < end; )
+        {
+            off_t slot = pos / COMPACT_RECORD_SIZE;
+            size_t len = (size_t)(end - pos);
+            ssize_t n;
+            size_t i;
+
+            if (len > SCAN_CHUNK_BYTES)
+                len = SCAN_CHUNK_BYTES;
+            n = pread(fd, buff, len, pos);
+            if (n <= 0)
+                return ERR_DB_FILE;
+            len = (size_t)n - (size_t)n % COMPACT_RECORD_SIZE;
+            if (len == 0)
+                return ERR_DB_FILE;
+            SDB_COUNT(records_scanned, len / COMPACT_RECORD_SIZE);
+
+            // slot 0 is the header
+            for (i = (slot == 0) ? 1 : 0; i < len / COMPACT_RECORD_SIZE; i++)
+            {
+                if (buff[i].id == DELETED_STUDENT_ID)
+                    continue;
+                db_dict_decode(ctx, &buff[i], &s);
+                if ((rc = fn(&s, slot + i, arg)) != NO_ERROR)
+                    return rc;
+            }
+            pos += len;
+        }
+    }
+
+    return (rc == SRCH_NOT_FOUND) ? NO_ERROR : rc;
+}
+
+// scan_range() for a file of plain records
+static int scan_records(sdb_ctx_t *ctx, int fd, off_t from, off_t to,
+                        student_t *buff, db_scan_fn fn, void *arg)
+{
+    off_t start;
+    off_t end;
+    off_t pos = from;
+    int rc;
+
+    while ((rc = next_extent(fd, pos, to, STUDENT_RECORD_SIZE, &start, &end)) == NO_ERROR)
+    {
+        for (pos = start; pos < end; )
+        {
+            uint64_t live[SCAN_CHUNK_RECORDS / 64];
+            const student_t *recs;
+            off_t slot = pos / STUDENT_RECORD_SIZE;
+            size_t len = (size_t)(end - pos);
+            size_t w;
+
+            if (len > SCAN_CHUNK_BYTES)
+                len = SCAN_CHUNK_BYTES;
+            if (sdb_config.use_mmap)
+            {
+                if ((size_t)end > ctx->map_len)
+                    return ERR_DB_FILE;
+                recs = &ctx->map[slot];
+            }
+            else
+            {
+                ssize_t n = pread(fd, buff, len, pos);
+
+                if (n <= 0)
+                    return ERR_DB_FILE;
+                len = (size_t)n - (size_t)n % STUDENT_RECORD_SIZE;
+                if (len == 0)
+                    return ERR_DB_FILE;
+                recs = buff;
+            }
+
+            SDB_COUNT(records_scanned, len / STUDENT_RECORD_SIZE);
+            classify(recs, len / STUDENT_RECORD_SIZE, live);
+            for (w = 0; w < (len / STUDENT_RECORD_SIZE + 63) / 64; w++)
+            {
+                uint64_t bits = live[w];
+
+                while (bits != 0)
+                {
+                    size_t i = w * 64 + (size_t)__builtin_ctzll(bits);
+
+                    bits &= bits - 1;
+                    if (ctx->hash != NULL && !db_hash_owns(ctx, recs[i].id, slot + i))
+                        continue;
+                    if ((rc = fn(&recs[i], slot + i, arg)) != NO_ERROR)
+                        return rc;
+                }
+            }
+            pos += len;
+        }
+    }
+
+    return (rc == SRCH_NOT_FOUND) ? NO_ERROR : rc;
+}
+
+/*
+ *  scan_range
+ *      ctx, fd:   database to scan
+ *      from, to:  byte range [from, to), both on record boundaries
+ *      fn, arg:   see db_scan()
+ *
+ *  Visits the records of the range SCAN_CHUNK_BYTES at a time.  The kernel
+ *  is told the range is read front to back so it reads ahead further, and
+ *  empty slots are skipped with classify().
+ *
+ *  returns:  see db_scan()
+ */
+static int scan_range(sdb_ctx_t *ctx, int fd, off_t from, off_t to,
+                      db_scan_fn fn, void *arg)
+{
+    void *buff = NULL;
+    int rc;
+
+    if (!sdb_config.use_mmap || ctx->layout == DB_LAYOUT_COMPACT)
+    {
+        buff = malloc(SCAN_CHUNK_BYTES);
+        if (buff == NULL)
+            return ERR_DB_FILE;
+        posix_fadvise(fd, from, to - from, POSIX_FADV_SEQUENTIAL);
+    }
+
+    if (ctx->layout == DB_LAYOUT_COMPACT)
+        rc = scan_compact(ctx, fd, from, to, buff, fn, arg);
+    else
+        rc = scan_records(ctx, fd, from, to, buff, fn, arg);
+
+    free(buff);
+    return rc;
+}
+
+/*
+ *  db_scan
+ *      fd:   database file descriptor
+ *      fn:   callback for every non empty record
+ *      arg:  passed through to fn
+ *
+ *  Walks every record in slot order and hands the non empty ones to fn.
+ *  Only the data extents of the file are visited (see next_extent()), so a
+ *  sparse database with students 1 and 100000 costs two reads rather than
+ *  100000.  Extents are read SCAN_CHUNK_BYTES at a time, with the mmap
+ *  backend the callback gets a pointer straight into the mapping instead.
+ *
+ *  returns:  NO_ERROR       whole file scanned
+ *            ERR_DB_FILE    database file I/O issue
+ *            <other>        whatever fn returned to stop the scan
+ */
+int db_scan(int fd, db_scan_fn fn, void *arg)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+    struct stat st;
+
+    if (ctx == NULL || db_pool_flush(ctx) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    if (sdb_config.use_mmap && map_refresh(ctx) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    if (fstat(fd, &st) == -1)
+        return ERR_DB_FILE;
+
+    return scan_range(ctx, fd, 0, st.st_size - st.st_size % record_bytes(ctx),
+                      fn, arg);
+}
+
+typedef struct pscan {
+    sdb_ctx_t  *ctx;
+    int        fd;
+    off_t      size;                //bytes to scan, whole records
+    off_t      range_bytes;         //bytes per range, whole pages
+    int        ranges;
+    int        next;                //next range nobody has taken yet
+    int        rc;                  //first error, NO_ERROR if none
+    db_scan_fn fn;
+    char       *parts;              //one part of part_size bytes per range
+    size_t     part_size;
+} pscan_t;
+
+static void *pscan_worker(void *arg)
+{
+    pscan_t *ps = arg;
+    int r;
+
+    while ((r = __atomic_fetch_add(&ps->next, 1, __ATOMIC_RELAXED)) < ps->ranges)
+    {
+        off_t from = (off_t)r * ps->range_bytes;
+        off_t to = from + ps->range_bytes;
+        int rc;
+
+        if (to > ps->size)
+            to = ps->size;
+
+        rc = scan_range(ps->ctx, ps->fd, from, to, ps->fn,
+                        ps->parts + (size_t)r * ps->part_size);
+        if (rc != NO_ERROR)
+        {
+            int none = NO_ERROR;
+
+            __atomic_compare_exchange_n(&ps->rc, &none, rc, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            __atomic_store_n(&ps->next, ps->ranges, __ATOMIC_RELAXED);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ *  db_scan_parallel
+ *      fd:         database file descriptor
+ *      fn:         callback for every non empty record, called from the
+ *                  scan threads with the part of the range it is in
+ *      merge:      called once per range, in slot order, with its part
+ *      part_size:  bytes of state per range, zeroed before the scan
+ *      arg:        passed through to merge
+ *
+ *  Like db_scan() but the file is split into page aligned ranges that
+ *  sdb_config.scan_threads threads (one per core if 0) scan side by side
+ *  with pread(), or straight from the mapping with the mmap backend.  Each
+ *  range collects what fn finds in its own part, so fn needs no locking,
+ *  and merging the parts in range order gives the same result a
+ *  sequential scan would.  Small files are scanned as one range without
+ *  starting any thread.
+ *
+ *  merge is called for every range even after an error, so it can release
+ *  what a part holds.
+ *
+ *  returns:  NO_ERROR       whole file scanned
+ *            ERR_DB_FILE    database file I/O issue
+ *            <other>        whatever fn returned to stop the scan
+ */
+int db_scan_parallel(int fd, db_scan_fn fn, db_merge_fn merge, size_t part_size,
+                     void *arg)
+{
+    pthread_t tids[PSCAN_MAX_THREADS];
+    pscan_t ps;
+    struct stat st;
+    int threads = sdb_config.scan_threads;
+    int started = 0;
+    int r;
+
+    memset(&ps, 0, sizeof(ps));
+    ps.ctx = db_ctx(fd);
+    ps.fd = fd;
+    ps.fn = fn;
+    ps.part_size = part_size;
+
+    if (ps.ctx == NULL || db_pool_flush(ps.ctx) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    if (sdb_config.use_mmap && map_refresh(ps.ctx) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    if (fstat(fd, &st) == -1)
+        return ERR_DB_FILE;
+    ps.size = st.st_size - st.st_size % record_bytes(ps.ctx);
+
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > PSCAN_MAX_THREADS)
+        threads = PSCAN_MAX_THREADS;
+    if (threads < 1 || ps.size < PSCAN_MIN_BYTES)
+        threads = 1;
+
+    // ranges are whole pages, which are whole records too
+    ps.ranges = (threads == 1) ? 1 : threads * PSCAN_RANGES_PER_THREAD;
+    ps.range_bytes = (ps.size + ps.ranges - 1) / ps.ranges;
+    ps.range_bytes += (PSCAN_PAGE - ps.range_bytes % PSCAN_PAGE) % PSCAN_PAGE;
+    if (ps.range_bytes == 0)
+        ps.range_bytes = PSCAN_PAGE;
+
+    ps.parts = calloc(ps.ranges, part_size);
+    if (ps.parts == NULL)
+        return ERR_DB_FILE;
+
+    // the calling thread scans too, a failed pthread_create() only means
+    // fewer threads
+    for (; started < threads - 1; started++)
+    {
+        if (pthread_create(&tids[started], NULL, pscan_worker, &ps) != 0)
+            break;
+    }
+    pscan_worker(&ps);
+    for (r = 0; r < started; r++)
+        pthread_join(tids[r], NULL);
+
+    for (r = 0; r < ps.ranges; r++)
+        merge(ps.parts + (size_t)r * part_size, arg);
+
+    free(ps.parts);
+    return ps.rc;
+}
+
+/*
+ *  db_compact
+ *      fd:  database file descriptor
+ *
+ *  Punches out every file system block in the data extents of the file
+ *  that only holds empty slots.  Unlike compress_db() no record moves, so
+ *  this is safe to run next to other users of the database: each block is
+ *  checked and punched under the exclusive lock.
+ *
+ *  returns:  number of blocks punched, or ERR_DB_FILE on errors
+ */
+int db_compact(int fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+    off_t blk = block_bytes(fd);
+    struct stat st;
+    off_t start;
+    off_t end;
+    off_t pos = 0;
+    char *buff;
+    int punched = 0;
+    int rc;
+
+    if (ctx == NULL || fstat(fd, &st) == -1 || (buff = malloc(blk)) == NULL)
+        return ERR_DB_FILE;
+
+    while ((rc = next_extent(fd, pos, st.st_size, record_bytes(ctx), &start, &end)) == NO_ERROR)
+    {
+        for (pos = start - start % blk; pos < end; pos += blk)
+        {
+            off_t len = (pos + blk > st.st_size) ? st.st_size - pos : blk;
+
+            if (db_lock(fd, true) != NO_ERROR)
+            {
+                free(buff);
+                return ERR_DB_FILE;
+            }
+            rc = punch_if_empty(fd, pos, len, buff);
+            db_unlock(fd);
+
+            if (rc < 0)
+            {
+                free(buff);
+                return rc;
+            }
+            punched += rc;
+        }
+    }
+
+    free(buff);
+    return (rc == SRCH_NOT_FOUND) ? punched : rc;
+}
+
+/*
+ *  db_compact_needed
+ *      fd:  database file descriptor
+ *
+ *  returns:  true once enough deleted slots hold storage, see
+ *            SDB_DEAD_RATIO_PCT and SDB_DEAD_MIN_SLOTS
+ */
+bool db_compact_needed(int fd)
+{
+    int dead = db_bitmap_dead(fd);
+    int live = db_bitmap_count(fd);
+
+    if (!sdb_config.auto_compact || live < 0 || dead < SDB_DEAD_MIN_SLOTS)
+        return false;
+
+    return (long)dead * 100 >= (long)(live + dead) * SDB_DEAD_RATIO_PCT;
+}
+
+/*
+ *  db_compact_background
+ *      fd:  database file descriptor
+ *
+ *  Runs db_compact() in a detached grandchild so the command that noticed
+ *  the dead space does not wait for it.  The grandchild opens the database
+ *  again, its own open file description is what makes the flock() based
+ *  locking keep it apart from this process.
+ */
+void db_compact_background(int fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+    char path[PATH_MAX];
+    pid_t pid;
+
+    if (ctx == NULL)
+        return;
+    strcpy(path, ctx->path);
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0)
+    {
+        if (fork() == 0)
+        {
+            int cfd;
+
+            close(fd);
+            cfd = open(path, O_RDWR);
+            if (cfd != -1 && db_register(cfd, path) != NULL)
+            {
+                db_change_begin(cfd);
+                if (db_compact(cfd) >= 0)
+                    db_bitmap_clear_dead(cfd);
+                db_change_commit(cfd);
+            }
+            _exit(0);
+        }
+        _exit(0);
+    }
+
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+}
+
+/*
+ *  db_find
+ *      fd:     database file descriptor
+ *      id:     student id to look up
+ *      *slot:  receives the slot of the student, may be NULL
+ *      *s:     receives the student record, may be NULL
+ *
+ *  Reads the record for id with a single pread().  In the direct and
+ *  compact layouts the slot is the id itself, in the packed layout it
+ *  comes from the index.  If the record found does not carry the id we
+ *  asked for, the index is missing or stale, so it is rebuilt from a scan
+ *  and the lookup retried once.
+ *
+ *  returns:  NO_ERROR       student found
+ *            SRCH_NOT_FOUND student not in the database
+ *            ERR_DB_FILE    database file I/O issue
+ */
+int db_find(int fd, int id, off_t *slot, student_t *s)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+    student_t temp;
+    off_t where;
+    int attempt;
+    int rc;
+
+    if (ctx == NULL)
+        return ERR_DB_FILE;
+
+    if (ctx->layout == DB_LAYOUT_HASH)
+        return db_hash_find(ctx, fd, id, slot, s);
+
+    if ((id < MIN_STD_ID) || (id > MAX_STD_ID))
+        return SRCH_NOT_FOUND;
+
+    for (attempt = 0; attempt < 2; attempt++)
+    {
+        if (ctx->layout == DB_LAYOUT_PACKED)
+        {
+            if (ctx->idx[id] == 0)
+                return SRCH_NOT_FOUND;
+            where = ctx->idx[id] - 1;
+        }
+        else
+        {
+            where = id;
+        }
+
+        rc = db_read_slot(fd, where, &temp);
+        if (rc == ERR_DB_FILE)
+            return rc;
+
+        if (rc == NO_ERROR && temp.id == id)
+        {
+            if (slot != NULL)
+                *slot = where;
+            if (s != NULL)
+                memcpy(s, &temp, STUDENT_RECORD_SIZE);
+            return NO_ERROR;
+        }
+
+        // an empty direct slot is a plain miss, anything else means the
+        // index does not describe this file
+        if (ctx->layout != DB_LAYOUT_PACKED &&
+            (rc != NO_ERROR || temp.id == DELETED_STUDENT_ID))
+            return SRCH_NOT_FOUND;
+
+        if (index_rebuild(ctx) != NO_ERROR)
+            return ERR_DB_FILE;
+    }
+
+    return SRCH_NOT_FOUND;
+}
+
+/*
+ *  db_alloc_slot
+ *      fd:     database file descriptor
+ *      id:     id of the first student about to be added
+ *      n:      number of slots needed, for records with consecutive ids in
+ *              a direct addressed file or any records in a packed one
+ *      *slot:  receives the first slot to write the students to
+ *
+ *  Direct addressed and compact files store the student at slot id.  Packed
+ *  files append new students after the last record, the slots are reserved
+ *  by growing the file under the meta lock so concurrent adds never get the
+ *  same ones.
+ *  Hashed files place every student in its bucket, n must be 1 there.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on I/O errors
+ */
+int db_alloc_slot(int fd, int id, int n, off_t *slot)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+    struct stat st;
+    int rc = NO_ERROR;
+
+    if (ctx == NULL)
+        return ERR_DB_FILE;
+
+    if (ctx->layout == DB_LAYOUT_DIRECT || ctx->layout == DB_LAYOUT_COMPACT)
+    {
+        *slot = id;
+        return NO_ERROR;
+    }
+
+    if (ctx->layout == DB_LAYOUT_HASH)
+        return (n == 1) ? db_hash_alloc(ctx, fd, id, slot) : ERR_DB_FILE;
+
+    if (db_lock_records(fd, SDB_LOCK_META, 1, true) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    if (fstat(fd, &st) == -1)
+        rc = ERR_DB_FILE;
+    else
+    {
+        *slot = (st.st_size + STUDENT_RECORD_SIZE - 1) / STUDENT_RECORD_SIZE;
+        if (ftruncate(fd, (*slot + n) * STUDENT_RECORD_SIZE) == -1)
+            rc = ERR_DB_FILE;
+    }
+
+    db_unlock_records(fd, SDB_LOCK_META, 1);
+    return rc;
+}
+
+/*
+ *  db_index_set
+ *      fd:    database file descriptor
+ *      id:    student id
+ *      slot:  slot the student now lives in, -1 if it was removed
+ *
+ *  Keeps the index of a packed file in step with adds and deletes, it is a
+ *  no-op for the other layouts.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE if the index is unavailable
+ */
+int db_index_set(int fd, int id, off_t slot)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx == NULL)
+        return ERR_DB_FILE;
+
+    if (ctx->layout != DB_LAYOUT_PACKED)
+        return NO_ERROR;
+
+    if (ctx->idx == NULL && index_map(ctx, true) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    ctx->idx[id] = (uint32_t)(slot + 1);
+    return NO_ERROR;
+}
+
+/*
+ *  db_index_build
+ *      fd:        file descriptor of a packed database file
+ *      idx_path:  path of the index file to (re)create
+ *
+ *  Scans the database and writes a fresh index for it.  The index is built
+ *  in memory and written with one pwrite(), compress_db() uses this to write
+ *  the index of the temporary file before renaming both into place.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on I/O errors
+ */
+int db_index_build(int fd, const char *idx_path)
+{
+    student_t buff[IDX_SCAN_RECORDS];
+    struct stat st;
+    uint32_t *idx;
+    off_t slot = 0;
+    ssize_t n;
+    int rc = NO_ERROR;
+    int ifd;
+    int i;
+
+    idx = calloc(MAX_STD_ID + 1, sizeof(uint32_t));
+    if (idx == NULL)
+        return ERR_DB_FILE;
+
+    if (fstat(fd, &st) == -1)
+    {
+        free(idx);
+        return ERR_DB_FILE;
+    }
+    idx[0] = (uint32_t)st.st_ino;
+
+    while ((n = pread(fd, buff, sizeof(buff), slot * STUDENT_RECORD_SIZE)) > 0)
+    {
+        for (i = 0; i < n / STUDENT_RECORD_SIZE; i++, slot++)
+        {
+            if ((buff[i].id >= MIN_STD_ID) && (buff[i].id <= MAX_STD_ID))
+                idx[buff[i].id] = (uint32_t)(slot + 1);
+        }
+        if (n % STUDENT_RECORD_SIZE != 0)
+            break;
+    }
+    if (n < 0)
+        rc = ERR_DB_FILE;
+
+    ifd = open(idx_path, O_RDWR | O_CREAT | O_TRUNC,
+               S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (ifd == -1)
+        rc = ERR_DB_FILE;
+    else
+    {
+        if (rc == NO_ERROR && pwrite(ifd, idx, IDX_FILE_SIZE, 0) != IDX_FILE_SIZE)
+            rc = ERR_DB_FILE;
+        close(ifd);
+    }
+
+    free(idx);
+    return rc;
+}
+
+/*
+ *  db_stamp / db_stamp_matches
+ *      fd:      database file descriptor
+ *      *stamp:  stamp to fill in or compare against
+ *
+ *  The stamp is the inode, size and mtime of the file.  Every change made
+ *  through sdbsc moves the mtime, so a sidecar whose stamp still matches
+ *  has seen every change to the records.
+ *
+ *  returns:  db_stamp: NO_ERROR on success, ERR_DB_FILE if fstat() fails
+ *            db_stamp_matches: true if the file still carries the stamp
+ */
+int db_stamp(int fd, sdb_stamp_t *stamp)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == -1)
+        return ERR_DB_FILE;
+
+    stamp->ino = st.st_ino;
+    stamp->size = st.st_size;
+    stamp->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    return NO_ERROR;
+}
+
+bool db_stamp_matches(int fd, const sdb_stamp_t *stamp)
+{
+    sdb_stamp_t now;
+
+    if (db_stamp(fd, &now) != NO_ERROR)
+        return false;
+
+    return now.ino == stamp->ino && now.size == stamp->size &&
+           now.mtime == stamp->mtime;
+}
+
+/*
+ *  db_change_begin / db_change_record / db_change_commit
+ *      fd:   database file descriptor
+ *      old:  the student before the change, NULL for an add
+ *      now:  the student after the change, NULL for a delete
+ *
+ *  Bracket a change to the records for every sidecar that describes them:
+ *  the occupancy bitmap, the name index, the GPA index and the columns.
+ *  Each one counts the change as in flight before the database is written
+ *  and takes it off the count after, the last change to finish stamps it.
+ *  The change itself is recorded in between with their own set functions.
+ *  db_change_record() records a single student change and commits it.
+ *
+ *  Other writers share the sidecars, so all of this runs under the meta
+ *  lock.  Callers setting sidecars directly take it themselves.
+ */
+void db_change_begin(int fd)
+{
+    db_lock_records(fd, SDB_LOCK_META, 1, true);
+    db_bitmap_begin(fd);
+    db_names_begin(fd);
+    db_gpa_begin(fd);
+    db_col_begin(fd);
+    db_unlock_records(fd, SDB_LOCK_META, 1);
+}
+
+void db_change_record(int fd, const student_t *old, const student_t *now)
+{
+    const student_t *s = (now != NULL) ? now : old;
+
+    db_lock_records(fd, SDB_LOCK_META, 1, true);
+    if (old != NULL)
+        db_names_remove(fd, old);
+    if (now != NULL)
+        db_names_insert(fd, now);
+    db_bitmap_set(fd, s->id, now != NULL);
+    db_gpa_set(fd, s->id, s->gpa, now != NULL);
+    db_col_set(fd, s->id, s->gpa, now != NULL);
+    db_unlock_records(fd, SDB_LOCK_META, 1);
+
+    db_change_commit(fd);
+}
+
+void db_change_commit(int fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx != NULL)
+        db_pool_flush(ctx);
+
+    db_lock_records(fd, SDB_LOCK_META, 1, true);
+    db_bitmap_commit(fd);
+    if (ctx != NULL)
+        db_pool_committed(ctx);
+    db_names_commit(fd);
+    db_gpa_commit(fd);
+    db_col_commit(fd);
+    db_unlock_records(fd, SDB_LOCK_META, 1);
+}
@@ -0,0 +1,345 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  The write-ahead log (.student.db.wal) makes adds, deletes and updates
+ *  durable without an fsync of the database for every change.  Every change
+ *  appends a record holding the full image of the slot it writes, then the
+ *  database itself is written without syncing.  Records are made durable in
+ *  groups with fdatasync() of the log, see wal_commit().
+ *
+ *  As long as the machine stays up every write that returned is in the page
+ *  cache, so the log only matters after a crash of the whole system.  The
+ *  log header records the boot it was written in; opening a database whose
+ *  log comes from an earlier boot replays it.  Replay writes the images
+ *  back in log order, which is idempotent, fsyncs the database and empties
+ *  the log.  A checkpoint does the same without the replay: once the log
+ *  grows past WAL_CHECKPOINT_BYTES the database is fsynced and the log
+ *  emptied.
+ *
+ *  Appends hold a shared flock() on the log, checkpoints an exclusive one,
+ *  so several processes can log into the same file.
+ */
+
+#define BOOT_ID_FILE    "/proc/sys/kernel/random/boot_id"
+
+static uint32_t crc32_bytes(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint32_t crc = 0xFFFFFFFFu;
+    size_t i;
+    int k;
+
+    for (i = 0; i < len; i++)
+    {
+        crc ^= p[i];
+        for (k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+    }
+
+    return ~crc;
+}
+
+static uint32_t record_crc(const wal_record_t *rec)
+{
+    wal_record_t tmp = *rec;
+
+    tmp.crc = 0;
+    return crc32_bytes(&tmp, sizeof(tmp));
+}
+
+static void boot_id(char *out)
+{
+    FILE *f = fopen(BOOT_ID_FILE, "r");
+
+    memset(out, 0, WAL_BOOT_ID_LEN);
+    if (f == NULL)
+        return;
+    if (fgets(out, WAL_BOOT_ID_LEN, f) != NULL)
+        out[strcspn(out, "\n")] = '\0';
+    fclose(f);
+}
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ *  wal_reset
+ *      ctx:  database context with an open log
+ *
+ *  Empties the log and writes a fresh header for the current boot and the
+ *  current database file.  The caller holds the exclusive log lock and has
+ *  made sure the database is on disk.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int wal_reset(sdb_ctx_t *ctx)
+{
+    wal_header_t hdr = {0};
+    struct stat st;
+
+    if (fstat(ctx->fd, &st) == -1)
+        return ERR_DB_FILE;
+
+    hdr.magic = WAL_MAGIC;
+    hdr.version = WAL_VERSION;
+    hdr.db_ino = st.st_ino;
+    boot_id(hdr.boot_id);
+
+    if (ftruncate(ctx->wal_fd, 0) == -1 ||
+        pwrite(ctx->wal_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        db_fsync(ctx->wal_fd, true) == -1)
+        return ERR_DB_FILE;
+
+    ctx->wal_pending = 0;
+    return NO_ERROR;
+}
+
+/*
+ *  wal_replay
+ *      ctx:  database context with an open log
+ *
+ *  Writes every intact record of the log back into the database.  Reading
+ *  stops at the first record with a bad magic or checksum, that is the
+ *  torn tail of an append that never completed.
+ *
+ *  returns:  number of records replayed, ERR_DB_FILE on I/O errors
+ */
+static int wal_replay(sdb_ctx_t *ctx)
+{
+    wal_record_t rec;
+    off_t off = sizeof(wal_header_t);
+    int replayed = 0;
+
+    while (pread(ctx->wal_fd, &rec, sizeof(rec), off) == sizeof(rec))
+    {
+        if (rec.magic != WAL_REC_MAGIC || rec.crc != record_crc(&rec))
+            break;
+
+        if (db_write_slot(ctx->fd, rec.slot, &rec.image) != NO_ERROR ||
+            db_index_set(ctx->fd, rec.id, (rec.op == WAL_OP_DEL) ? -1 : rec.slot) != NO_ERROR)
+            return ERR_DB_FILE;
+
+        off += sizeof(rec);
+        replayed++;
+    }
+
+    if (replayed > 0 && db_sync(ctx->fd, true) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    return replayed;
+}
+
+/*
+ *  wal_open
+ *      ctx:  database context, layout already worked out
+ *
+ *  Opens the log of the database and replays it if it was left behind by
+ *  an earlier boot.  A log that belongs to another database file (the
+ *  database was removed and created again) is thrown away.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE if the log cannot be used
+ */
+int wal_open(sdb_ctx_t *ctx)
+{
+    char wal_path[PATH_MAX];
+    char boot[WAL_BOOT_ID_LEN];
+    wal_header_t hdr;
+    struct stat st;
+    int rc = NO_ERROR;
+
+    ctx->wal_fd = -1;
+    if (!sdb_config.use_wal)
+        return NO_ERROR;
+
+    if (db_sidecar_path(ctx->path, WAL_SIDECAR, wal_path) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    ctx->wal_fd = open(wal_path, O_RDWR | O_CREAT | O_APPEND,
+                       S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (ctx->wal_fd == -1)
+        return ERR_DB_FILE;
+
+    if (flock(ctx->wal_fd, LOCK_EX) == -1 || fstat(ctx->fd, &st) == -1)
+    {
+        close(ctx->wal_fd);
+        ctx->wal_fd = -1;
+        return ERR_DB_FILE;
+    }
+
+    boot_id(boot);
+    if (pread(ctx->wal_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        hdr.magic != WAL_MAGIC || hdr.version != WAL_VERSION ||
+        hdr.db_ino != (uint64_t)st.st_ino)
+    {
+        rc = wal_reset(ctx);
+    }
+    else if (strncmp(hdr.boot_id, boot, WAL_BOOT_ID_LEN) != 0 || boot[0] == '\0')
+    {
+        if (wal_replay(ctx) < 0)
+            rc = ERR_DB_FILE;
+        else
+            rc = wal_reset(ctx);
+    }
+
+    flock(ctx->wal_fd, LOCK_UN);
+    if (rc != NO_ERROR)
+    {
+        close(ctx->wal_fd);
+        ctx->wal_fd = -1;
+    }
+
+    return rc;
+}
+
+/*
+ *  wal_append
+ *      fd:     database file descriptor
+ *      op:     WAL_OP_ADD, WAL_OP_DEL or WAL_OP_UPDATE
+ *      id:     student id the change is for
+ *      slot:   slot the change writes
+ *      image:  record written to the slot
+ *
+ *  Logs a change before it is written to the database.  The record is one
+ *  write() on an O_APPEND descriptor, so appends from several processes do
+ *  not interleave.  Nothing is synced here, see wal_commit().
+ *
+ *  returns:  NO_ERROR on success (or without a log), ERR_DB_FILE on failure
+ */
+int wal_append(int fd, int op, int id, off_t slot, const student_t *image)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+    wal_record_t rec = {0};
+    ssize_t n;
+
+    if (ctx == NULL || ctx->wal_fd == -1)
+        return NO_ERROR;
+
+    rec.magic = WAL_REC_MAGIC;
+    rec.op = op;
+    rec.id = id;
+    rec.slot = slot;
+    memcpy(&rec.image, image, STUDENT_RECORD_SIZE);
+    rec.crc = record_crc(&rec);
+
+    if (flock(ctx->wal_fd, LOCK_SH) == -1)
+        return ERR_DB_FILE;
+    n = write(ctx->wal_fd, &rec, sizeof(rec));
+    flock(ctx->wal_fd, LOCK_UN);
+
+    if (n != sizeof(rec))
+        return ERR_DB_FILE;
+
+    if (ctx->wal_pending++ == 0)
+        ctx->wal_first_ms = now_ms();
+
+    return NO_ERROR;
+}
+
+/*
+ *  wal_commit
+ *      fd:     database file descriptor
+ *      force:  commit whatever is pending regardless of the group settings
+ *
+ *  Group commit.  Pending records are made durable with one fdatasync() of
+ *  the log once sdb_config.commit_every of them are waiting, or the oldest
+ *  has waited sdb_config.commit_ms milliseconds.  Without a log a forced
+ *  commit falls back to syncing the database itself.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+int wal_commit(int fd, bool force)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+
+    if (ctx == NULL || ctx->wal_fd == -1)
+        return force ? db_sync(fd, true) : NO_ERROR;
+
+    if (ctx->wal_pending == 0)
+        return NO_ERROR;
+
+    if (!force && ctx->wal_pending < sdb_config.commit_every &&
+        (sdb_config.commit_ms <= 0 ||
+         now_ms() - ctx->wal_first_ms < sdb_config.commit_ms))
+        return NO_ERROR;
+
+    if (db_fsync(ctx->wal_fd, true) == -1)
+        return ERR_DB_FILE;
+
+    ctx->wal_pending = 0;
+    return NO_ERROR;
+}
+
+/*
+ *  wal_checkpoint
+ *      fd:  database file descriptor
+ *
+ *  Folds the log into the database: the database is fsynced, after which
+ *  nothing in the log is needed any more and it is emptied.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+int wal_checkpoint(int fd)
+{
+    sdb_ctx_t *ctx = db_ctx(fd);
+    struct stat st;
+    int rc;
+
+    if (ctx == NULL || ctx->wal_fd == -1)
+        return NO_ERROR;
+
+    if (flock(ctx->wal_fd, LOCK_EX) == -1)
+        return ERR_DB_FILE;
+
+    // nothing logged since the last checkpoint
+    if (fstat(ctx->wal_fd, &st) == 0 && st.st_size <= (off_t)sizeof(wal_header_t))
+    {
+        flock(ctx->wal_fd, LOCK_UN);
+        return NO_ERROR;
+    }
+
+    rc = db_sync(fd, true);
+    if (rc == NO_ERROR)
+        rc = wal_reset(ctx);
+
+    flock(ctx->wal_fd, LOCK_UN);
+    return rc;
+}
+
+/*
+ *  wal_close
+ *      ctx:  database context
+ *
+ *  Commits whatever is still pending and checkpoints the log once it has
+ *  grown past WAL_CHECKPOINT_BYTES.
+ */
+void wal_close(sdb_ctx_t *ctx)
+{
+    struct stat st;
+
+    if (ctx->wal_fd == -1)
+        return;
+
+    wal_commit(ctx->fd, true);
+    if (fstat(ctx->wal_fd, &st) == 0 && st.st_size > WAL_CHECKPOINT_BYTES)
+        wal_checkpoint(ctx->fd);
+
+    close(ctx->wal_fd);
+    ctx->wal_fd = -1;
+}
@@ -32,10 +32,44 @@ int open_db(char *dbFile, bool should_truncate)
     int flags = O_RDWR | O_CREAT;
 
     if (should_truncate)
-        flags += O_TRUNC;
+    {
+        // an empty file is direct addressed again, drop the packed index
+        // and anything else describing the old records.  The empty file
+        // replaces the old one rather than truncating it under other users.
+        // --shards=N starts over with a new set of shards, a hashed or
+        // compact database stays that way unless --layout says otherwise
+        bool hashed = (sdb_config.layout == DB_LAYOUT_HASH) ||
+                      (sdb_config.layout == -1 && sdb_config.shards == 0 &&
+                       db_hash_exists(dbFile));
+        bool compact = (sdb_config.layout == DB_LAYOUT_COMPACT) ||
+                       (sdb_config.layout == -1 && sdb_config.shards == 0 &&
+                        db_dict_exists(dbFile));
+        bool single = hashed || compact;
+
+        if ((single && sdb_config.shards > 1) ||
+            ((sdb_config.shards > 0 || single) &&
+             db_shards_create(dbFile, single ? 1 : sdb_config.shards) != NO_ERROR) ||
+            db_replace_empty(dbFile) != NO_ERROR ||
+            (hashed && db_hash_create(dbFile) != NO_ERROR) ||
+            (compact && !hashed && db_dict_create(dbFile) != NO_ERROR))
+        {
+            printf(M_ERR_DB_OPEN);
+            return ERR_DB_FILE;
+        }
+    }
+
+    // a sharded database opens all of its shards, the descriptor returned
+    // stands for all of them
+    int fd = db_shards_open(dbFile, should_truncate);
+    if (fd != SRCH_NOT_FOUND)
+    {
+        if (fd < 0)
+            printf(M_ERR_DB_OPEN);
+        return fd;
+    }
 
     // Now open file
-    int fd = open(dbFile, flags, mode);
+    fd = open(dbFile, flags, mode);
 
     if (fd == -1)
     {
@@ -44,9 +78,69 @@ int open_db(char *dbFile, bool should_truncate)
         return ERR_DB_FILE;
     }
 
+    // remember the path and work out the record layout of the file
+    if (db_register(fd, dbFile) == NULL)
+    {
+        close(fd);
+        printf(M_ERR_DB_OPEN);
+        return ERR_DB_FILE;
+    }
+
     return fd;
 }
 
+/*
+ *  close_db
+ *      fd:  linux file descriptor returned from open_db()
+ *
+ *  Releases the storage engine state kept for the database and closes it,
+ *  every shard of it if it is sharded.
+ *
+ *  returns:  nothing, this is a void function
+ *
+ *  console:  Does not produce any console I/O
+ */
+void close_db(int fd)
+{
+    if (!db_shards_close(fd))
+        db_unregister(fd);
+    close(fd);
+}
+
+/*
+ *  lock_student / unlock_student
+ *      fd:         linux file descriptor
+ *      id:         student id
+ *      exclusive:  true to change the student, false to read it
+ *
+ *  Takes the whole file lock shared and the record lock of one student, see
+ *  db_lock() and db_lock_records().  Ids out of range are never in the
+ *  database, they only take the file lock.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int lock_student(int fd, int id, bool exclusive)
+{
+    if (db_lock(fd, exclusive && db_hashed(fd)) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    if ((id >= MIN_STD_ID) && (id <= HASH_MAX_STD_ID) &&
+        db_lock_records(fd, id, 1, exclusive) != NO_ERROR)
+    {
+        db_unlock(fd);
+        return ERR_DB_FILE;
+    }
+
+    return NO_ERROR;
+}
+
+static void unlock_student(int fd, int id)
+{
+    if ((id >= MIN_STD_ID) && (id <= HASH_MAX_STD_ID))
+        db_unlock_records(fd, id, 1);
+    db_unlock(fd);
+}
+
 /*
  *  get_student
  *      fd:  linux file descriptor
@@ -54,6 +148,14 @@ int open_db(char *dbFile, bool should_truncate)
  *      *s:  a pointer where the located (if found) student data will be
  *           copied
  *
+ *  Records are read directly by id rather than by scanning the file.  In a
+ *  direct addressed file the student lives at id * STUDENT_RECORD_SIZE, after
+ *  compress_db() has packed the file the slot comes from the id->offset
+ *  index sidecar.  Either way the lookup is a single pread(), see db_find().
+ *  The record is read under a shared record lock, so it is never seen
+ *  halfway through a write.  In a sharded database the shard for the id
+ *  is read, see db_shard().
+ *
  *  returns:  NO_ERROR       student located and copied into *s
  *            ERR_DB_FILE    database file I/O issue
  *            SRCH_NOT_FOUND student was not located in the database
@@ -62,38 +164,81 @@ int open_db(char *dbFile, bool should_truncate)
  */
 int get_student(int fd, int id, student_t *s)
 {
-    student_t temp;
-    off_t current_pos;
+    int base;
+    int rc;
+
+    fd = db_shard(fd, id, &base);
+    if (lock_student(fd, id - base, false) != NO_ERROR)
+        return ERR_DB_FILE;
+    rc = db_find(fd, id - base, NULL, s);
+    unlock_student(fd, id - base);
+
+    if (rc == NO_ERROR && s != NULL)
+        s->id = id;
+    return rc;
+}
     
-    // Move to beginning of file
-    if (lseek(fd, 0, SEEK_SET) == -1)
+
+// add_student() once the student is locked, sid is the id in the shard
+static int add_locked(int fd, int id, int sid, char *fname, char *lname, int gpa)
+{
+    //TO DO
+    student_t student;
+    off_t slot;
+    bool present;
+    int rc;
+
+    // Check if the student already exists, the occupancy bitmap answers
+    // this without reading the database when it is available
+    if (db_bitmap_test(fd, sid, &present))
+        rc = present ? NO_ERROR : SRCH_NOT_FOUND;
+    else
+        rc = db_find(fd, sid, NULL, &student);
+
+    switch (rc)
     {
-        return ERR_DB_FILE;
+    case NO_ERROR:
+        printf(M_ERR_DB_ADD_DUP, id);
+        return ERR_DB_OP;  // Student already exists
+    case SRCH_NOT_FOUND:
+        break;
+    default:
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;  // File I/O issue
     }
-    
-    // Read through records until we find the matching ID
-    while ((current_pos = lseek(fd, 0, SEEK_CUR)) != -1)
+
+    // Initialize new student record
+    memset(&student, 0, STUDENT_RECORD_SIZE);
+    student.id = sid;
+    strncpy(student.fname, fname, sizeof(student.fname) - 1);
+    strncpy(student.lname, lname, sizeof(student.lname) - 1);
+    student.gpa = gpa;
+
+    // Pick the slot for the student, id * STUDENT_RECORD_SIZE unless the
+    // file has been packed by compress_db()
+    db_change_begin(fd);
+    if (db_alloc_slot(fd, sid, 1, &slot) != NO_ERROR)
     {
-        ssize_t bytes_read = read(fd, &temp, STUDENT_RECORD_SIZE);
-        if (bytes_read == 0)  // EOF
-        {
-            return SRCH_NOT_FOUND;
-        }
-        if (bytes_read != STUDENT_RECORD_SIZE)
-        {
-            return ERR_DB_FILE;
-        }
-        
-        if (temp.id == id)
-        {
-            memcpy(s, &temp, STUDENT_RECORD_SIZE);
-            return NO_ERROR;
-        }
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;  // File I/O issue
     }
-    
-    return SRCH_NOT_FOUND;
+
+    // Log the change, then write student record to file
+    if (wal_append(fd, WAL_OP_ADD, sid, slot, &student) != NO_ERROR ||
+        db_write_slot(fd, slot, &student) != NO_ERROR ||
+        db_index_set(fd, sid, slot) != NO_ERROR ||
+        wal_commit(fd, false) != NO_ERROR)
+    {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;  // File I/O issue
+    }
+    db_change_record(fd, NULL, &student);
+
+    // Print success message
+    printf(M_STD_ADDED, id);
+    return NO_ERROR;
 }
-    
+
 
 /*
  *  add_student
@@ -122,40 +267,67 @@ int get_student(int fd, int id, student_t *s)
  */
 int add_student(int fd, int id, char *fname, char *lname, int gpa)
 {
-    //TO DO
-    student_t student;
+    int base;
+    int rc;
+
+    // In a sharded database the student goes to the shard for its id
+    fd = db_shard(fd, id, &base);
 
-    // Check if the student already exists
-    if (get_student(fd, id, &student) == NO_ERROR)
+    // Two adds of the same id would both pass the duplicate check, the
+    // record lock makes the check and the write a single step
+    if (lock_student(fd, id - base, true) != NO_ERROR)
     {
-        printf(M_ERR_DB_ADD_DUP, id);
-        return ERR_DB_OP;  // Student already exists
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;  // File I/O issue
     }
+    rc = add_locked(fd, id, id - base, fname, lname, gpa);
+    unlock_student(fd, id - base);
 
-    // Initialize new student record
-    memset(&student, 0, STUDENT_RECORD_SIZE);
-    student.id = id;
-    strncpy(student.fname, fname, sizeof(student.fname) - 1);
-    strncpy(student.lname, lname, sizeof(student.lname) - 1);
-    student.gpa = gpa;
+    return rc;
+}
+
+
+// del_student() once the student is locked, sid is the id in the shard and
+// *slot receives the slot freed
+static int del_locked(int fd, int id, int sid, off_t *slot)
+{
+    student_t student;
 
-    // Compute offset for student location
-    int offset = id * STUDENT_RECORD_SIZE;
-    if (lseek(fd, offset, SEEK_SET) == -1)
+    // Check if student exists, this also tells us which slot it is in
+    // and the name to take out of the name index
+    switch (db_find(fd, sid, slot, &student))
     {
+    case NO_ERROR:
+        break;
+    case SRCH_NOT_FOUND:
+        printf(M_STD_NOT_FND_MSG, id);
+        return ERR_DB_OP;  // Student not found
+    default:
         printf(M_ERR_DB_READ);
         return ERR_DB_FILE;  // File I/O issue
     }
 
-    // Write student record to file
-    if (write(fd, &student, STUDENT_RECORD_SIZE) != STUDENT_RECORD_SIZE)
+    // Log the change, then overwrite student record with
+    // EMPTY_STUDENT_RECORD
+    db_change_begin(fd);
+    if (wal_append(fd, WAL_OP_DEL, sid, *slot, &EMPTY_STUDENT_RECORD) != NO_ERROR ||
+        db_write_slot(fd, *slot, &EMPTY_STUDENT_RECORD) != NO_ERROR ||
+        db_index_set(fd, sid, -1) != NO_ERROR)
     {
         printf(M_ERR_DB_WRITE);
         return ERR_DB_FILE;  // File I/O issue
     }
 
-    // Print success message
-    printf(M_STD_ADDED, id);
+    // Ensure data is actually written to disk.  With the write-ahead log
+    // that is a (group) commit of the log, without it sync the database
+    // like deletes always have
+    if (wal_commit(fd, !sdb_config.use_wal) != NO_ERROR)
+    {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;  // File I/O issue
+    }
+
+    db_change_record(fd, &student, NULL);
     return NO_ERROR;
 }
 
@@ -184,41 +356,123 @@ int add_student(int fd, int id, char *fname, char *lname, int gpa)
  */
 int del_student(int fd, int id)
 {
-    student_t student;
+    off_t slot;
+    int base;
+    int rc;
 
-    // Check if student exists
-    if (get_student(fd, id, &student) != NO_ERROR)
+    fd = db_shard(fd, id, &base);
+    if (lock_student(fd, id - base, true) != NO_ERROR)
     {
-        printf(M_STD_NOT_FND_MSG, id);
-        return ERR_DB_OP;  // Student not found
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;  // File I/O issue
     }
+    rc = del_locked(fd, id, id - base, &slot);
+    unlock_student(fd, id - base);
+
+    if (rc != NO_ERROR)
+        return rc;
+
+    // Give the storage back once the whole block around the slot is
+    // empty, otherwise the slot counts as dead space.  Punching takes the
+    // file lock exclusively, so it waits until the record locks are gone
+    db_change_begin(fd);
+    if (db_punch_block(fd, slot) == 0)
+        db_bitmap_add_dead(fd, 1);
+    db_change_commit(fd);
+
+    // Print success message
+    printf(M_STD_DEL_MSG, id);
+
+    // Too much dead space, punch it out without making the caller wait
+    if (db_compact_needed(fd))
+        db_compact_background(fd);
+    
+    return NO_ERROR;
+}
 
-    // Compute offset for student location
-    int offset = id * STUDENT_RECORD_SIZE;
-    if (lseek(fd, offset, SEEK_SET) == -1)
+
+// update_student() once the student is locked, sid is the id in the shard
+static int update_locked(int fd, int id, int sid, char *fname, char *lname, int gpa)
+{
+    student_t student;
+    student_t old;
+    off_t slot;
+
+    // Find the slot the student lives in
+    switch (db_find(fd, sid, &slot, &old))
     {
+    case NO_ERROR:
+        break;
+    case SRCH_NOT_FOUND:
+        printf(M_STD_NOT_FND_MSG, id);
+        return ERR_DB_OP;  // Student not found
+    default:
         printf(M_ERR_DB_READ);
         return ERR_DB_FILE;  // File I/O issue
     }
 
-    // Overwrite student record with EMPTY_STUDENT_RECORD
-    ssize_t bytes_written = write(fd, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE);
-    if (bytes_written != STUDENT_RECORD_SIZE)
+    memset(&student, 0, STUDENT_RECORD_SIZE);
+    student.id = sid;
+    strncpy(student.fname, fname, sizeof(student.fname) - 1);
+    strncpy(student.lname, lname, sizeof(student.lname) - 1);
+    student.gpa = gpa;
+
+    // Log the change, then write the new record over the old one
+    db_change_begin(fd);
+    if (wal_append(fd, WAL_OP_UPDATE, sid, slot, &student) != NO_ERROR ||
+        db_write_slot(fd, slot, &student) != NO_ERROR ||
+        wal_commit(fd, false) != NO_ERROR)
     {
         printf(M_ERR_DB_WRITE);
         return ERR_DB_FILE;  // File I/O issue
     }
+    db_change_record(fd, &old, &student);
 
-    // Ensure data is actually written to disk
-    fsync(fd);
-
-    // Print success message
-    printf(M_STD_DEL_MSG, id);
-    
+    printf(M_STD_UPDATED, id);
     return NO_ERROR;
 }
 
 
+/*
+ *  update_student
+ *      fd:     linux file descriptor
+ *      id:     student id to be updated
+ *      fname:  new first name
+ *      lname:  new last name
+ *      gpa:    new GPA as an integer (range defined in db.h)
+ *
+ *  Replaces the names and GPA of a student already in the database.  The
+ *  student keeps its slot, so this is a single logged record write.
+ *
+ *  returns:  NO_ERROR       student updated
+ *            ERR_DB_FILE    database file I/O issue
+ *            ERR_DB_OP      database operation logically failed (aka student
+ *                           not in database)
+ *
+ *  console:  M_STD_UPDATED      on success
+ *            M_STD_NOT_FND_MSG  student not in database, cant be updated
+ *            M_ERR_DB_READ      error reading or seeking the database file
+ *            M_ERR_DB_WRITE     error writing to db file
+ *
+ */
+int update_student(int fd, int id, char *fname, char *lname, int gpa)
+{
+    int base;
+    int rc;
+
+    fd = db_shard(fd, id, &base);
+    if (lock_student(fd, id - base, true) != NO_ERROR)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;  // File I/O issue
+    }
+    rc = update_locked(fd, id, id - base, fname, lname, gpa);
+    unlock_student(fd, id - base);
+
+    return rc;
+}
+
+
 /*
  *  count_db_records
  *      fd:     linux file descriptor
@@ -243,26 +497,37 @@ int del_student(int fd, int id)
  *            M_ERR_DB_WRITE   error writing to db file (adding student)
  *
  */
+static int count_record(const student_t *s, off_t slot, void *arg)
+{
+    (void)s;
+    (void)slot;
+    (*(int *)arg)++;
+    return NO_ERROR;
+}
+
+static void count_merge(void *part, void *arg)
+{
+    *(int *)arg += *(int *)part;
+}
+
 int count_db_records(int fd)
 {
     // TO DO
-    student_t student;
-    int count = 0;
+    int count = db_shard_count(fd);
+    int rc = NO_ERROR;
 
-    // Move to the beginning of the database file
-    if (lseek(fd, 0, SEEK_SET) == -1)
+    // The occupancy bitmaps keep a live count, without them visit every
+    // non-empty record and count it, a range of the file or a shard per
+    // thread
+    if (count < 0)
     {
-        printf(M_ERR_DB_READ);
-        return ERR_DB_FILE;  // File I/O issue
+        count = 0;
+        rc = db_shard_scan(fd, count_record, count_merge, sizeof(int), &count);
     }
-
-    // Read records one by one and count non-empty records
-    while (read(fd, &student, STUDENT_RECORD_SIZE) == STUDENT_RECORD_SIZE)
+    if (rc != NO_ERROR)
     {
-        if (memcmp(&student, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE) != 0)
-        {
-            count++;
-        }
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;  // File I/O issue
     }
 
     // Handle empty database case
@@ -304,48 +569,441 @@ int count_db_records(int fd)
  *  the GPA in the student structure is an int, to convert it into a real
  *  gpa divide by 100.0 and store in a float variable.
  *
- *  returns:  NO_ERROR       on success
- *            ERR_DB_FILE    database file I/O issue
+ *  returns:  NO_ERROR       on success
+ *            ERR_DB_FILE    database file I/O issue
+ *
+ *
+ *  console:  <see above>      on success, print table or database empty
+ *            M_ERR_DB_READ    error reading or seeking the database file
+ *
+ */
+static int print_record(const student_t *s, off_t slot, void *arg)
+{
+    int *printed = arg;
+
+    (void)slot;
+    if (!*printed)
+    {
+        // Print header only once before printing first record
+        printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST NAME", "LAST_NAME", "GPA");
+        *printed = 1;
+    }
+
+    // Convert GPA from int to float and print the student record
+    printf(STUDENT_PRINT_FMT_STRING, s->id, s->fname, s->lname, s->gpa / 100.0);
+    return NO_ERROR;
+}
+
+// what one range of print_db() prints, formatted by the scan thread
+typedef struct print_part {
+    char   *data;
+    size_t len;
+    size_t size;
+} print_part_t;
+
+static int print_part_record(const student_t *s, off_t slot, void *arg)
+{
+    print_part_t *part = arg;
+    char line[PRINT_LINE_MAX];
+    int n;
+
+    (void)slot;
+    n = snprintf(line, sizeof(line), STUDENT_PRINT_FMT_STRING,
+                 s->id, s->fname, s->lname, s->gpa / 100.0);
+    if (n < 0 || (size_t)n >= sizeof(line))
+        return ERR_DB_FILE;
+
+    if (part->len + n > part->size)
+    {
+        size_t size = part->size ? part->size * 2 : 64 * 1024;
+        char *data = realloc(part->data, size);
+
+        if (data == NULL)
+            return ERR_DB_FILE;
+        part->data = data;
+        part->size = size;
+    }
+
+    memcpy(part->data + part->len, line, n);
+    part->len += n;
+    return NO_ERROR;
+}
+
+static void print_merge(void *arg_part, void *arg)
+{
+    print_part_t *part = arg_part;
+    int *printed = arg;
+
+    if (part->len > 0)
+    {
+        if (!*printed)
+        {
+            // Print header only once before printing first record
+            printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST NAME", "LAST_NAME", "GPA");
+            *printed = 1;
+        }
+        fwrite(part->data, 1, part->len, stdout);
+    }
+    free(part->data);
+}
+
+int print_db(int fd)
+{
+    // TO DO
+    int printed = 0;
+    int rc;
+
+    // Visit every non-empty record and print it.  Threads format a range
+    // of the file or a shard each, the ranges are printed in order.  With
+    // --sort the records come out of an external sort instead
+    if (sdb_config.sort_key != SDB_SORT_NONE)
+        rc = db_sort_scan(fd, sdb_config.sort_key, print_record, &printed);
+    else
+        rc = db_shard_scan(fd, print_part_record, print_merge,
+                           sizeof(print_part_t), &printed);
+    if (rc != NO_ERROR)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;  // File I/O issue
+    }
+
+    // If no records were printed, the database is empty
+    if (!printed)
+    {
+        printf(M_DB_EMPTY);
+    }
+
+    return NO_ERROR;
+}
+
+
+/*
+ *  find_by_lname
+ *      fd:      linux file descriptor
+ *      prefix:  start of the last names to look for
+ *
+ *  Prints every student whose last name starts with prefix, sorted by last
+ *  name, first name and id, in the same table format as print_db().  The
+ *  last name index finds the first match with one page read per level of
+ *  the tree and only the matching records are read, see db_names_scan().
+ *
+ *  returns:  NO_ERROR       at least one student printed
+ *            SRCH_NOT_FOUND no last name starts with prefix
+ *            ERR_DB_FILE    database file I/O issue
+ *
+ *  console:  <see print_db>   on success
+ *            M_NAME_NOT_FND   no student matched
+ *            M_ERR_DB_READ    error reading the database or the index
+ *
+ */
+int find_by_lname(int fd, char *prefix)
+{
+    int printed = 0;
+
+    if (db_names_scan(fd, prefix, print_record, &printed) != NO_ERROR)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;  // File I/O issue
+    }
+
+    if (!printed)
+    {
+        printf(M_NAME_NOT_FND, prefix);
+        return SRCH_NOT_FOUND;
+    }
+
+    return NO_ERROR;
+}
+
+
+/*
+ *  find_by_gpa
+ *      fd:      linux file descriptor
+ *      lo, hi:  GPA range as 3 digit ints, inclusive
+ *
+ *  Prints every student with a GPA in [lo, hi], lowest GPA first and by id
+ *  within a GPA, in the same table format as print_db().  The GPA index
+ *  hands out the ids bucket by bucket so only those records are read, see
+ *  db_gpa_scan().
+ *
+ *  returns:  NO_ERROR       at least one student printed
+ *            SRCH_NOT_FOUND nobody has a GPA in the range
+ *            ERR_DB_FILE    database file I/O issue
+ *
+ *  console:  <see print_db>   on success
+ *            M_GPA_NOT_FND    no student in the range
+ *            M_ERR_DB_READ    error reading the database or the index
+ *
+ */
+int find_by_gpa(int fd, int lo, int hi)
+{
+    int printed = 0;
+
+    if (db_gpa_scan(fd, lo, hi, false, 0, print_record, &printed) != NO_ERROR)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;  // File I/O issue
+    }
+
+    if (!printed)
+    {
+        printf(M_GPA_NOT_FND, lo / 100.0, hi / 100.0);
+        return SRCH_NOT_FOUND;
+    }
+
+    return NO_ERROR;
+}
+
+
+/*
+ *  top_students
+ *      fd:  linux file descriptor
+ *      k:   number of students to print
+ *
+ *  Prints the k students with the highest GPA, highest first and by id
+ *  within a GPA, in the same table format as print_db().  Walking the GPA
+ *  buckets from the top stops after k records.
+ *
+ *  returns:  NO_ERROR       on success
+ *            ERR_DB_FILE    database file I/O issue
+ *
+ *  console:  <see print_db>   on success, or M_DB_EMPTY
+ *            M_ERR_DB_READ    error reading the database or the index
+ *
+ */
+int top_students(int fd, int k)
+{
+    int printed = 0;
+
+    if (db_gpa_scan(fd, MIN_STD_GPA, MAX_STD_GPA, true, k, print_record, &printed) != NO_ERROR)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;  // File I/O issue
+    }
+
+    if (!printed)
+    {
+        printf(M_DB_EMPTY);
+    }
+
+    return NO_ERROR;
+}
+
+
+/*
+ *  gpa_stats
+ *      fd:  linux file descriptor
+ *
+ *  Prints the average, minimum, maximum and the 25th, 50th, 75th and 90th
+ *  percentile GPA of the database.  Everything comes from the histogram of
+ *  the GPA index, no student record is read.  Percentiles are nearest rank:
+ *  the lowest GPA that at least p percent of the students are at or below.
+ *
+ *  returns:  <number>       number of students the stats cover
+ *            ERR_DB_FILE    database file I/O issue
+ *
+ *  console:  M_GPA_STATS      on success
+ *            M_DB_EMPTY       on success if the database is empty
+ *            M_ERR_DB_READ    error reading the database or the index
+ *
+ */
+static int gpa_percentile(const uint32_t *hist, int count, int pct)
+{
+    long rank = ((long)count * pct + 99) / 100;
+    long seen = 0;
+    int b;
+
+    if (rank < 1)
+        rank = 1;
+
+    for (b = 0; b < GPA_BUCKETS; b++)
+    {
+        seen += hist[b];
+        if (seen >= rank)
+            return b + MIN_STD_GPA;
+    }
+
+    return MAX_STD_GPA;
+}
+
+int gpa_stats(int fd)
+{
+    uint32_t hist[GPA_BUCKETS];
+    long total = 0;
+    int count;
+    int b;
+
+    count = db_gpa_histogram(fd, hist);
+    if (count < 0)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;  // File I/O issue
+    }
+
+    if (count == 0)
+    {
+        printf(M_DB_EMPTY);
+        return 0;
+    }
+
+    for (b = 0; b < GPA_BUCKETS; b++)
+        total += (long)hist[b] * (b + MIN_STD_GPA);
+
+    printf(M_GPA_STATS, count, (double)total / count / 100.0,
+           gpa_percentile(hist, count, 0) / 100.0,
+           gpa_percentile(hist, count, 25) / 100.0,
+           gpa_percentile(hist, count, 50) / 100.0,
+           gpa_percentile(hist, count, 75) / 100.0,
+           gpa_percentile(hist, count, 90) / 100.0,
+           gpa_percentile(hist, count, 100) / 100.0);
+
+    return count;
+}
+
+
+/*
+ *  aggregate_gpa
+ *      fd:             linux file descriptor
+ *      gpa_lo, gpa_hi: GPA range as 3 digit ints, inclusive
+ *      id_lo, id_hi:   id range, inclusive
+ *
+ *  Prints the students whose GPA and id are both in range, by id, in the
+ *  same table format as print_db(), followed by the count, average,
+ *  minimum and maximum GPA of the matches.  The filter and the aggregates
+ *  run over the id and GPA columns with vector instructions, only the
+ *  records of the students that matched are read, see db_col_query().
+ *
+ *  returns:  <number>       number of students that matched
+ *            SRCH_NOT_FOUND nobody matched
+ *            ERR_DB_FILE    database file I/O issue
+ *
+ *  console:  <see print_db> and M_GPA_AGG  on success
+ *            M_AGG_NOT_FND    nobody matched
+ *            M_ERR_DB_READ    error reading the database or the columns
+ *
+ */
+int aggregate_gpa(int fd, int gpa_lo, int gpa_hi, int id_lo, int id_hi)
+{
+    col_pred_t pred = { id_lo, id_hi, gpa_lo, gpa_hi };
+    col_agg_t agg;
+    int printed = 0;
+
+    if (db_col_query(fd, &pred, &agg, print_record, &printed) != NO_ERROR)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;  // File I/O issue
+    }
+
+    if (agg.count == 0)
+    {
+        printf(M_AGG_NOT_FND);
+        return SRCH_NOT_FOUND;
+    }
+
+    printf(M_GPA_AGG, agg.count, (double)agg.sum / agg.count / 100.0,
+           agg.min / 100.0, agg.max / 100.0);
+    return agg.count;
+}
+
+
+// what query_db() hands its scan callbacks
+typedef struct query_arg {
+    const sdb_query_t *q;
+    int               printed;
+} query_arg_t;
+
+static int query_record(const student_t *s, off_t slot, void *arg)
+{
+    query_arg_t *qa = arg;
+
+    if (!db_query_match(qa->q, s))
+        return NO_ERROR;
+
+    return print_record(s, slot, &qa->printed);
+}
+
+/*
+ *  query_db
+ *      fd:    linux file descriptor
+ *      expr:  filter expression, see sdb_query.c
+ *
+ *  Prints every student that passes expr in the same table format as
+ *  print_db().  The expression is compiled once and the records are only
+ *  formatted when they pass.  What every match must satisfy picks how the
+ *  students are found:
+ *
+ *      id == N           one lookup, like get_student()
+ *      an id or GPA range the columns, only the records in range are read
+ *                        (id order, see db_col_query())
+ *      lname ^= or ==    the last name index (name order)
+ *      anything else     a scan of the whole database (slot order)
+ *
+ *  The indexes are not used on hashed and sharded databases, whose ids do
+ *  not fit them.
  *
+ *  returns:  NO_ERROR       at least one student printed
+ *            SRCH_NOT_FOUND nobody matched
+ *            ERR_DB_OP      expr is not a valid query
+ *            ERR_DB_FILE    database file I/O issue
  *
- *  console:  <see above>      on success, print table or database empty
- *            M_ERR_DB_READ    error reading or seeking the database file
+ *  console:  <see print_db>   on success
+ *            M_AGG_NOT_FND    nobody matched
+ *            M_ERR_QUERY      expr is not a valid query
+ *            M_ERR_DB_READ    error reading the database or an index
  *
  */
-int print_db(int fd)
+int query_db(int fd, char *expr)
 {
-    // TO DO
-    student_t student;
-    int printed = 0;
-
-    // Move to the beginning of the database file
-    if (lseek(fd, 0, SEEK_SET) == -1)
+    sdb_query_t q;
+    query_arg_t qa = { &q, 0 };
+    bool indexed = !db_sharded(fd) && !db_hashed(fd);
+    const char *err;
+    student_t s;
+    int rc;
+
+    if (db_query_compile(expr, &q, &err) != NO_ERROR)
     {
-        printf(M_ERR_DB_READ);
-        return ERR_DB_FILE;  // File I/O issue
+        printf(M_ERR_QUERY, (*err != '\0') ? err : "end of query");
+        return ERR_DB_OP;
     }
 
-    // Read records one by one and print valid ones
-    while (read(fd, &student, STUDENT_RECORD_SIZE) == STUDENT_RECORD_SIZE)
+    if (q.id_lo > q.id_hi || q.gpa_lo > q.gpa_hi)
+        rc = NO_ERROR;
+    else if (q.id_lo == q.id_hi)
     {
-        if (memcmp(&student, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE) != 0)
+        rc = NO_ERROR;
+        if (q.id_lo <= db_max_id())
         {
-            if (!printed)
-            {
-                // Print header only once before printing first record
-                printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST NAME", "LAST_NAME", "GPA");
-                printed = 1;
-            }
-
-            // Convert GPA from int to float and print the student record
-            printf(STUDENT_PRINT_FMT_STRING, student.id, student.fname, student.lname, student.gpa / 100.0);
+            rc = get_student(fd, q.id_lo, &s);
+            if (rc == NO_ERROR)
+                rc = query_record(&s, 0, &qa);
+            else if (rc == SRCH_NOT_FOUND)
+                rc = NO_ERROR;
         }
     }
+    else if (indexed && (q.id_lo > MIN_STD_ID || q.id_hi < MAX_STD_ID ||
+                         q.gpa_lo > MIN_STD_GPA || q.gpa_hi < MAX_STD_GPA))
+    {
+        col_pred_t pred = { q.id_lo, q.id_hi, q.gpa_lo, q.gpa_hi };
+        col_agg_t agg;
 
-    // If no records were printed, the database is empty
-    if (!printed)
+        rc = db_col_query(fd, &pred, &agg, query_record, &qa);
+    }
+    else if (indexed && q.prefix[0] != '\0')
+        rc = db_names_scan(fd, q.prefix, query_record, &qa);
+    else
+        rc = db_shard_visit(fd, query_record, &qa);
+
+    if (rc != NO_ERROR)
     {
-        printf(M_DB_EMPTY);
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;  // File I/O issue
+    }
+
+    if (!qa.printed)
+    {
+        printf(M_AGG_NOT_FND);
+        return SRCH_NOT_FOUND;
     }
 
     return NO_ERROR;
@@ -445,50 +1103,99 @@ void print_student(student_t *s)
  *            M_ERR_DB_WRITE   error writing to db or tempdb file (adding student)
  *
  */
+static int copy_record(const student_t *s, off_t slot, void *arg)
+{
+    (void)slot;
+    if (write(*(int *)arg, s, STUDENT_RECORD_SIZE) != STUDENT_RECORD_SIZE)
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
 int compress_db(int fd)
 {
      // TO DO
+    int rc;
+
+    // Records move and the file is replaced, hold off every other user of
+    // the database until the new file is in place
+    if (db_lock(fd, true) != NO_ERROR)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    // The log refers to slots of the file being replaced, fold it into the
+    // database before the records move
+    if (wal_checkpoint(fd) != NO_ERROR)
+    {
+        printf(M_ERR_DB_WRITE);
+        db_unlock(fd);
+        return ERR_DB_FILE;
+    }
+
     // Open temporary file
     int temp_fd = open(TMP_DB_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
     if (temp_fd == -1)
     {
         printf(M_ERR_DB_CREATE);
+        db_unlock(fd);
         return ERR_DB_FILE;
     }
 
-    student_t student;
-    lseek(fd, 0, SEEK_SET); // Move to the beginning of the database file
-
     // Copy all valid students to the temporary file
-    while (read(fd, &student, STUDENT_RECORD_SIZE) == STUDENT_RECORD_SIZE)
+    if (db_scan(fd, copy_record, &temp_fd) != NO_ERROR)
     {
-        if (memcmp(&student, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE) != 0)
-        {
-            if (write(temp_fd, &student, STUDENT_RECORD_SIZE) != STUDENT_RECORD_SIZE)
-            {
-                printf(M_ERR_DB_WRITE);
-                close(temp_fd);
-                return ERR_DB_FILE;
-            }
-        }
+        printf(M_ERR_DB_WRITE);
+        close(temp_fd);
+        db_unlock(fd);
+        return ERR_DB_FILE;
     }
 
-    // Close both files before renaming
-    close(fd);
-    close(temp_fd);
+    // The packed file no longer keeps students at id * STUDENT_RECORD_SIZE,
+    // write the id->slot index for it next to the temporary file
+    char idx_path[PATH_MAX];
+    char tmp_idx_path[PATH_MAX];
+    if (db_sidecar_path(DB_FILE, IDX_SIDECAR, idx_path) != NO_ERROR ||
+        db_sidecar_path(TMP_DB_FILE, IDX_SIDECAR, tmp_idx_path) != NO_ERROR ||
+        db_index_build(temp_fd, tmp_idx_path) != NO_ERROR)
+    {
+        printf(M_ERR_DB_WRITE);
+        close(temp_fd);
+        db_unlock(fd);
+        return ERR_DB_FILE;
+    }
 
-    // Rename the temporary file to replace the original database file
-    if (rename(TMP_DB_FILE, DB_FILE) != 0)
+    // The same students are still there, stamp the occupancy bitmap, the
+    // GPA index and the columns with the compressed file so they stay valid
+    // after the rename.  The name index is left alone, it no longer matches
+    // and is rebuilt without the space deletes left in it when the file is
+    // reopened
+    db_bitmap_clear_dead(fd);
+    db_bitmap_restamp(fd, temp_fd);
+    db_gpa_restamp(fd, temp_fd);
+    db_col_restamp(fd, temp_fd);
+
+    // Rename the temporary files to replace the original database file,
+    // the index goes first so the packed file never shows up without one.
+    // This happens before closing so the exclusive lock is still held,
+    // writers waiting on it move over to the new file, see db_lock()
+    rc = NO_ERROR;
+    if (rename(tmp_idx_path, idx_path) != 0 ||
+        rename(TMP_DB_FILE, DB_FILE) != 0)
+        rc = ERR_DB_FILE;
+
+    close_db(fd);
+    close(temp_fd);
+    if (rc != NO_ERROR)
     {
         printf(M_ERR_DB_CREATE);
         return ERR_DB_FILE;
     }
 
     // Reopen the new compressed file and return its descriptor
-    temp_fd = open(DB_FILE, O_RDWR);
-    if (temp_fd == -1)
+    temp_fd = open_db(DB_FILE, false);
+    if (temp_fd < 0)
     {
-        printf(M_ERR_DB_OPEN);
         return ERR_DB_FILE;
     }
 
@@ -504,7 +1211,8 @@ int compress_db(int fd)
  *
  *  This function validates that the id and gpa are in the allowable ranges
  *  as per the specifications.  It checks if the values are within the
- *  inclusive range using constents in db.h
+ *  inclusive range using constents in db.h, a sharded database takes ids
+ *  up to the last one of its last shard
  *
  *  returns:    NO_ERROR       on success, both ID and GPA are in range
  *              EXIT_FAIL_ARGS if either ID or GPA is out of range
@@ -515,7 +1223,7 @@ int compress_db(int fd)
 int validate_range(int id, int gpa)
 {
 
-    if ((id < MIN_STD_ID) || (id > MAX_STD_ID))
+    if ((id < MIN_STD_ID) || (id > db_max_id()))
         return EXIT_FAIL_ARGS;
 
     if ((gpa < MIN_STD_GPA) || (gpa > MAX_STD_GPA))
@@ -537,18 +1245,153 @@ int validate_range(int id, int gpa)
  */
 void usage(char *exename)
 {
-    printf("usage: %s -[h|a|c|d|f|p|z] options.  Where:\n", exename);
+    printf("usage: %s -[h|a|A|b|c|C|d|e|f|F|g|G|n|p|q|r|s|t|u|x|z] options.  Where:\n", exename);
     printf("\t-h:  prints help\n");
     printf("\t-a id first_name last_name gpa(as 3 digit int):  adds a student\n");
+    printf("\t-A lo hi [id_lo id_hi]:  prints students in a GPA (and id) range\n");
+    printf("\t    with their count, average, min and max GPA\n");
+    printf("\t-b file:  bulk loads students from a CSV or packed student file\n");
     printf("\t-c:  counts the records in the database\n");
+    printf("\t-C compact|direct:  converts the database to 16 byte records with\n");
+    printf("\t    the names in a dictionary, or back to plain records\n");
     printf("\t-d id:  deletes a student\n");
+    printf("\t-e csv|jsonl|bin:  exports every student to stdout\n");
     printf("\t-f id:  finds and prints a student in the database\n");
+    printf("\t-F [idfile]:  finds and prints every student in idfile (or stdin)\n");
+    printf("\t-g lo hi(as 3 digit ints):  prints students with a GPA in the range\n");
+    printf("\t-G:  prints GPA statistics for the database\n");
+    printf("\t-n prefix:  prints students whose last name starts with prefix\n");
     printf("\t-p:  prints all records in the student database\n");
+    printf("\t-q expr:  prints the students that pass expr, for example\n");
+    printf("\t    \"gpa>=350 && lname^='Sm'\" (id, gpa, fname, lname, == != < <=\n");
+    printf("\t    > >= ^=, && || ! and parentheses)\n");
+    printf("\t-r name:  restores the database from the snapshot name\n");
+    printf("\t-s name:  writes a snapshot of the database to name\n");
+    printf("\t-t k:  prints the k students with the highest GPA\n");
+    printf("\t-u id first_name last_name gpa(as 3 digit int):  updates a student\n");
     printf("\t-x:  compress the database file [EXTRA CREDIT]\n");
     printf("\t-z:  zero db file (remove all records)\n");
+    printf("engine options, may be given anywhere on the command line:\n");
+    printf("\t--mmap:  access the database through a memory mapping\n");
+    printf("\t--sync=none|async|full:  flush policy after every change\n");
+    printf("\t--no-compact:  do not punch out dead space in the background\n");
+    printf("\t--no-wal:  do not log changes to the write-ahead log\n");
+    printf("\t--commit-every=N:  sync the log once N changes are waiting\n");
+    printf("\t--commit-ms=T:  or once the oldest change has waited T ms\n");
+    printf("\t--threads=N:  full scans use N threads, one per core by default\n");
+    printf("\t--shards=N:  with -z, spread the emptied database over N files\n");
+    printf("\t    by id range (1 to go back to one file)\n");
+    printf("\t--layout=hash|compact|direct:  with -z, make the emptied database\n");
+    printf("\t    hashed, for ids up to 999999999, compact, or direct addressed again\n");
+    printf("\t--pool=N:  cache N 4KB pages of records, for --serve and -b\n");
+    printf("\t--direct:  read and write pool pages with O_DIRECT\n");
+    printf("\t--sort=lname|fname|gpa:  -p prints in name or GPA order\n");
+    printf("\t--sort-mem=KB:  memory the sort may use before it spills runs to\n");
+    printf("\t    temporary files, 16384 by default\n");
+    printf("\t-S:  report the time, I/O, records and syncs of every phase of the\n");
+    printf("\t    command on stderr\n");
+    printf("\t--stats=FILE:  write that report to FILE as JSON instead\n");
+    printf("\t--serve:  keep the database open and answer requests on a socket\n");
+    printf("\t--connect:  send -a, -c, -d, -f, -p or -u to a running --serve\n");
+}
+
+/*
+ *  parse_engine_opts
+ *      argc:  argument count from main()
+ *      argv:  argument vector from main()
+ *
+ *  Storage engine options are long options ("--name" or "--name=value")
+ *  that can appear anywhere on the command line.  They are applied to
+ *  sdb_config and removed from argv so the single letter option handling
+ *  in main() does not have to know about them.  -S goes with them, it
+ *  changes how a command runs rather than which one runs.
+ *
+ *  returns:  the new argument count, or -1 if an option is not valid
+ *
+ *  console:  This function does not produce any output
+ */
+int parse_engine_opts(int argc, char *argv[])
+{
+    int i;
+    int n = 1;
+
+    for (i = 1; i < argc; i++)
+    {
+        char *arg = argv[i];
+
+        if (strcmp(arg, "-S") == 0)
+        {
+            sdb_config.stats = true;
+            continue;
+        }
+        if (strncmp(arg, "--", 2) != 0)
+        {
+            argv[n++] = arg;
+            continue;
+        }
+
+        if (strcmp(arg, "--mmap") == 0)
+            sdb_config.use_mmap = true;
+        else if (strcmp(arg, "--no-wal") == 0)
+            sdb_config.use_wal = false;
+        else if (strncmp(arg, "--commit-every=", 15) == 0 && atoi(arg + 15) > 0)
+            sdb_config.commit_every = atoi(arg + 15);
+        else if (strncmp(arg, "--commit-ms=", 12) == 0 && atoi(arg + 12) >= 0)
+            sdb_config.commit_ms = atoi(arg + 12);
+        else if (strncmp(arg, "--threads=", 10) == 0 && atoi(arg + 10) > 0)
+            sdb_config.scan_threads = atoi(arg + 10);
+        else if (strncmp(arg, "--shards=", 9) == 0 && atoi(arg + 9) > 0)
+            sdb_config.shards = atoi(arg + 9);
+        else if (strcmp(arg, "--layout=hash") == 0)
+            sdb_config.layout = DB_LAYOUT_HASH;
+        else if (strcmp(arg, "--layout=direct") == 0)
+            sdb_config.layout = DB_LAYOUT_DIRECT;
+        else if (strcmp(arg, "--layout=compact") == 0)
+            sdb_config.layout = DB_LAYOUT_COMPACT;
+        else if (strncmp(arg, "--pool=", 7) == 0 && atoi(arg + 7) > 0)
+            sdb_config.pool_pages = atoi(arg + 7);
+        else if (strcmp(arg, "--direct") == 0)
+            sdb_config.direct_io = true;
+        else if (strcmp(arg, "--sort=lname") == 0)
+            sdb_config.sort_key = SDB_SORT_LNAME;
+        else if (strcmp(arg, "--sort=fname") == 0)
+            sdb_config.sort_key = SDB_SORT_FNAME;
+        else if (strcmp(arg, "--sort=gpa") == 0)
+            sdb_config.sort_key = SDB_SORT_GPA;
+        else if (strncmp(arg, "--sort-mem=", 11) == 0 && atoi(arg + 11) > 0)
+            sdb_config.sort_kb = atoi(arg + 11);
+        else if (strncmp(arg, "--stats=", 8) == 0 && arg[8] != '\0')
+        {
+            sdb_config.stats = true;
+            sdb_config.stats_file = arg + 8;
+        }
+        else if (strcmp(arg, "--serve") == 0)
+            sdb_config.serve = true;
+        else if (strcmp(arg, "--connect") == 0)
+            sdb_config.remote = true;
+        else if (strcmp(arg, "--no-compact") == 0)
+            sdb_config.auto_compact = false;
+        else if (strcmp(arg, "--sync=none") == 0)
+            sdb_config.sync_policy = SDB_SYNC_NONE;
+        else if (strcmp(arg, "--sync=async") == 0)
+            sdb_config.sync_policy = SDB_SYNC_ASYNC;
+        else if (strcmp(arg, "--sync=full") == 0)
+            sdb_config.sync_policy = SDB_SYNC_FULL;
+        else
+            return -1;
+    }
+
+    // O_DIRECT only makes sense with a pool to cache the pages
+    if (sdb_config.direct_io && sdb_config.pool_pages == 0)
+        sdb_config.pool_pages = POOL_DIRECT_PAGES;
+
+    argv[n] = NULL;
+    return n;
 }
 
-// Welcome to main()
+// Welcome to main(), left out when the functions are linked into
+// bench/sdb_bench
+#ifndef SDB_NO_MAIN
 int main(int argc, char *argv[])
 {
     char opt;      // user selected option
@@ -557,12 +1400,33 @@ int main(int argc, char *argv[])
     int exit_code; // exit code to shell
     int id;        // userid from argv[2]
     int gpa;       // gpa from argv[5]
+    int lo;        // low end of a gpa range from argv[2]
 
     // space for a student structure which we will get back from
     // some of the functions we will be writing such as get_student(),
     // and print_student().
     student_t student = {0};
 
+    // pull out the storage engine options first
+    argc = parse_engine_opts(argc, argv);
+
+    // run as a server until told to stop
+    if (sdb_config.serve && argc == 1)
+    {
+        fd = open_db(DB_FILE, false);
+        if (fd < 0)
+            exit(EXIT_FAIL_DB);
+        if (db_sharded(fd))
+        {
+            printf(M_ERR_SHARD_OPT, "--serve");
+            close_db(fd);
+            exit(EXIT_NOT_IMPL);
+        }
+        rc = serve_db(fd);
+        close_db(fd);
+        exit((rc < 0) ? EXIT_FAIL_DB : EXIT_OK);
+    }
+
     // This function must have at least one arg, and the arg must start
     // with a dash
     if ((argc < 2) || (*argv[1] != '-'))
@@ -572,7 +1436,7 @@ int main(int argc, char *argv[])
     }
 
     // The option is the first character after the dash for example
-    //-h -a -c -d -f -p -x -z
+    //-h -a -A -b -c -d -e -f -g -G -n -p -t -u -x -z
     opt = (char)*(argv[1] + 1); // get the option flag
 
     // handle the help flag and then exit normally
@@ -582,20 +1446,55 @@ int main(int argc, char *argv[])
         exit(EXIT_OK);
     }
 
+    // a client leaves the database to the server
+    if (sdb_config.remote)
+    {
+        exit(remote_main(argc, argv));
+    }
+
     // now lets open the file and continue if there is no error
     // note we are not truncating the file using the second
     // parameter
+    db_stats_phase("open");
     fd = open_db(DB_FILE, false);
     if (fd < 0)
     {
         exit(EXIT_FAIL_DB);
     }
 
+    // a sharded database takes the options that work student by student
+    // or scan everything, the indexes and compress_db() work per file
+    if (db_sharded(fd) && strchr("acdfFpquz", opt) == NULL)
+    {
+        printf(M_ERR_SHARD_OPT, argv[1]);
+        close_db(fd);
+        exit(EXIT_NOT_IMPL);
+    }
+
+    // the same goes for a hashed database, whose ids do not fit the
+    // indexes, and its records only make sense with its directory
+    if (db_hashed(fd) && strchr("abcdeFfpquz", opt) == NULL)
+    {
+        printf(M_ERR_HASH_OPT, argv[1]);
+        close_db(fd);
+        exit(EXIT_NOT_IMPL);
+    }
+
+    // compact records only make sense with their dictionary, which
+    // compress_db() and snapshots leave out
+    if (db_dict_encoded(fd) && strchr("rsx", opt) != NULL)
+    {
+        printf(M_ERR_COMPACT_OPT, argv[1]);
+        close_db(fd);
+        exit(EXIT_NOT_IMPL);
+    }
+
     // set rc to the return code of the operation to ensure the program
     // use that to determine the proper exit_code.  Look at the header
     // sdbsc.h for expected values.
 
     exit_code = EXIT_OK;
+    db_stats_phase("run");
     switch (opt)
     {
     case 'a':
@@ -628,6 +1527,48 @@ int main(int argc, char *argv[])
 
         break;
 
+    case 'A':
+        //    arv[0] arv[1]  arv[2]  arv[3]  [arv[4]  arv[5]]
+        // prog_name     -A      lo      hi  [id_lo   id_hi]
+        //--------------------------------------------------
+        // example:  prog_name -A 350 500 1000 1999
+        if (argc != 4 && argc != 6)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        lo = atoi(argv[2]);
+        gpa = atoi(argv[3]);
+        if ((lo < MIN_STD_GPA) || (gpa > MAX_STD_GPA) || (lo > gpa))
+        {
+            printf(M_ERR_GPA_RNG);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = aggregate_gpa(fd, lo, gpa,
+                           (argc == 6) ? atoi(argv[4]) : MIN_STD_ID,
+                           (argc == 6) ? atoi(argv[5]) : MAX_STD_ID);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'b':
+        //    arv[0] arv[1]  arv[2]
+        // prog_name     -b    file
+        //-------------------------
+        // example:  prog_name -b roster.csv
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = bulk_load(fd, argv[2]);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
     case 'c':
         //    arv[0] arv[1]
         // prog_name     -c
@@ -638,6 +1579,28 @@ int main(int argc, char *argv[])
             exit_code = EXIT_FAIL_DB;
         break;
 
+    case 'C':
+        //    arv[0] arv[1]   arv[2]
+        // prog_name     -C   layout
+        //--------------------------
+        // example:  prog_name -C compact
+        // like compress_db, convert_db returns the fd of the converted
+        // database and we close it after this switch statement
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = convert_db(fd, argv[2]);
+        if (rc == ERR_DB_OP)
+            exit_code = EXIT_FAIL_ARGS;
+        else if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        if (rc != ERR_DB_OP)
+            fd = rc;
+        break;
+
     case 'd':
         //   arv[0]  arv[1]  arv[2]
         // prog_name     -d      id
@@ -657,6 +1620,24 @@ int main(int argc, char *argv[])
 
         break;
 
+    case 'e':
+        //    arv[0] arv[1]  arv[2]
+        // prog_name     -e  format
+        //-------------------------
+        // example:  prog_name -e csv > students.csv
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = export_db(fd, argv[2]);
+        if (rc == ERR_DB_OP)
+            exit_code = EXIT_FAIL_ARGS;
+        else if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
     case 'f':
         //    arv[0] arv[1]  arv[2]
         // prog_name     -f      id
@@ -687,6 +1668,75 @@ int main(int argc, char *argv[])
         }
         break;
 
+    case 'F':
+        //    arv[0] arv[1]  arv[2]
+        // prog_name     -F  [idfile]
+        //---------------------------
+        // example:  prog_name -F roster.txt
+        //           cut -d, -f1 roster.csv | prog_name -F
+        if (argc != 2 && argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = get_students(fd, (argc == 3) ? argv[2] : NULL);
+        if (rc == ERR_DB_OP)
+            exit_code = EXIT_FAIL_ARGS;
+        else if (rc != 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'g':
+        //    arv[0] arv[1]  arv[2]  arv[3]
+        // prog_name     -g      lo      hi
+        //---------------------------------
+        // example:  prog_name -g 350 400
+        if (argc != 4)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        lo = atoi(argv[2]);
+        gpa = atoi(argv[3]);
+        if ((lo < MIN_STD_GPA) || (gpa > MAX_STD_GPA) || (lo > gpa))
+        {
+            printf(M_ERR_GPA_RNG);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = find_by_gpa(fd, lo, gpa);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'G':
+        //    arv[0] arv[1]
+        // prog_name     -G
+        //-----------------
+        // example:  prog_name -G
+        rc = gpa_stats(fd);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'n':
+        //    arv[0] arv[1]  arv[2]
+        // prog_name     -n  prefix
+        //-------------------------
+        // example:  prog_name -n Sm
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = find_by_lname(fd, argv[2]);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
     case 'p':
         //    arv[0] arv[1]
         // prog_name     -p
@@ -697,6 +1747,108 @@ int main(int argc, char *argv[])
             exit_code = EXIT_FAIL_DB;
         break;
 
+    case 'q':
+        //    arv[0] arv[1]  arv[2]
+        // prog_name     -q    expr
+        //-------------------------
+        // example:  prog_name -q "gpa>=350 && lname^='Sm'"
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = query_db(fd, argv[2]);
+        if (rc == ERR_DB_OP)
+            exit_code = EXIT_FAIL_ARGS;
+        else if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'r':
+        //    arv[0] arv[1]  arv[2]
+        // prog_name     -r    name
+        //-------------------------
+        // example:  prog_name -r before-import.db
+        // like compress_db, restore_db returns the fd of the restored
+        // database and we close it after this switch statement.  It closes
+        // the old fd even when it fails, fd is then the error and there is
+        // nothing left to close
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = restore_db(fd, argv[2]);
+        if (rc == ERR_DB_OP)
+            exit_code = EXIT_FAIL_ARGS;
+        else if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        fd = rc;
+        break;
+
+    case 's':
+        //    arv[0] arv[1]  arv[2]
+        // prog_name     -s    name
+        //-------------------------
+        // example:  prog_name -s before-import.db
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = snapshot_db(fd, argv[2]);
+        if (rc == ERR_DB_OP)
+            exit_code = EXIT_FAIL_ARGS;
+        else if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 't':
+        //    arv[0] arv[1]  arv[2]
+        // prog_name     -t       k
+        //-------------------------
+        // example:  prog_name -t 10
+        if (argc != 3 || atoi(argv[2]) <= 0)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = top_students(fd, atoi(argv[2]));
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'u':
+        //   arv[0] arv[1]  arv[2]      arv[3]    arv[4]  arv[5]
+        // prog_name     -u      id  first_name last_name     gpa
+        //-------------------------------------------------------
+        // example:  prog_name -u 1 John Doe 355
+        if (argc != 6)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+
+        id = atoi(argv[2]);
+        gpa = atoi(argv[5]);
+
+        exit_code = validate_range(id, gpa);
+        if (exit_code == EXIT_FAIL_ARGS)
+        {
+            printf(M_ERR_STD_RNG);
+            break;
+        }
+
+        rc = update_student(fd, id, argv[3], argv[4], gpa);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
     case 'x':
         //    arv[0] arv[1]
         // prog_name     -x
@@ -717,7 +1869,7 @@ int main(int argc, char *argv[])
         // example:  prog_name -x
         // HINT:  close the db file, we already have fd
         //       and reopen db indicating truncate=true
-        close(fd);
+        close_db(fd);
         fd = open_db(DB_FILE, true);
         if (fd < 0)
         {
@@ -734,6 +1886,12 @@ int main(int argc, char *argv[])
 
     // dont forget to close the file before exiting, and setting the
     // proper exit code - see the header file for expected values
-    close(fd);
+    db_stats_phase("output");
+    fflush(stdout);
+    db_stats_phase("close");
+    close_db(fd);
+    if (db_stats_report(argv[1]) != NO_ERROR)
+        fprintf(stderr, M_ERR_STATS_FILE, sdb_config.stats_file);
     exit(exit_code);
 }
+#endif
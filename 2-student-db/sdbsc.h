@@ -1,4 +1,9 @@
 #ifndef __SDB_H__
+    #define __SDB_H__
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 #include "db.h" //get student record type
 
@@ -6,13 +11,588 @@
 int open_db(char *dbFile, bool should_truncate);
 int add_student(int fd, int id, char *fname, char *lname, int gpa);
 int get_student(int fd, int id, student_t *s);
+int get_students(int fd, char *file);
 int del_student(int fd, int id);
+int update_student(int fd, int id, char *fname, char *lname, int gpa);
 int compress_db(int fd);
 void print_student(student_t *s);
 int validate_range(int id, int gpa);
 int count_db_records(int fd);
 int print_db(int fd);
+int export_db(int fd, char *format);
+int snapshot_db(int fd, char *name);
+int restore_db(int fd, char *name);
+int convert_db(int fd, char *layout);
 void usage(char *);
+int parse_engine_opts(int argc, char *argv[]);
+int bulk_load(int fd, char *file);
+int find_by_lname(int fd, char *prefix);
+int find_by_gpa(int fd, int lo, int hi);
+int top_students(int fd, int k);
+int gpa_stats(int fd);
+int aggregate_gpa(int fd, int gpa_lo, int gpa_hi, int id_lo, int id_hi);
+int query_db(int fd, char *expr);
+int serve_db(int fd);
+int remote_main(int argc, char *argv[]);
+void close_db(int fd);
+
+//storage engine prototypes, see sdb_store.c.  Every fd returned from open_db()
+//has a context that remembers the path of the database file and how its
+//records are laid out on disk:
+//  DB_LAYOUT_DIRECT  student id lives at id * STUDENT_RECORD_SIZE
+//  DB_LAYOUT_PACKED  records were packed by compress_db(), the id->slot
+//                    mapping is kept in the index sidecar file
+//  DB_LAYOUT_HASH    records live in buckets found through an extendible
+//                    hash directory sidecar, for ids up to HASH_MAX_STD_ID
+//  DB_LAYOUT_COMPACT direct addressed 16 byte records whose names are
+//                    numbers into the name dictionary sidecar
+#define DB_LAYOUT_DIRECT    0
+#define DB_LAYOUT_PACKED    1
+#define DB_LAYOUT_HASH      2
+#define DB_LAYOUT_COMPACT   3
+
+//identity of the database file at one point in time.  Sidecars that
+//describe the records keep the stamp of the file they were last brought up
+//to date with, and are rebuilt when it no longer matches, see db_stamp()
+typedef struct sdb_stamp {
+    uint64_t ino;                   //inode number
+    int64_t  size;                  //size in bytes
+    int64_t  mtime;                 //mtime in nanoseconds
+} sdb_stamp_t;
+
+//occupancy bitmap sidecar, one bit per possible id plus a live record
+//count, see sdb_bitmap.c for how it is kept consistent
+#define BMP_MAGIC       0x4d424453      //"SDBM"
+#define BMP_VERSION     3
+
+typedef struct bmp_file {
+    uint32_t magic;                 //BMP_MAGIC
+    uint32_t version;               //BMP_VERSION
+    uint32_t count;                 //live records in the database
+    uint32_t inflight;              //changes begun and not yet committed
+    uint32_t dead;                  //deleted slots still holding storage,
+                                    //an estimate, see db_compact_needed()
+    uint32_t changes;               //bumped by every change as it commits,
+                                    //see sdb_pool.c
+    sdb_stamp_t stamp;              //stamp of the database file the
+                                    //bitmap describes, checked on open
+    uint8_t  bits[(MAX_STD_ID + 8) / 8];
+} bmp_file_t;
+
+//write-ahead log sidecar, see sdb_wal.c.  The header is followed by one
+//wal_record_t per logged change.
+#define WAL_MAGIC       0x4c415753      //"SWAL"
+#define WAL_REC_MAGIC   0x43455257      //"WREC"
+#define WAL_VERSION     1
+#define WAL_BOOT_ID_LEN 40
+#define WAL_OP_ADD      1
+#define WAL_OP_DEL      2
+#define WAL_OP_UPDATE   3
+
+//checkpoint once the log is bigger than this when the database is closed
+#define WAL_CHECKPOINT_BYTES    (1024 * 1024)
+
+typedef struct wal_header {
+    uint32_t magic;                 //WAL_MAGIC
+    uint32_t version;               //WAL_VERSION
+    uint64_t db_ino;                //database file the log belongs to
+    char     boot_id[WAL_BOOT_ID_LEN];  //boot the log was started in
+    char     reserved[8];
+} wal_header_t;
+
+typedef struct wal_record {
+    uint32_t  magic;                //WAL_REC_MAGIC
+    uint32_t  op;                   //WAL_OP_xxx
+    int32_t   id;                   //student the change is for
+    uint32_t  crc;                  //crc32 of the record with crc = 0
+    int64_t   slot;                 //slot written
+    student_t image;                //record written to the slot
+} wal_record_t;
+
+//GPA index sidecar, a histogram with one bucket per possible GPA and the
+//ids in each bucket as a doubly linked list, see sdb_gpa.c
+#define GPA_MAGIC       0x41504753      //"SGPA"
+#define GPA_VERSION     2
+#define GPA_BUCKETS     (MAX_STD_GPA - MIN_STD_GPA + 1)
+
+typedef struct gpa_file {
+    uint32_t magic;                 //GPA_MAGIC
+    uint32_t version;               //GPA_VERSION
+    uint32_t count;                 //students in the index
+    uint32_t inflight;              //changes begun and not yet committed
+    sdb_stamp_t stamp;              //stamp of the database file indexed
+    uint32_t hist[GPA_BUCKETS];     //students per GPA
+    uint32_t head[GPA_BUCKETS];     //first id in each bucket, 0 if empty
+    uint32_t next[MAX_STD_ID + 1];  //next id in the same bucket
+    uint32_t prev[MAX_STD_ID + 1];  //previous id in the same bucket
+    uint16_t where[MAX_STD_ID + 1]; //bucket + 1 of every id, 0 if absent
+} gpa_file_t;
+
+//column sidecar, the ids and GPAs of the live students as dense columns
+//for vectorized filters, see sdb_col.c
+#define COL_MAGIC       0x4c4f4353      //"SCOL"
+#define COL_VERSION     2
+
+typedef struct col_file {
+    uint32_t magic;                 //COL_MAGIC
+    uint32_t version;               //COL_VERSION
+    uint32_t count;                 //rows in use
+    uint32_t inflight;              //changes begun and not yet committed
+    sdb_stamp_t stamp;              //stamp of the database file described
+    uint32_t pos[MAX_STD_ID + 1];   //row + 1 of every id, 0 if absent
+    int32_t  id[MAX_STD_ID];        //id column
+    int32_t  gpa[MAX_STD_ID];       //GPA column
+} col_file_t;
+
+//filter for db_col_query(), a student passes when both its id and its
+//GPA are in range (inclusive)
+typedef struct col_pred {
+    int id_lo;
+    int id_hi;
+    int gpa_lo;
+    int gpa_hi;
+} col_pred_t;
+
+typedef struct col_agg {
+    int       count;                //students that passed the filter
+    long long sum;                  //sum of their GPAs
+    int       min;                  //lowest GPA, INT_MAX if none
+    int       max;                  //highest GPA, INT_MIN if none
+} col_agg_t;
+
+//compiled -q filter, see sdb_query.c.  The expression is kept in postfix
+//order, QOP_TEST pushes the result of one comparison and the others
+//combine the results on top of the stack
+#define QUERY_MAX_OPS   64
+#define QUERY_MAX_STR   32
+
+#define QOP_TEST        0
+#define QOP_AND         1
+#define QOP_OR          2
+#define QOP_NOT         3
+
+#define QF_ID           0
+#define QF_GPA          1
+#define QF_FNAME        2
+#define QF_LNAME        3
+
+#define QC_EQ           0
+#define QC_NE           1
+#define QC_LT           2
+#define QC_LE           3
+#define QC_GT           4
+#define QC_GE           5
+#define QC_PREFIX       6               //^=, names only
+
+typedef struct query_op {
+    uint8_t code;                   //QOP_xxx
+    uint8_t field;                  //QF_xxx (test)
+    uint8_t cmp;                    //QC_xxx (test)
+    uint8_t len;                    //length of str (test)
+    int32_t num;                    //id or GPA to compare with (test)
+    char    str[QUERY_MAX_STR];     //name to compare with (test)
+} query_op_t;
+
+typedef struct sdb_query {
+    query_op_t op[QUERY_MAX_OPS];
+    int        count;               //ops in use
+    //what every match must satisfy, taken from the comparisons joined to
+    //the top with && only, for the index that serves the query
+    int        id_lo;
+    int        id_hi;
+    int        gpa_lo;
+    int        gpa_hi;
+    char       prefix[QUERY_MAX_STR];   //last name prefix, "" if none
+} sdb_query_t;
+
+//last name index sidecar, a B+tree of name_key_t in NAME_PAGE_SIZE pages.
+//Page 0 holds the header, see sdb_names.c for how the tree is kept
+//consistent with the database
+#define NAME_MAGIC      0x4d414e53      //"SNAM"
+#define NAME_VERSION    2
+#define NAME_PAGE_SIZE  4096
+
+typedef struct name_header {
+    uint32_t magic;                 //NAME_MAGIC
+    uint32_t version;               //NAME_VERSION
+    uint32_t root;                  //page number of the root node
+    uint32_t pages;                 //pages in the file, header included
+    uint32_t height;                //levels in the tree, 1 = root is a leaf
+    uint32_t count;                 //keys in the tree
+    uint32_t inflight;              //changes begun and not yet committed
+    uint32_t reserved;
+    sdb_stamp_t stamp;              //stamp of the database file indexed
+} name_header_t;
+
+//keys sort by last name, then first name, then id.  The names have the
+//same sizes as in student_t and are always NUL terminated.
+typedef struct name_key {
+    char    lname[32];
+    char    fname[24];
+    int32_t id;
+} name_key_t;
+
+#define NAME_LEAF_KEYS  ((NAME_PAGE_SIZE - 8) / sizeof(name_key_t))
+#define NAME_INNER_KEYS ((NAME_PAGE_SIZE - 12) / (sizeof(name_key_t) + 4))
+
+typedef struct name_page {
+    uint16_t leaf;                  //1 for leaves, 0 for inner nodes
+    uint16_t count;                 //keys in use
+    uint32_t next;                  //next leaf in key order, 0 at the end
+    union {
+        name_key_t keys[NAME_LEAF_KEYS];    //leaf keys
+        struct {
+            name_key_t keys[NAME_INNER_KEYS];   //keys[i] is the smallest
+            uint32_t   child[NAME_INNER_KEYS + 1];  //key under child[i+1]
+        } inner;
+    };
+} name_page_t;
+
+//extendible hash directory sidecar, see sdb_hash.c.  The database file is
+//an array of HASH_BUCKET_SLOTS record buckets, one 4KB page each.  The low
+//depth bits of the hash of an id pick the directory entry, which holds the
+//bucket of the id.  The file is sparse, only the directory entries in use
+//hold storage.
+#define HASH_MAGIC          0x48534453      //"SDSH"
+#define HASH_VERSION        1
+#define HASH_BUCKET_SLOTS   64
+#define HASH_BUCKET_BYTES   (HASH_BUCKET_SLOTS * STUDENT_RECORD_SIZE)
+#define HASH_MAX_DEPTH      20
+#define HASH_DIR_MAX        (1 << HASH_MAX_DEPTH)
+#define HASH_MAX_STD_ID     999999999       //every 9 digit id
+
+typedef struct hash_dir {
+    uint32_t magic;                 //HASH_MAGIC
+    uint32_t version;               //HASH_VERSION
+    uint32_t depth;                 //global depth, the directory has
+                                    //1 << depth entries in use
+    uint32_t buckets;               //buckets in the database file
+    uint32_t dir[HASH_DIR_MAX];     //bucket of every hash prefix
+    uint8_t  local[HASH_DIR_MAX];   //local depth of every bucket
+} hash_dir_t;
+
+//compact records, see sdb_dict.c.  A compact file keeps student id at
+//id * COMPACT_RECORD_SIZE with both names replaced by their entry in the
+//name dictionary sidecar, entry 0 is the empty name.  Slot 0 holds
+//COMPACT_MAGIC in place of an id, larger than any student id, which is how
+//a compact file is told apart from the other layouts.  Its fname says which
+//of the two dictionary files the records use, see convert_db().
+#define COMPACT_MAGIC       0x43424453      //"SDBC"
+#define COMPACT_VERSION     1
+#define COMPACT_RECORD_SIZE ((int)sizeof(compact_rec_t))
+
+typedef struct compact_rec {
+    int32_t  id;                    //student id, 0 for an empty slot
+    int32_t  gpa;
+    uint32_t fname;                 //dictionary entry of the first name
+    uint32_t lname;                 //dictionary entry of the last name
+} compact_rec_t;
+
+//the dictionary holds every name once, first and last names alike, in
+//entries of DICT_ENTRY_SIZE bytes that never move.  An open addressing
+//table over the entries finds the entry of a name.  The file is sparse and
+//mapped shared, names are added under the meta lock and never removed,
+//converting the database to compact again drops the unused ones.
+#define DICT_MAGIC          0x44424453      //"SDBD"
+#define DICT_VERSION        1
+#define DICT_ENTRY_SIZE     32              //the longest last name and NUL
+#define DICT_MAX_ENTRIES    (1 << 19)
+#define DICT_TABLE_SLOTS    (1 << 20)       //never more than half full
+
+typedef struct dict_file {
+    uint32_t magic;                 //DICT_MAGIC
+    uint32_t version;               //DICT_VERSION
+    uint32_t count;                 //entries in use, entry 0 included
+    uint32_t reserved;
+    uint32_t table[DICT_TABLE_SLOTS];   //entry of a name, 0 if the slot
+                                        //is free
+    char     names[DICT_MAX_ENTRIES][DICT_ENTRY_SIZE];
+} dict_file_t;
+
+//buffer pool, see sdb_pool.c.  A page is POOL_PAGE_SLOTS records, 4KB
+#define POOL_PAGE_SLOTS     64
+#define POOL_PAGE_BYTES     4096
+#define POOL_DIRECT_PAGES   1024            //--direct without --pool, 4MB
+
+typedef struct sdb_pool sdb_pool_t;
+
+typedef struct sdb_ctx {
+    int      fd;                    //database file descriptor, -1 if unused
+    int      layout;                //DB_LAYOUT_xxx
+    char     path[PATH_MAX];        //path of the database file
+    uint32_t *idx;                  //mapped id->slot index (packed only)
+    hash_dir_t *hash;               //mapped hash directory (hash only)
+    dict_file_t *dict;              //mapped name dictionary (compact only)
+    student_t *map;                 //mapped records (mmap backend only)
+    size_t   map_len;               //bytes currently mapped
+    sdb_pool_t *pool;               //buffer pool, NULL until first used
+    bmp_file_t *bmp;                //mapped occupancy bitmap, NULL if none
+    gpa_file_t *gpa;                //mapped GPA index, NULL if none
+    col_file_t *col;                //mapped id/GPA columns, NULL if none
+    int      wal_fd;                //write-ahead log, -1 if not in use
+    int      wal_pending;           //records appended but not yet synced
+    int64_t  wal_first_ms;          //when the oldest pending record was added
+    int      names_fd;              //last name index, -1 if not in use
+} sdb_ctx_t;
+
+//engine settings chosen on the command line (see main()) before the
+//database is opened.  Building with "make MMAP=1" turns the mmap backend
+//on by default.
+//  SDB_SYNC_NONE   leave write back to the kernel
+//  SDB_SYNC_ASYNC  schedule write back after every change (MS_ASYNC)
+//  SDB_SYNC_FULL   wait for write back after every change (MS_SYNC/fsync)
+#define SDB_SYNC_NONE   0
+#define SDB_SYNC_ASYNC  1
+#define SDB_SYNC_FULL   2
+
+#ifndef SDB_MMAP
+    #define SDB_MMAP    0
+#endif
+
+typedef struct sdb_config {
+    bool use_mmap;                  //map the database file
+    int  sync_policy;               //SDB_SYNC_xxx for the mmap backend
+    bool auto_compact;              //punch out dead space in the background
+    bool use_wal;                   //log changes to the write-ahead log
+    int  commit_every;              //group commit after this many changes
+    int  commit_ms;                 //or once the oldest waited this long
+    bool serve;                     //run as a server (--serve)
+    bool remote;                    //send the command to a server (--connect)
+    int  scan_threads;              //threads for full scans, 0 for one per core
+    int  shards;                    //shards for -z to create, 0 to keep them
+    int  layout;                    //DB_LAYOUT_xxx for -z, -1 to keep it
+    int  pool_pages;                //buffer pool frames, 0 for no pool
+    bool direct_io;                 //buffer pool I/O with O_DIRECT
+    bool stats;                     //report what the command cost (-S)
+    const char *stats_file;         //as JSON to this file, NULL for stderr
+    int  sort_key;                  //SDB_SORT_xxx order for -p
+    int  sort_kb;                   //memory the sort may use, in KB
+} sdb_config_t;
+
+//orders -p can print in (--sort=), see sdb_sort.c.  Ties go to the other
+//name, then the id, like the last name index
+#define SDB_SORT_NONE       0       //slot order
+#define SDB_SORT_LNAME      1       //last name, first name, id
+#define SDB_SORT_FNAME      2       //first name, last name, id
+#define SDB_SORT_GPA        3       //gpa, id, like -g
+
+#define SORT_MEM_KB         16384   //--sort-mem default, 256K records
+#define SORT_MERGE_WAY      16      //runs merged at a time
+
+//what a command cost, see sdb_stats.c.  sdb_stats holds the totals the
+//storage engine counts as it goes, every field is a uint64_t
+typedef struct sdb_counters {
+    uint64_t read_syscalls;         //read type syscalls (/proc/self/io)
+    uint64_t write_syscalls;        //write type syscalls
+    uint64_t bytes_read;            //bytes read through syscalls
+    uint64_t bytes_written;         //bytes written through syscalls
+    uint64_t records_scanned;       //slots looked at by scans
+    uint64_t records_read;          //records read one at a time
+    uint64_t records_written;       //records written
+    uint64_t syncs;                 //fsync, fdatasync and msync calls
+    uint64_t sync_us;               //time spent in them
+    uint64_t wall_us;               //wall clock time
+    uint64_t user_us;               //user CPU time
+    uint64_t sys_us;                //system CPU time
+} sdb_counters_t;
+
+extern sdb_counters_t sdb_stats;
+
+#define SDB_COUNT(field, n) \
+    __atomic_add_fetch(&sdb_stats.field, (uint64_t)(n), __ATOMIC_RELAXED)
+
+//most shards a sharded database can have, each holds MAX_STD_ID ids
+#define SHARD_MAX   8
+
+//sdbsc --serve protocol, see sdb_server.c.  Every request is one
+//srv_request_t, every reply a srv_reply_t followed by count records.
+#define SRV_OP_ADD      1
+#define SRV_OP_GET      2
+#define SRV_OP_DEL      3
+#define SRV_OP_COUNT    4
+#define SRV_OP_PRINT    5
+#define SRV_OP_UPDATE   6
+
+//most records sent in one reply, 64KB
+#define SRV_BATCH_RECORDS   1024
+
+typedef struct srv_request {
+    uint32_t op;                    //SRV_OP_xxx
+    int32_t  id;                    //student id (add, get, del, update)
+    int32_t  gpa;                   //gpa (add, update)
+    char     fname[24];             //names (add, update), NUL terminated
+    char     lname[32];
+} srv_request_t;
+
+typedef struct srv_reply {
+    int32_t  rc;                    //status, NO_ERROR or an error code
+    uint32_t count;                 //records following the header
+    uint32_t more;                  //another reply follows
+    uint32_t total;                 //students in the database (count)
+} srv_reply_t;
+
+//background compaction starts once at least SDB_DEAD_MIN_SLOTS deleted
+//slots hold storage and they make up SDB_DEAD_RATIO_PCT percent of all
+//allocated slots.  One file system block worth of records is the least
+//that can be given back.
+#define SDB_DEAD_RATIO_PCT  25
+#define SDB_DEAD_MIN_SLOTS  64
+
+//id locked with db_lock_records() to guard what the sidecars share between
+//all students, one past the last student of any layout so it never locks
+//a record
+#define SDB_LOCK_META       (HASH_MAX_STD_ID + 1)
+
+extern sdb_config_t sdb_config;
+
+//callback for db_scan(), called for every non empty record.  Returning
+//anything but NO_ERROR stops the scan and is passed back to the caller
+typedef int (*db_scan_fn)(const student_t *s, off_t slot, void *arg);
+
+//merge callback for db_scan_parallel(), called once per range in slot
+//order with the part the scan callback filled in for that range
+typedef void (*db_merge_fn)(void *part, void *arg);
+
+sdb_ctx_t *db_register(int fd, const char *path);
+sdb_ctx_t *db_ctx(int fd);
+void db_unregister(int fd);
+int db_sidecar_path(const char *path, const char *suffix, char *out);
+void db_remove_sidecars(const char *path);
+int db_read_slot(int fd, off_t slot, student_t *s);
+int db_write_slot(int fd, off_t slot, const student_t *s);
+int db_find(int fd, int id, off_t *slot, student_t *s);
+int db_alloc_slot(int fd, int id, int n, off_t *slot);
+int db_index_set(int fd, int id, off_t slot);
+int db_index_build(int fd, const char *idx_path);
+int db_stamp(int fd, sdb_stamp_t *stamp);
+bool db_stamp_matches(int fd, const sdb_stamp_t *stamp);
+void db_change_begin(int fd);
+void db_change_record(int fd, const student_t *old, const student_t *now);
+void db_change_commit(int fd);
+int db_scan(int fd, db_scan_fn fn, void *arg);
+int db_scan_parallel(int fd, db_scan_fn fn, db_merge_fn merge, size_t part_size,
+                     void *arg);
+
+int db_shards_create(const char *path, int n);
+int db_shards_open(const char *path, bool truncate);
+bool db_shards_close(int fd);
+bool db_sharded(int fd);
+int db_shard(int fd, int id, int *base);
+int db_shard_max_id(void);
+int db_max_id(void);
+int db_shard_count(int fd);
+int db_shard_scan(int fd, db_scan_fn fn, db_merge_fn merge, size_t part_size,
+                  void *arg);
+int db_shard_visit(int fd, db_scan_fn fn, void *arg);
+int db_sort_scan(int fd, int key, db_scan_fn fn, void *arg);
+int db_hash_create(const char *path);
+bool db_hash_exists(const char *path);
+int db_hash_open(sdb_ctx_t *ctx);
+void db_hash_close(sdb_ctx_t *ctx);
+bool db_hashed(int fd);
+int db_hash_find(sdb_ctx_t *ctx, int fd, int id, off_t *slot, student_t *s);
+bool db_hash_owns(const sdb_ctx_t *ctx, int id, off_t slot);
+int db_hash_alloc(sdb_ctx_t *ctx, int fd, int id, off_t *slot);
+int db_dict_create(const char *path);
+bool db_dict_exists(const char *path);
+int db_dict_open(sdb_ctx_t *ctx);
+void db_dict_close(sdb_ctx_t *ctx);
+bool db_dict_encoded(int fd);
+int db_dict_sync(sdb_ctx_t *ctx);
+void db_dict_decode(const sdb_ctx_t *ctx, const compact_rec_t *rec, student_t *s);
+int db_dict_read(sdb_ctx_t *ctx, int fd, off_t slot, student_t *s);
+int db_dict_write(sdb_ctx_t *ctx, int fd, off_t slot, const student_t *s);
+bool db_pool_enabled(const sdb_ctx_t *ctx);
+int db_pool_read(sdb_ctx_t *ctx, off_t slot, student_t *s);
+int db_pool_write(sdb_ctx_t *ctx, off_t slot, const student_t *s);
+int db_pool_flush(sdb_ctx_t *ctx);
+void db_pool_committed(sdb_ctx_t *ctx);
+void db_pool_close(sdb_ctx_t *ctx);
+void db_stats_phase(const char *name);
+int db_stats_report(const char *op);
+int db_fsync(int fd, bool data_only);
+int db_msync(void *addr, size_t len, int flags);
+int db_sync(int fd, bool force);
+int db_lock(int fd, bool exclusive);
+void db_unlock(int fd);
+int db_lock_records(int fd, int id, int n, bool exclusive);
+void db_unlock_records(int fd, int id, int n);
+int db_replace_empty(const char *path);
+int db_restore(const char *path, int src);
+int db_clone(int src, int dst);
+int db_punch_block(int fd, off_t slot);
+int db_compact(int fd);
+bool db_compact_needed(int fd);
+void db_compact_background(int fd);
+
+int db_bitmap_open(sdb_ctx_t *ctx);
+void db_bitmap_close(sdb_ctx_t *ctx);
+bool db_bitmap_test(int fd, int id, bool *present);
+int db_bitmap_count(int fd);
+void db_bitmap_begin(int fd);
+void db_bitmap_set(int fd, int id, bool present);
+void db_bitmap_commit(int fd);
+void db_bitmap_restamp(int fd, int stamp_fd);
+void db_bitmap_add_dead(int fd, int delta);
+void db_bitmap_clear_dead(int fd);
+int db_bitmap_dead(int fd);
+
+int db_gpa_open(sdb_ctx_t *ctx);
+void db_gpa_close(sdb_ctx_t *ctx);
+void db_gpa_begin(int fd);
+void db_gpa_set(int fd, int id, int gpa, bool present);
+void db_gpa_commit(int fd);
+void db_gpa_restamp(int fd, int stamp_fd);
+int db_gpa_histogram(int fd, uint32_t *hist);
+int db_gpa_scan(int fd, int lo, int hi, bool high_first, int limit,
+                db_scan_fn fn, void *arg);
+
+int db_col_open(sdb_ctx_t *ctx);
+void db_col_close(sdb_ctx_t *ctx);
+void db_col_begin(int fd);
+void db_col_set(int fd, int id, int gpa, bool present);
+void db_col_commit(int fd);
+void db_col_restamp(int fd, int stamp_fd);
+int db_col_query(int fd, const col_pred_t *p, col_agg_t *agg, db_scan_fn fn, void *arg);
+
+int db_names_open(sdb_ctx_t *ctx);
+void db_names_close(sdb_ctx_t *ctx);
+void db_names_begin(int fd);
+void db_names_insert(int fd, const student_t *s);
+void db_names_remove(int fd, const student_t *s);
+void db_names_commit(int fd);
+void db_names_rebuild(int fd);
+int db_names_scan(int fd, const char *prefix, db_scan_fn fn, void *arg);
+
+int db_query_compile(const char *text, sdb_query_t *q, const char **err);
+bool db_query_match(const sdb_query_t *q, const student_t *s);
+
+int wal_open(sdb_ctx_t *ctx);
+void wal_close(sdb_ctx_t *ctx);
+int wal_append(int fd, int op, int id, off_t slot, const student_t *image);
+int wal_commit(int fd, bool force);
+int wal_checkpoint(int fd);
+
+//sidecar files live next to the database file and are named
+//.<db file name><suffix>, for example .student.db.idx
+#define IDX_SIDECAR     ".idx"          //id->slot index for packed files
+#define BMP_SIDECAR     ".bmp"          //occupancy bitmap
+#define WAL_SIDECAR     ".wal"          //write-ahead log
+#define NAME_SIDECAR    ".name"         //last name index
+#define GPA_SIDECAR     ".gpa"          //GPA histogram and buckets
+#define COL_SIDECAR     ".col"          //id and GPA columns
+#define SOCK_SIDECAR    ".sock"         //sdbsc --serve socket
+#define SHARD_SIDECAR   ".shards"       //shard manifest, see sdb_shard.c
+#define HASH_SIDECAR    ".hash"         //hash directory, see sdb_hash.c
+#define DICT_SIDECAR    ".dict"         //name dictionary, see sdb_dict.c
+#define DICT_ALT_SIDECAR ".dict.1"      //the other name dictionary
+#define TMP_SIDECAR     ".tmp"          //suffix for files being rebuilt
+
+//the index stores slot+1 for every id, 0 marks an id that is not present.
+//Entry 0 (id 0 is never valid) holds the inode number of the database file
+//the index was built for, so an index left behind by a removed database is
+//recognised as stale.
+#define IDX_FILE_SIZE   ((MAX_STD_ID + 1) * (off_t)sizeof(uint32_t))
 
 //error codes to be returned from individual functions
 // NO_ERROR is returned if there are no errors
@@ -47,12 +627,41 @@ void usage(char *);
 
 #define M_STD_ADDED       "Student %d added to database.\n"
 #define M_STD_DEL_MSG     "Student %d was deleted from database.\n"
+#define M_STD_UPDATED     "Student %d updated in database.\n"
 #define M_STD_NOT_FND_MSG "Student %d was not found in database.\n"
+#define M_ERR_MGET_ID     "Cant look up %s, it is not a student id\n"
+#define M_NAME_NOT_FND    "No students with a last name starting with %s in database.\n"
+#define M_GPA_NOT_FND     "No students with a GPA between %.2f and %.2f in database.\n"
+#define M_AGG_NOT_FND     "No students matched the filter.\n"
+#define M_ERR_QUERY       "Cant parse the query at: %s\n"
 #define M_DB_COMPRESSED_OK "Database successfully compressed!\n"
+#define M_DB_CONVERTED_OK "Database converted to the %s layout!\n"
+#define M_ERR_LAYOUT      "Cant convert to %s, use compact or direct\n"
 #define M_DB_ZERO_OK      "All database records removed!\n"
 #define M_DB_EMPTY        "Database contains no student records.\n"
 #define M_DB_RECORD_CNT   "Database contains %d student record(s).\n"
+#define M_GPA_STATS       "GPA of %d student(s): avg %.2f min %.2f p25 %.2f median %.2f p75 %.2f p90 %.2f max %.2f\n"
+#define M_GPA_AGG         "%d student(s) matched: avg %.2f min %.2f max %.2f\n"
+#define M_SNAP_OK         "Snapshot of database written to %s.\n"
+#define M_SNAP_RESTORED   "Database restored from snapshot %s.\n"
+#define M_ERR_SNAP_OPEN   "Error opening snapshot %s, exiting!\n"
+#define M_ERR_SNAP_BAD    "Cant use %s as a snapshot, it is the database or not a database file\n"
+#define M_ERR_EXPORT_FMT  "Cant export as %s, use csv, jsonl or bin\n"
+#define M_ERR_GPA_RNG     "Cant search GPA range, bounds out of allowable range!\n"
+#define M_SRV_READY       "Serving %s on %s\n"
+#define M_ERR_SRV_SOCK    "Error creating server socket %s, exiting!\n"
+#define M_ERR_SRV_CONNECT "Cant connect to the sdbsc server, is sdbsc --serve running?\n"
+#define M_ERR_HASH_OPT    "Option %s is not available on a hashed database\n"
+#define M_ERR_COMPACT_OPT "Option %s is not available on a compact database\n"
+#define M_ERR_SHARD_OPT   "Option %s is not available on a sharded database\n"
+#define M_ERR_SRV_OPT     "Option %s is not available through the sdbsc server\n"
+#define M_STATS_PHASE     "stats %-6s wall %.3fms user %.3fms sys %.3fms reads %llu (%llu bytes) writes %llu (%llu bytes) scanned %llu read %llu written %llu syncs %llu (%.3fms)\n"
+#define M_ERR_STATS_FILE  "Error writing stats file %s\n"
 #define M_NOT_IMPL        "The requested operation is not implemented yet!\n"
+#define M_LOAD_OK         "%d student(s) loaded into database.\n"
+#define M_ERR_LOAD_OPEN   "Error opening load file %s, exiting!\n"
+#define M_ERR_LOAD_LINE   "Cant load line %d of %s, expected id,first_name,last_name,gpa\n"
+#define M_ERR_LOAD_RNG    "Cant load student with ID=%d, either ID or GPA out of allowable range!\n"
 
 //useful format strings for print students
 //For example to print the header in the required output:
@@ -61,4 +670,7 @@ void usage(char *);
 #define  STUDENT_PRINT_HDR_STRING   "%-6s %-24s %-32s %-3s\n"
 #define  STUDENT_PRINT_FMT_STRING   "%-6d %-24.24s %-32.32s %-3.2f\n"
 
+//room for one line of STUDENT_PRINT_FMT_STRING
+#define  PRINT_LINE_MAX             128
+
 #endif